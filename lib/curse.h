@@ -8,34 +8,102 @@
 
 #include <iostream>
 #include <utility>
+#include <algorithm>
 #include <vector>
 #include <array>
+#include <span>
+#include <initializer_list>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <tuple>
 #include <limits>
+#include <cmath>
+#include <chrono>
 #include <cassert>
+#include <cstdint>
 #include <csignal>
 #include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <type_traits>
+
+#if defined (__x86_64__) || defined (__i386__)
+#define CURSE_IS_X86
+
+#include <immintrin.h>
+#endif
 
 
-namespace curse
-{
-
 #if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__))
 #define CURSE_IS_POSIX
 
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 
+namespace curse
+{
+
+
+// Decimal digits of every SGR parameter up to 255, built at compile time
+struct SGRDigits
+{
+    char len;
+    char str[3];
+
+    [[nodiscard]] constexpr std::string_view view() const { return {str, static_cast<std::size_t>(len)}; }
+};
+
+constexpr std::array<SGRDigits, 256> make_sgr_digits()
+{
+    std::array<SGRDigits, 256> table{};
+    for (int i = 0; i < 256; i++)
+    {
+        SGRDigits& d = table[i];
+        if (i >= 100)
+            d = {3, {char('0' + i / 100), char('0' + i / 10 % 10), char('0' + i % 10)}};
+        else if (i >= 10)
+            d = {2, {char('0' + i / 10), char('0' + i % 10), '\0'}};
+        else
+            d = {1, {char('0' + i), '\0', '\0'}};
+    }
+    return table;
+}
+
+static constexpr std::array<SGRDigits, 256> sgr_digits = make_sgr_digits();
+
+// std::string with the put() interface of FrameBuffer, for building sequences outside of a frame
+struct FrameBufferAdapter
+{
+    std::string str;
+
+    void put(std::string_view s) { str.append(s); }
+};
+
+
 // ANSIColor class for handling ANSI color codes
 class ANSIColor
 {
 public:
-    enum class FG : int
+    enum class FG : std::uint8_t
     {
         Default = 39,
         Black = 30,
@@ -57,7 +125,7 @@ public:
         None = 0
     };
 
-    enum class BG : int
+    enum class BG : std::uint8_t
     {
         Default = 49,
         Black = 40,
@@ -81,24 +149,34 @@ public:
 
     constexpr explicit ANSIColor(FG fg = FG::None, BG bg = BG::None) : _fg(fg), _bg(bg) {}
 
+    // Trivially copyable, so cell buffers can be filled and compared as plain memory
     constexpr ANSIColor(const ANSIColor& other) = default;
-
-    constexpr ANSIColor(ANSIColor&& other) noexcept : _fg(other._fg), _bg(other._bg) {}
-
+    constexpr ANSIColor(ANSIColor&& other) noexcept = default;
     ANSIColor& operator=(const ANSIColor& other) = default;
+    ANSIColor& operator=(ANSIColor&& other) noexcept = default;
 
-    ANSIColor& operator=(ANSIColor&& other) noexcept
+    [[nodiscard]] std::string code() const
     {
-        _fg = other._fg;
-        _bg = other._bg;
-        return *this;
+        std::string res;
+        write_sgr(res);
+        return res;
     }
 
-    [[nodiscard]] std::string code() const
+    // Append the SGR sequence to any buffer with put(char) or push_back(char). Digits come from the
+    // compile-time table, so nothing is allocated here
+    template<class TBuf>
+    void write_sgr(TBuf& out) const
     {
-        std::ostringstream oss;
-        oss << "\033[" << static_cast<int>(_fg) << ";" << static_cast<int>(_bg) << "m";
-        return oss.str();
+        auto put = [&](std::string_view s)
+        {
+            if constexpr (requires { out.put(s); }) out.put(s);
+            else out.append(s);
+        };
+        put("\033[");
+        put(sgr_digits[static_cast<int>(_fg)].view());
+        put(";");
+        put(sgr_digits[static_cast<int>(_bg)].view());
+        put("m");
     }
 
     static constexpr std::string reset() { return "\033[0m"; }
@@ -145,6 +223,281 @@ private:
 };
 
 
+// Color depth a terminal accepts. Colors with more detail are quantized when they are encoded
+enum class ColorDepth : std::uint8_t
+{
+    ANSI16,
+    Indexed256,
+    TrueColor
+};
+
+// Guess the depth from the environment: COLORTERM=truecolor|24bit, or a TERM with 256color in it
+inline ColorDepth detect_color_depth()
+{
+    const char* colorterm = std::getenv("COLORTERM");
+    if (colorterm && (std::strcmp(colorterm, "truecolor") == 0 || std::strcmp(colorterm, "24bit") == 0))
+        return ColorDepth::TrueColor;
+    const char* term = std::getenv("TERM");
+    if (term && std::strstr(term, "256color"))
+        return ColorDepth::Indexed256;
+    return ColorDepth::ANSI16;
+}
+
+// RGB of an entry of the xterm 256 color palette, 0xRRGGBB
+constexpr std::uint32_t xterm_rgb(int index)
+{
+    constexpr std::uint32_t base[16] = {
+        0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+        0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+    };
+    if (index < 16)
+        return base[index];
+    if (index < 232)
+    {
+        auto level = [](int v) { return static_cast<std::uint32_t>(v ? 55 + v * 40 : 0); };
+        int i = index - 16;
+        return (level(i / 36) << 16) | (level(i / 6 % 6) << 8) | level(i % 6);
+    }
+    auto gray = static_cast<std::uint32_t>(8 + (index - 232) * 10);
+    return (gray << 16) | (gray << 8) | gray;
+}
+
+constexpr int rgb_distance(std::uint32_t a, std::uint32_t b)
+{
+    int dr = int(a >> 16 & 0xff) - int(b >> 16 & 0xff);
+    int dg = int(a >> 8 & 0xff) - int(b >> 8 & 0xff);
+    int db = int(a & 0xff) - int(b & 0xff);
+    return dr * dr + dg * dg + db * db;
+}
+
+// Nearest entry of the 6x6x6 cube or the gray ramp of the xterm palette
+constexpr int rgb_to_256(std::uint32_t rgb)
+{
+    auto step = [](int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+    int r = int(rgb >> 16 & 0xff), g = int(rgb >> 8 & 0xff), b = int(rgb & 0xff);
+    int cube = 16 + 36 * step(r) + 6 * step(g) + step(b);
+
+    int avg = (r + g + b) / 3;
+    int gray = avg > 238 ? 255 : 232 + std::max(0, (avg - 3) / 10);
+    return rgb_distance(rgb, xterm_rgb(gray)) < rgb_distance(rgb, xterm_rgb(cube)) ? gray : cube;
+}
+
+// Nearest of the 16 basic colors
+constexpr int rgb_to_16(std::uint32_t rgb)
+{
+    int best = 0;
+    for (int i = 1; i < 16; i++)
+        if (rgb_distance(rgb, xterm_rgb(i)) < rgb_distance(rgb, xterm_rgb(best)))
+            best = i;
+    return best;
+}
+
+// SGR parameters of a palette index for the depth, without the surrounding ESC [ and m
+template<class TBuf>
+void put_indexed_sgr(TBuf& out, int index, bool background, ColorDepth depth)
+{
+    if (depth == ColorDepth::ANSI16)
+    {
+        if (index >= 16)
+            index = rgb_to_16(xterm_rgb(index));
+        out.put(sgr_digits[(index < 8 ? 30 + index : 82 + index) + (background ? 10 : 0)].view());
+        return;
+    }
+    out.put(background ? "48;5;" : "38;5;");
+    out.put(sgr_digits[index].view());
+}
+
+
+// Color from the 256 color xterm palette. Fits in 3 bytes, with a flag for each unset layer
+class IndexedColor
+{
+public:
+    constexpr IndexedColor() = default;
+    constexpr explicit IndexedColor(int fg, int bg = -1)
+        : _fg(static_cast<std::uint8_t>(fg < 0 ? 0 : fg)), _bg(static_cast<std::uint8_t>(bg < 0 ? 0 : bg)),
+          _flags(static_cast<std::uint8_t>((fg < 0 ? fg_none : 0) | (bg < 0 ? bg_none : 0))) {}
+
+    static constexpr IndexedColor None() { return IndexedColor(); }
+    [[nodiscard]] constexpr bool isna() const { return *this == None(); }
+
+    // Palette index, -1 if unset
+    [[nodiscard]] constexpr int fg() const { return (_flags & fg_none) ? -1 : _fg; }
+    [[nodiscard]] constexpr int bg() const { return (_flags & bg_none) ? -1 : _bg; }
+
+    constexpr bool operator==(const IndexedColor& other) const = default;
+
+    // Unset layers are taken from with
+    [[nodiscard]] constexpr IndexedColor blend(const IndexedColor& with) const
+    {
+        return IndexedColor(fg() < 0 ? with.fg() : fg(), bg() < 0 ? with.bg() : bg());
+    }
+
+    // Layers that are set in with replace this color's
+    [[nodiscard]] constexpr IndexedColor overlay(const IndexedColor& with) const
+    {
+        return IndexedColor(with.fg() < 0 ? fg() : with.fg(), with.bg() < 0 ? bg() : with.bg());
+    }
+
+    // Full SGR sequence. Digits come from the compile-time table, nothing is allocated
+    template<class TBuf>
+    void write_sgr(TBuf& out, ColorDepth depth = ColorDepth::Indexed256) const
+    {
+        out.put("\033[");
+        if (fg() < 0) out.put("39");
+        else put_indexed_sgr(out, fg(), false, depth);
+        out.put(";");
+        if (bg() < 0) out.put("49");
+        else put_indexed_sgr(out, bg(), true, depth);
+        out.put("m");
+    }
+
+    [[nodiscard]] std::string code(ColorDepth depth = ColorDepth::Indexed256) const
+    {
+        FrameBufferAdapter buf;
+        write_sgr(buf, depth);
+        return buf.str;
+    }
+
+    static constexpr std::string reset() { return "\033[0m"; }
+
+private:
+    static constexpr std::uint8_t fg_none = 1, bg_none = 2;
+
+    std::uint8_t _fg = 0;
+    std::uint8_t _bg = 0;
+    std::uint8_t _flags = fg_none | bg_none;
+};
+
+
+// 24-bit color. Layers are given as packed 0xRRGGBB values and stored in 7 bytes without padding,
+// so a Cell with a char glyph stays at 8 bytes and can still be compared as raw memory.
+// The SGR sequence of recently used colors is cached per thread
+class TrueColor
+{
+public:
+    static constexpr std::uint32_t none = 0xff000000; // Unset layer
+
+    constexpr TrueColor() = default;
+    constexpr explicit TrueColor(std::uint32_t fg, std::uint32_t bg = none)
+    {
+        set(_fg, fg);
+        set(_bg, bg);
+        _flags = static_cast<std::uint8_t>(((fg & none) ? fg_none : 0) | ((bg & none) ? bg_none : 0));
+    }
+
+    static constexpr TrueColor None() { return TrueColor(); }
+    [[nodiscard]] constexpr bool isna() const { return *this == None(); }
+
+    // Packed 0xRRGGBB, or none
+    [[nodiscard]] constexpr std::uint32_t fg() const { return (_flags & fg_none) ? none : get(_fg); }
+    [[nodiscard]] constexpr std::uint32_t bg() const { return (_flags & bg_none) ? none : get(_bg); }
+
+    constexpr bool operator==(const TrueColor& other) const = default;
+
+    // Unset layers are taken from with
+    [[nodiscard]] constexpr TrueColor blend(const TrueColor& with) const
+    {
+        return TrueColor((_flags & fg_none) ? with.fg() : fg(), (_flags & bg_none) ? with.bg() : bg());
+    }
+
+    // Layers that are set in with replace this color's
+    [[nodiscard]] constexpr TrueColor overlay(const TrueColor& with) const
+    {
+        return TrueColor((with._flags & fg_none) ? fg() : with.fg(), (with._flags & bg_none) ? bg() : with.bg());
+    }
+
+    // Full SGR sequence, quantized to the depth. Built once per color and depth, then copied from the cache
+    template<class TBuf>
+    void write_sgr(TBuf& out, ColorDepth depth = ColorDepth::TrueColor) const
+    {
+        struct Slot
+        {
+            std::uint64_t key = ~0ull;
+            std::uint8_t len = 0;
+            char seq[39];
+        };
+        thread_local std::array<Slot, 256> cache;
+
+        std::uint64_t key = packed() | (static_cast<std::uint64_t>(depth) << 56);
+        Slot& slot = cache[(key * 0x9e3779b97f4a7c15ull) >> 56];
+        if (slot.key != key)
+        {
+            FrameBufferAdapter buf;
+            buf.put("\033[");
+            put_layer(buf, fg(), false, depth);
+            buf.put(";");
+            put_layer(buf, bg(), true, depth);
+            buf.put("m");
+            std::memcpy(slot.seq, buf.str.data(), buf.str.size());
+            slot.len = static_cast<std::uint8_t>(buf.str.size());
+            slot.key = key;
+        }
+        out.put(std::string_view(slot.seq, slot.len));
+    }
+
+    [[nodiscard]] std::string code(ColorDepth depth = ColorDepth::TrueColor) const
+    {
+        FrameBufferAdapter buf;
+        write_sgr(buf, depth);
+        return buf.str;
+    }
+
+    static constexpr std::string reset() { return "\033[0m"; }
+
+private:
+    static constexpr std::uint8_t fg_none = 1, bg_none = 2;
+
+    static constexpr void set(std::array<std::uint8_t, 3>& c, std::uint32_t rgb)
+    {
+        if (rgb & none) rgb = 0; // Unset layers are all zero, so equal colors have equal bytes
+        c = {static_cast<std::uint8_t>(rgb >> 16), static_cast<std::uint8_t>(rgb >> 8), static_cast<std::uint8_t>(rgb)};
+    }
+
+    static constexpr std::uint32_t get(const std::array<std::uint8_t, 3>& c)
+    {
+        return (std::uint32_t(c[0]) << 16) | (std::uint32_t(c[1]) << 8) | c[2];
+    }
+
+    [[nodiscard]] constexpr std::uint64_t packed() const
+    {
+        return (std::uint64_t(get(_fg)) << 24) | get(_bg) | (std::uint64_t(_flags) << 48);
+    }
+
+    template<class TBuf>
+    static void put_layer(TBuf& out, std::uint32_t rgb, bool background, ColorDepth depth)
+    {
+        if (rgb & none)
+        {
+            out.put(background ? "49" : "39");
+            return;
+        }
+        switch (depth)
+        {
+        case ColorDepth::TrueColor:
+            out.put(background ? "48;2;" : "38;2;");
+            out.put(sgr_digits[rgb >> 16 & 0xff].view());
+            out.put(";");
+            out.put(sgr_digits[rgb >> 8 & 0xff].view());
+            out.put(";");
+            out.put(sgr_digits[rgb & 0xff].view());
+            break;
+        case ColorDepth::Indexed256:
+            put_indexed_sgr(out, rgb_to_256(rgb), background, depth);
+            break;
+        case ColorDepth::ANSI16:
+            put_indexed_sgr(out, rgb_to_16(rgb), background, depth);
+            break;
+        }
+    }
+
+    std::array<std::uint8_t, 3> _fg{};
+    std::array<std::uint8_t, 3> _bg{};
+    std::uint8_t _flags = fg_none | bg_none;
+};
+
+static_assert(sizeof(TrueColor) == 7 && sizeof(IndexedColor) == 3, "Colors must stay packed");
+
+
 enum class Colors : int
 {
     Primary,   // Main color
@@ -194,19 +547,41 @@ enum class WidgetLayout
     Horizontal, // Use margin and padding to position children
     Vertical, // ditto
     Floating, // Use widgets _xy to position
-    Text // Just text (std::string), no children
+    Text, // Just text (std::string), no children
+    List // Rows of a ListView, only the visible ones are fetched. No children
 };
 
+// Border glyphs as code points. Byte cells can't hold box drawing characters, they get the ASCII look-alike
 class __attribute__((packed)) BoxStyle
 {
 public:
-    char tl='\0', tr='\0', bl='\0', br='\0', hline='\0', vline='\0';
+    char32_t tl=0, tr=0, bl=0, br=0, hline=0, vline=0;
 
-    constexpr BoxStyle(char tl_i, char tr_i, char bl_i, char br_i, char hline_i, char vline_i) : tl(tl_i), tr(tr_i), bl(bl_i), br(br_i), hline(hline_i), vline(vline_i) {}
+    constexpr BoxStyle(char32_t tl_i, char32_t tr_i, char32_t bl_i, char32_t br_i, char32_t hline_i, char32_t vline_i)
+        : tl(tl_i), tr(tr_i), bl(bl_i), br(br_i), hline(hline_i), vline(vline_i) {}
 
-    constexpr BoxStyle(int tl_i, int tr_i, int bl_i, int br_i, int hline_i, int vline_i) : tl(tl_i), tr(tr_i), bl(bl_i), br(br_i), hline(hline_i), vline(vline_i) {}
+    [[nodiscard]] bool isna() const { return tl == 0; }
 
-    [[nodiscard]] bool isna() const { return tl == '\0'; }
+    // Border glyph for the cell type
+    template<class TChar>
+    [[nodiscard]] static constexpr TChar glyph(char32_t g)
+    {
+        if constexpr (sizeof(TChar) == 1)
+        {
+            if (g < 0x80) return static_cast<TChar>(g);
+            switch (g)
+            {
+            case U'─': case U'━': return '-';
+            case U'│': case U'┃': return '|';
+            case U'═': return '=';
+            case U'║': return 'H';
+            case U'╔': case U'╗': case U'╚': case U'╝': return '#';
+            default: return '+';
+            }
+        }
+        else
+            return static_cast<TChar>(g);
+    }
 };
 
 // Symbolic borders
@@ -216,8 +591,10 @@ static constexpr BoxStyle SingleBoxStyle{'+', '+', '+', '+', '-', '|'};
 static constexpr BoxStyle DoubleBoxStyle{'#', '#', '#', '#', '=', 'H'};
 
 // Box-drawing borders
-//static constexpr BoxStyle SingleBoxStyleDOS{0xda, 0xbf, 0xc0, 0xd9, 0xc4, 0xb3};
-//static constexpr BoxStyle DoubleBoxStyleDOS{'╔', '╗', '╚', '╝', '═', '║'};
+static constexpr BoxStyle SingleBoxStyleDOS {U'┌', U'┐', U'└', U'┘', U'─', U'│'};
+static constexpr BoxStyle DoubleBoxStyleDOS {U'╔', U'╗', U'╚', U'╝', U'═', U'║'};
+static constexpr BoxStyle RoundedBoxStyle   {U'╭', U'╮', U'╰', U'╯', U'─', U'│'};
+static constexpr BoxStyle HeavyBoxStyle     {U'┏', U'┓', U'┗', U'┛', U'━', U'┃'};
 
 // TODO fix shadow rendering
 enum class ShadowStyle
@@ -246,6 +623,7 @@ public:
 
     // Access quad as a native tuple object. No overhead
     std::tuple<int, int, int, int>& tup() { return static_cast<std::tuple<int, int, int, int>&>(*this); }
+    const std::tuple<int, int, int, int>& tup() const { return static_cast<const std::tuple<int, int, int, int>&>(*this); }
 
     // Operators overload
     Quad& operator+=(const Quad& rhs) { l() += rhs.l(); t() += rhs.t(); r() += rhs.r(); b() += rhs.b(); return *this; }
@@ -279,10 +657,10 @@ public:
     std::pair<int, int>& pair() { return static_cast<std::pair<int, int>&>(*this); }
 
     // Operators overload
-    friend Point operator+(const Point& lhs, const Point& rhs) { Point res; res.x() += rhs.x(); res.y() += rhs.y(); return res; }
-    friend Point operator-(const Point& lhs, const Point& rhs) { Point res; res.x() -= rhs.x(); res.y() -= rhs.y(); return res; }
-    friend Point operator*(const Point& lhs, const Point& rhs) { Point res; res.x() *= rhs.x(); res.y() *= rhs.y(); return res; }
-    friend Point operator/(const Point& lhs, const Point& rhs) { Point res; res.x() /= rhs.x(); res.y() /= rhs.y(); return res; }
+    friend Point operator+(const Point& lhs, const Point& rhs) { Point res = lhs; res.x() += rhs.x(); res.y() += rhs.y(); return res; }
+    friend Point operator-(const Point& lhs, const Point& rhs) { Point res = lhs; res.x() -= rhs.x(); res.y() -= rhs.y(); return res; }
+    friend Point operator*(const Point& lhs, const Point& rhs) { Point res = lhs; res.x() *= rhs.x(); res.y() *= rhs.y(); return res; }
+    friend Point operator/(const Point& lhs, const Point& rhs) { Point res = lhs; res.x() /= rhs.x(); res.y() /= rhs.y(); return res; }
 
     Point& operator+=(const Point& rhs) { x() += rhs.x(); y() += rhs.y(); return *this; }
     Point& operator-=(const Point& rhs) { x() -= rhs.x(); y() -= rhs.y(); return *this; }
@@ -295,906 +673,5007 @@ public:
 };
 
 
-// Event types for user interaction
-enum class EventType
+// Display width of code points. Ranges of width 0 (combining marks, format characters, Hangul medial
+// vowels) and 2 (East Asian Wide and Fullwidth) from the Unicode 14 data, everything else is 1
+struct WidthRange
 {
-    None,
-    Select,
-    Click, // KeyDown
-    ArrowUp,
-    ArrowDown,
-    ArrowLeft,
-    ArrowRight,
-    OnCreate,
-    OnDestroy
+    char32_t lo, hi;
+    std::uint8_t width;
 };
 
-struct IPEvent
-{
-    EventType type;
-    int key; // For Click, can be ASCII or special key code
-    explicit IPEvent(EventType t = EventType::None, int k = 0) : type(t), key(k) {}
+inline constexpr WidthRange width_ranges[] = {
+    {0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0}, {0x05BF, 0x05BF, 0}, {0x05C1, 0x05C2, 0}, {0x05C4, 0x05C5, 0},
+    {0x05C7, 0x05C7, 0}, {0x0600, 0x0605, 0}, {0x0610, 0x061A, 0}, {0x061C, 0x061C, 0}, {0x064B, 0x065F, 0}, {0x0670, 0x0670, 0},
+    {0x06D6, 0x06DD, 0}, {0x06DF, 0x06E4, 0}, {0x06E7, 0x06E8, 0}, {0x06EA, 0x06ED, 0}, {0x070F, 0x070F, 0}, {0x0711, 0x0711, 0},
+    {0x0730, 0x074A, 0}, {0x07A6, 0x07B0, 0}, {0x07EB, 0x07F3, 0}, {0x07FD, 0x07FD, 0}, {0x0816, 0x0819, 0}, {0x081B, 0x0823, 0},
+    {0x0825, 0x0827, 0}, {0x0829, 0x082D, 0}, {0x0859, 0x085B, 0}, {0x0890, 0x089F, 0}, {0x08CA, 0x0902, 0}, {0x093A, 0x093A, 0},
+    {0x093C, 0x093C, 0}, {0x0941, 0x0948, 0}, {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0}, {0x0981, 0x0981, 0},
+    {0x09BC, 0x09BC, 0}, {0x09C1, 0x09C4, 0}, {0x09CD, 0x09CD, 0}, {0x09E2, 0x09E3, 0}, {0x09FE, 0x0A02, 0}, {0x0A3C, 0x0A3C, 0},
+    {0x0A41, 0x0A51, 0}, {0x0A70, 0x0A71, 0}, {0x0A75, 0x0A75, 0}, {0x0A81, 0x0A82, 0}, {0x0ABC, 0x0ABC, 0}, {0x0AC1, 0x0AC8, 0},
+    {0x0ACD, 0x0ACD, 0}, {0x0AE2, 0x0AE3, 0}, {0x0AFA, 0x0B01, 0}, {0x0B3C, 0x0B3C, 0}, {0x0B3F, 0x0B3F, 0}, {0x0B41, 0x0B44, 0},
+    {0x0B4D, 0x0B56, 0}, {0x0B62, 0x0B63, 0}, {0x0B82, 0x0B82, 0}, {0x0BC0, 0x0BC0, 0}, {0x0BCD, 0x0BCD, 0}, {0x0C00, 0x0C00, 0},
+    {0x0C04, 0x0C04, 0}, {0x0C3C, 0x0C3C, 0}, {0x0C3E, 0x0C40, 0}, {0x0C46, 0x0C56, 0}, {0x0C62, 0x0C63, 0}, {0x0C81, 0x0C81, 0},
+    {0x0CBC, 0x0CBC, 0}, {0x0CBF, 0x0CBF, 0}, {0x0CC6, 0x0CC6, 0}, {0x0CCC, 0x0CCD, 0}, {0x0CE2, 0x0CE3, 0}, {0x0D00, 0x0D01, 0},
+    {0x0D3B, 0x0D3C, 0}, {0x0D41, 0x0D44, 0}, {0x0D4D, 0x0D4D, 0}, {0x0D62, 0x0D63, 0}, {0x0D81, 0x0D81, 0}, {0x0DCA, 0x0DCA, 0},
+    {0x0DD2, 0x0DD6, 0}, {0x0E31, 0x0E31, 0}, {0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0}, {0x0EB1, 0x0EB1, 0}, {0x0EB4, 0x0EBC, 0},
+    {0x0EC8, 0x0ECD, 0}, {0x0F18, 0x0F19, 0}, {0x0F35, 0x0F35, 0}, {0x0F37, 0x0F37, 0}, {0x0F39, 0x0F39, 0}, {0x0F71, 0x0F7E, 0},
+    {0x0F80, 0x0F84, 0}, {0x0F86, 0x0F87, 0}, {0x0F8D, 0x0FBC, 0}, {0x0FC6, 0x0FC6, 0}, {0x102D, 0x1030, 0}, {0x1032, 0x1037, 0},
+    {0x1039, 0x103A, 0}, {0x103D, 0x103E, 0}, {0x1058, 0x1059, 0}, {0x105E, 0x1060, 0}, {0x1071, 0x1074, 0}, {0x1082, 0x1082, 0},
+    {0x1085, 0x1086, 0}, {0x108D, 0x108D, 0}, {0x109D, 0x109D, 0}, {0x1100, 0x115F, 2}, {0x1160, 0x11FF, 0}, {0x135D, 0x135F, 0},
+    {0x1712, 0x1714, 0}, {0x1732, 0x1733, 0}, {0x1752, 0x1753, 0}, {0x1772, 0x1773, 0}, {0x17B4, 0x17B5, 0}, {0x17B7, 0x17BD, 0},
+    {0x17C6, 0x17C6, 0}, {0x17C9, 0x17D3, 0}, {0x17DD, 0x17DD, 0}, {0x180B, 0x180F, 0}, {0x1885, 0x1886, 0}, {0x18A9, 0x18A9, 0},
+    {0x1920, 0x1922, 0}, {0x1927, 0x1928, 0}, {0x1932, 0x1932, 0}, {0x1939, 0x193B, 0}, {0x1A17, 0x1A18, 0}, {0x1A1B, 0x1A1B, 0},
+    {0x1A56, 0x1A56, 0}, {0x1A58, 0x1A60, 0}, {0x1A62, 0x1A62, 0}, {0x1A65, 0x1A6C, 0}, {0x1A73, 0x1A7F, 0}, {0x1AB0, 0x1B03, 0},
+    {0x1B34, 0x1B34, 0}, {0x1B36, 0x1B3A, 0}, {0x1B3C, 0x1B3C, 0}, {0x1B42, 0x1B42, 0}, {0x1B6B, 0x1B73, 0}, {0x1B80, 0x1B81, 0},
+    {0x1BA2, 0x1BA5, 0}, {0x1BA8, 0x1BA9, 0}, {0x1BAB, 0x1BAD, 0}, {0x1BE6, 0x1BE6, 0}, {0x1BE8, 0x1BE9, 0}, {0x1BED, 0x1BED, 0},
+    {0x1BEF, 0x1BF1, 0}, {0x1C2C, 0x1C33, 0}, {0x1C36, 0x1C37, 0}, {0x1CD0, 0x1CD2, 0}, {0x1CD4, 0x1CE0, 0}, {0x1CE2, 0x1CE8, 0},
+    {0x1CED, 0x1CED, 0}, {0x1CF4, 0x1CF4, 0}, {0x1CF8, 0x1CF9, 0}, {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0}, {0x202A, 0x202E, 0},
+    {0x2060, 0x206F, 0}, {0x20D0, 0x20F0, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2}, {0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2},
+    {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2}, {0x2614, 0x2615, 2}, {0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2},
+    {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2}, {0x26BD, 0x26BE, 2}, {0x26C4, 0x26C5, 2}, {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2},
+    {0x26EA, 0x26EA, 2}, {0x26F2, 0x26F3, 2}, {0x26F5, 0x26F5, 2}, {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+    {0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2}, {0x274E, 0x274E, 2}, {0x2753, 0x2755, 2}, {0x2757, 0x2757, 2},
+    {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2}, {0x27BF, 0x27BF, 2}, {0x2B1B, 0x2B1C, 2}, {0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2},
+    {0x2CEF, 0x2CF1, 0}, {0x2D7F, 0x2D7F, 0}, {0x2DE0, 0x2DFF, 0}, {0x2E80, 0x3029, 2}, {0x302A, 0x302D, 0}, {0x302E, 0x303E, 2},
+    {0x3041, 0x3096, 2}, {0x3099, 0x309A, 0}, {0x309B, 0x3247, 2}, {0x3250, 0x4DBF, 2}, {0x4E00, 0xA4C6, 2}, {0xA66F, 0xA672, 0},
+    {0xA674, 0xA67D, 0}, {0xA69E, 0xA69F, 0}, {0xA6F0, 0xA6F1, 0}, {0xA802, 0xA802, 0}, {0xA806, 0xA806, 0}, {0xA80B, 0xA80B, 0},
+    {0xA825, 0xA826, 0}, {0xA82C, 0xA82C, 0}, {0xA8C4, 0xA8C5, 0}, {0xA8E0, 0xA8F1, 0}, {0xA8FF, 0xA8FF, 0}, {0xA926, 0xA92D, 0},
+    {0xA947, 0xA951, 0}, {0xA960, 0xA97C, 2}, {0xA980, 0xA982, 0}, {0xA9B3, 0xA9B3, 0}, {0xA9B6, 0xA9B9, 0}, {0xA9BC, 0xA9BD, 0},
+    {0xA9E5, 0xA9E5, 0}, {0xAA29, 0xAA2E, 0}, {0xAA31, 0xAA32, 0}, {0xAA35, 0xAA36, 0}, {0xAA43, 0xAA43, 0}, {0xAA4C, 0xAA4C, 0},
+    {0xAA7C, 0xAA7C, 0}, {0xAAB0, 0xAAB0, 0}, {0xAAB2, 0xAAB4, 0}, {0xAAB7, 0xAAB8, 0}, {0xAABE, 0xAABF, 0}, {0xAAC1, 0xAAC1, 0},
+    {0xAAEC, 0xAAED, 0}, {0xAAF6, 0xAAF6, 0}, {0xABE5, 0xABE5, 0}, {0xABE8, 0xABE8, 0}, {0xABED, 0xABED, 0}, {0xAC00, 0xD7A3, 2},
+    {0xD7B0, 0xD7FB, 0}, {0xF900, 0xFAD9, 2}, {0xFB1E, 0xFB1E, 0}, {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2}, {0xFE20, 0xFE2F, 0},
+    {0xFE30, 0xFE6B, 2}, {0xFEFF, 0xFEFF, 0}, {0xFF01, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2}, {0xFFF9, 0xFFFB, 0}, {0x101FD, 0x101FD, 0},
+    {0x102E0, 0x102E0, 0}, {0x10376, 0x1037A, 0}, {0x10A01, 0x10A0F, 0}, {0x10A38, 0x10A3F, 0}, {0x10AE5, 0x10AE6, 0}, {0x10D24, 0x10D27, 0},
+    {0x10EAB, 0x10EAC, 0}, {0x10F46, 0x10F50, 0}, {0x10F82, 0x10F85, 0}, {0x11001, 0x11001, 0}, {0x11038, 0x11046, 0}, {0x11070, 0x11070, 0},
+    {0x11073, 0x11074, 0}, {0x1107F, 0x11081, 0}, {0x110B3, 0x110B6, 0}, {0x110B9, 0x110BA, 0}, {0x110BD, 0x110BD, 0}, {0x110C2, 0x110CD, 0},
+    {0x11100, 0x11102, 0}, {0x11127, 0x1112B, 0}, {0x1112D, 0x11134, 0}, {0x11173, 0x11173, 0}, {0x11180, 0x11181, 0}, {0x111B6, 0x111BE, 0},
+    {0x111C9, 0x111CC, 0}, {0x111CF, 0x111CF, 0}, {0x1122F, 0x11231, 0}, {0x11234, 0x11234, 0}, {0x11236, 0x11237, 0}, {0x1123E, 0x1123E, 0},
+    {0x112DF, 0x112DF, 0}, {0x112E3, 0x112EA, 0}, {0x11300, 0x11301, 0}, {0x1133B, 0x1133C, 0}, {0x11340, 0x11340, 0}, {0x11366, 0x11374, 0},
+    {0x11438, 0x1143F, 0}, {0x11442, 0x11444, 0}, {0x11446, 0x11446, 0}, {0x1145E, 0x1145E, 0}, {0x114B3, 0x114B8, 0}, {0x114BA, 0x114BA, 0},
+    {0x114BF, 0x114C0, 0}, {0x114C2, 0x114C3, 0}, {0x115B2, 0x115B5, 0}, {0x115BC, 0x115BD, 0}, {0x115BF, 0x115C0, 0}, {0x115DC, 0x115DD, 0},
+    {0x11633, 0x1163A, 0}, {0x1163D, 0x1163D, 0}, {0x1163F, 0x11640, 0}, {0x116AB, 0x116AB, 0}, {0x116AD, 0x116AD, 0}, {0x116B0, 0x116B5, 0},
+    {0x116B7, 0x116B7, 0}, {0x1171D, 0x1171F, 0}, {0x11722, 0x11725, 0}, {0x11727, 0x1172B, 0}, {0x1182F, 0x11837, 0}, {0x11839, 0x1183A, 0},
+    {0x1193B, 0x1193C, 0}, {0x1193E, 0x1193E, 0}, {0x11943, 0x11943, 0}, {0x119D4, 0x119DB, 0}, {0x119E0, 0x119E0, 0}, {0x11A01, 0x11A0A, 0},
+    {0x11A33, 0x11A38, 0}, {0x11A3B, 0x11A3E, 0}, {0x11A47, 0x11A47, 0}, {0x11A51, 0x11A56, 0}, {0x11A59, 0x11A5B, 0}, {0x11A8A, 0x11A96, 0},
+    {0x11A98, 0x11A99, 0}, {0x11C30, 0x11C3D, 0}, {0x11C3F, 0x11C3F, 0}, {0x11C92, 0x11CA7, 0}, {0x11CAA, 0x11CB0, 0}, {0x11CB2, 0x11CB3, 0},
+    {0x11CB5, 0x11CB6, 0}, {0x11D31, 0x11D45, 0}, {0x11D47, 0x11D47, 0}, {0x11D90, 0x11D91, 0}, {0x11D95, 0x11D95, 0}, {0x11D97, 0x11D97, 0},
+    {0x11EF3, 0x11EF4, 0}, {0x13430, 0x13438, 0}, {0x16AF0, 0x16AF4, 0}, {0x16B30, 0x16B36, 0}, {0x16F4F, 0x16F4F, 0}, {0x16F8F, 0x16F92, 0},
+    {0x16FE0, 0x16FE3, 2}, {0x16FE4, 0x16FE4, 0}, {0x16FF0, 0x1B2FB, 2}, {0x1BC9D, 0x1BC9E, 0}, {0x1BCA0, 0x1CF46, 0}, {0x1D167, 0x1D169, 0},
+    {0x1D173, 0x1D182, 0}, {0x1D185, 0x1D18B, 0}, {0x1D1AA, 0x1D1AD, 0}, {0x1D242, 0x1D244, 0}, {0x1DA00, 0x1DA36, 0}, {0x1DA3B, 0x1DA6C, 0},
+    {0x1DA75, 0x1DA75, 0}, {0x1DA84, 0x1DA84, 0}, {0x1DA9B, 0x1DAAF, 0}, {0x1E000, 0x1E02A, 0}, {0x1E130, 0x1E136, 0}, {0x1E2AE, 0x1E2AE, 0},
+    {0x1E2EC, 0x1E2EF, 0}, {0x1E8D0, 0x1E8D6, 0}, {0x1E944, 0x1E94A, 0}, {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2}, {0x1F18E, 0x1F18E, 2},
+    {0x1F191, 0x1F19A, 2}, {0x1F200, 0x1F320, 2}, {0x1F32D, 0x1F335, 2}, {0x1F337, 0x1F37C, 2}, {0x1F37E, 0x1F393, 2}, {0x1F3A0, 0x1F3CA, 2},
+    {0x1F3CF, 0x1F3D3, 2}, {0x1F3E0, 0x1F3F0, 2}, {0x1F3F4, 0x1F3F4, 2}, {0x1F3F8, 0x1F43E, 2}, {0x1F440, 0x1F440, 2}, {0x1F442, 0x1F4FC, 2},
+    {0x1F4FF, 0x1F53D, 2}, {0x1F54B, 0x1F54E, 2}, {0x1F550, 0x1F567, 2}, {0x1F57A, 0x1F57A, 2}, {0x1F595, 0x1F596, 2}, {0x1F5A4, 0x1F5A4, 2},
+    {0x1F5FB, 0x1F64F, 2}, {0x1F680, 0x1F6C5, 2}, {0x1F6CC, 0x1F6CC, 2}, {0x1F6D0, 0x1F6D2, 2}, {0x1F6D5, 0x1F6DF, 2}, {0x1F6EB, 0x1F6EC, 2},
+    {0x1F6F4, 0x1F6FC, 2}, {0x1F7E0, 0x1F7F0, 2}, {0x1F90C, 0x1F93A, 2}, {0x1F93C, 0x1F945, 2}, {0x1F947, 0x1F9FF, 2}, {0x1FA70, 0x1FAF6, 2},
+    {0x20000, 0x3FFFD, 2},
 };
 
+// Blocks of 256 code points. Uniform blocks share the first three stage 2 slots (width 0, 1, 2), the others
+// get their own. Ranges are sorted, r is the first one that may touch the block
+constexpr bool width_block_mixed(int b, std::size_t& r, int& width)
+{
+    char32_t base = char32_t(b) << 8, last = base + 255;
+    while (r < std::size(width_ranges) && width_ranges[r].hi < base) r++;
+    width = 1;
+    if (r == std::size(width_ranges) || width_ranges[r].lo > last)
+        return false;
+    if (width_ranges[r].lo <= base && width_ranges[r].hi >= last)
+    {
+        width = width_ranges[r].width;
+        return false;
+    }
+    return true;
+}
 
-template<class TChar> class Widget;
-template<class TChar> class WindowStack;
-// Event handler signature now returns bool for event handling
-template<class TChar>
-using EventHandler = bool(*)(Widget<TChar>*, WindowStack<TChar>*, const IPEvent&, const std::vector<int>& path);
+constexpr int count_mixed_width_blocks()
+{
+    int n = 0, width = 1;
+    std::size_t r = 0;
+    for (int b = 0; b < 0x400; b++)
+        n += width_block_mixed(b, r, width);
+    return n;
+}
 
+// Blocks of stage2: the three uniform ones, then one per mixed block. Their index is stored in a byte
+static_assert(3 + count_mixed_width_blocks() <= 255, "stage1 of the width table holds block indices in a uint8");
 
-template<class TChar>
-class Widget
+// Two stage lookup for planes 0-3: block index, then 2 bits per code point
+struct WidthTable
 {
-public:
-    Point _xy; // Relative to the parent
-    Point _wh; // width, height
-    Colors _color;
-    Quad _margin; // left, top, right, bottom
-    Quad _padding; // left, top, right, bottom
-    std::vector<Widget> _children;
-    std::basic_string<TChar> _content; // Text content
-    ShadowStyle _shadow_style;
+    std::array<std::uint8_t, 0x400> stage1{};
+    std::array<std::uint8_t, (3 + count_mixed_width_blocks()) * 64> stage2{};
+};
 
-    WidgetLayout _layout;
+constexpr WidthTable make_width_table()
+{
+    WidthTable t;
+    for (int u = 0; u < 3; u++)
+        for (int i = 0; i < 64; i++)
+            t.stage2[u * 64 + i] = static_cast<std::uint8_t>(u * 0x55);
+    int next = 3, width = 1;
+    std::size_t r = 0;
+    for (int b = 0; b < 0x400; b++)
+    {
+        if (!width_block_mixed(b, r, width))
+        {
+            t.stage1[b] = static_cast<std::uint8_t>(width);
+            continue;
+        }
+        t.stage1[b] = static_cast<std::uint8_t>(next);
+        std::uint8_t* block = &t.stage2[next++ * 64];
+        std::fill_n(block, 64, 0x55);
+        char32_t base = char32_t(b) << 8;
+        for (std::size_t k = r; k < std::size(width_ranges) && width_ranges[k].lo <= base + 255; k++)
+        {
+            char32_t lo = std::max<char32_t>(width_ranges[k].lo, base), hi = std::min<char32_t>(width_ranges[k].hi, base + 255);
+            for (char32_t c = lo; c <= hi; c++)
+            {
+                int i = static_cast<int>(c - base);
+                block[i / 4] = static_cast<std::uint8_t>((block[i / 4] & ~(3 << i % 4 * 2)) | (width_ranges[k].width << i % 4 * 2));
+            }
+        }
+    }
+    return t;
+}
 
-    const BoxStyle* _box_style;
+inline constexpr WidthTable width_table = make_width_table();
 
-    bool _selectable = false;
-    EventHandler<TChar> on_event = nullptr;
+// Columns a code point takes: 0, 1 or 2. Two loads, no search
+constexpr int codepoint_width(char32_t c)
+{
+    if (c < 0x300)
+        return (c >= 0x20 && c < 0x7f) || c >= 0xa0; // Latin, controls take nothing
+    if (c < 0x40000)
+        return width_table.stage2[width_table.stage1[c >> 8] * 64 + (c & 0xff) / 4] >> (c & 3) * 2 & 3;
+    return (c >= 0xe0000 && c < 0xe1000) ? 0 : 1; // Tags and variation selectors
+}
 
 
-    Widget()
-        : _xy{0, 0}, _wh{0, 0}, _color(Colors::Primary),
-          _margin{0, 0, 0, 0}, _padding{0, 0, 0, 0}, _shadow_style(ShadowStyle::None)
-          , _layout(WidgetLayout::Text), _box_style(nullptr) {}
+// Unicode cells use char32_t glyphs: a code point, the right half of a double-width glyph, or an interned
+// grapheme cluster. Byte cells (char) hold one column each and stay as they are
+using Glyph = char32_t;
 
-    // Text box
-    explicit Widget(std::basic_string<TChar> text, Colors color = Colors::Primary, Quad margin = Quad(0, 0, 0, 0),
-                      const BoxStyle* box = nullptr, const ShadowStyle shadow = ShadowStyle::None)
-        : _content(std::move(text)), _color(color), _margin(std::move(margin)), _box_style(box), _shadow_style(shadow),
-          _layout(WidgetLayout::Text) {}
+// Cell right of a double-width glyph. The terminal draws the glyph over both cells
+inline constexpr char32_t wide_tail = 0x7fffffff;
 
-    // Horizontal/Vertical layout
-    Widget(WidgetLayout layout, std::vector<Widget> children, Colors color = Colors::Primary,
-             Quad margin = Quad(0, 0, 0, 0), Quad padding = Quad(0, 0, 0, 0), const BoxStyle* box = nullptr,
-             ShadowStyle shadow = ShadowStyle::None, Point xy = {0, 0})
-        : _xy(xy), _wh{0, 0}, _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
-          _content(), _shadow_style(shadow), _layout(layout), _box_style(box) {}
+// Grapheme clusters of more than one code point (combining marks, emoji ZWJ sequences, flags) get an id,
+// so a cluster still fits one cell and compares in O(1). The width is part of the id
+class GlyphTable
+{
+public:
+    static constexpr char32_t cluster_bit = 0x80000000;
 
-    // Floating layout
-    Widget(const Point& xy, std::vector<Widget> children, Colors color = Colors::Primary,
-             Quad margin = Quad(0, 0, 0, 0), Quad padding = Quad(0, 0, 0, 0), const BoxStyle* box = nullptr,
-             ShadowStyle shadow = ShadowStyle::None)
-        : _xy(xy), _wh{0, 0}, _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
-          _content(), _shadow_style(shadow), _layout(WidgetLayout::Floating), _box_style(box) {}
+    [[nodiscard]] static constexpr bool is_cluster(char32_t g) { return g & cluster_bit; }
+    [[nodiscard]] static constexpr int cluster_width(char32_t g) { return static_cast<int>(g >> 24 & 3); }
 
-    // Full constructor
-    Widget(const Point& xy, const Point& wh, Colors color, Quad margin, Quad padding,
-             std::vector<Widget> children, std::basic_string<TChar> content, ShadowStyle shadow, WidgetLayout layout,
-             const BoxStyle* box)
-        : _xy(xy), _wh(wh), _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
-          _content(std::move(content)), _shadow_style(shadow), _layout(layout), _box_style(box) {}
+    static GlyphTable& instance()
+    {
+        static GlyphTable table;
+        return table;
+    }
 
-    void set_text(const std::basic_string<TChar>& s) { _content = s; }
+    // Ids are never freed, and the index has 24 bits. New clusters past that are drawn as U+FFFD
+    static constexpr std::size_t capacity = std::size_t(1) << 24;
 
-    void set_selectable(bool selectable) { _selectable = selectable; }
+    // Id of the cluster, the same one for the same code points. Thread safe
+    char32_t intern(std::u32string_view cluster, int width)
+    {
+        std::lock_guard lock(_mutex);
+        std::u32string key(cluster);
+        key.push_back(static_cast<char32_t>(width)); // Widths may differ, e.g. with a variation selector
+        if (auto it = _ids.find(key); it != _ids.end())
+            return it->second;
+        if (_utf8.size() >= capacity)
+            return 0xfffd;
+
+        char32_t id = cluster_bit | static_cast<char32_t>(width) << 24 | static_cast<char32_t>(_utf8.size());
+        _ids.emplace(std::move(key), id);
+        std::string& utf8 = _utf8.emplace_back();
+        for (char32_t c : cluster)
+            append_utf8(utf8, c);
+        return id;
+    }
 
-    Widget<TChar>& add_child(Widget<TChar>& wid) { _children.push_back(std::move(wid)); return _children.front(); }
+    // UTF-8 of an interned cluster. Stays valid for the lifetime of the program
+    std::string_view utf8(char32_t id)
+    {
+        std::lock_guard lock(_mutex);
+        std::size_t index = id & 0xffffff;
+        return index < _utf8.size() ? std::string_view(_utf8[index]) : std::string_view();
+    }
 
-    Widget<TChar>& add_child(const Widget<TChar>& wid) { _children.push_back(wid); return _children.front(); }
+    static void append_utf8(std::string& out, char32_t c)
+    {
+        if (c < 0x80)
+            out.push_back(static_cast<char>(c));
+        else if (c < 0x800)
+        {
+            out.push_back(static_cast<char>(0xc0 | (c >> 6)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+        else if (c < 0x10000)
+        {
+            out.push_back(static_cast<char>(0xe0 | (c >> 12)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+        else
+        {
+            out.push_back(static_cast<char>(0xf0 | (c >> 18)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+            out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+        }
+    }
 
-    Widget<TChar>& at(std::size_t i) { return _children[i]; }
-    Widget<TChar>& back() { return _children.back(); }
-    Widget<TChar>& front() { return _children.front(); }
-    std::size_t widgets_num() { return _children.size(); }
+private:
+    GlyphTable() = default;
 
-    void refresh(const Widget<TChar>& rhs) // Similar to =, but preserves current widget position
+    struct Hash
     {
-        // we don't copy _xy
-        _wh = rhs._wh;
-        _color = rhs._color;
-        _margin = rhs._margin;
-        _padding = rhs._padding;
-        _children = rhs._children;
-        _content = rhs._content;
-        _shadow_style = rhs._shadow_style;
-        _layout = rhs._layout;
-        _box_style = rhs._box_style;
-        _selectable = rhs._selectable;
-        on_event = rhs.on_event;
+        std::size_t operator()(const std::u32string& s) const { return std::hash<std::u32string_view>()(s); }
+    };
+
+    std::mutex _mutex;
+    std::unordered_map<std::u32string, char32_t, Hash> _ids;
+    std::deque<std::string> _utf8; // Stable addresses, indexed by the low bits of the id
+};
+
+// Columns a cell glyph takes. Byte cells always take one
+template<class TChar>
+constexpr int glyph_width(TChar glyph)
+{
+    if constexpr (sizeof(TChar) == 1)
+        return 1;
+    else
+    {
+        auto g = static_cast<char32_t>(glyph);
+        if (g < 0x110000)
+            return codepoint_width(g);
+        return GlyphTable::is_cluster(g) ? GlyphTable::cluster_width(g) : 0; // wide_tail takes no column of its own
     }
+}
 
-    // Layout/rendering logic
-    // ======================
+// Columns a text takes, used by the layout instead of the length
+template<class TChar>
+constexpr int text_width(std::basic_string_view<TChar> text)
+{
+    if constexpr (sizeof(TChar) == 1)
+        return static_cast<int>(text.size());
+    else
+    {
+        int width = 0;
+        for (TChar c : text)
+            width += glyph_width(c);
+        return width;
+    }
+}
 
-    // Helper to get effective color from palette if set
-    template <class TStyle>
-    ANSIColor get_effective_color(const TStyle& style, bool active_window, bool win_always_active, bool selected) const
+// Longest prefix of the text that fits in the given number of columns
+template<class TChar>
+constexpr std::basic_string_view<TChar> clip_width(std::basic_string_view<TChar> text, int columns)
+{
+    if constexpr (sizeof(TChar) == 1)
+        return text.substr(0, static_cast<std::size_t>(std::max(columns, 0)));
+    else
+    {
+        std::size_t n = 0;
+        for (int width = 0; n < text.size() && (width += glyph_width(text[n])) <= columns; n++) {}
+        return text.substr(0, n);
+    }
+}
+
+// Byte cells hold one column each: controls (ESC, TAB, CR) would reach the terminal as commands and a
+// UTF-8 sequence would be split over several cells, so text runs show them as ' ' and '?'
+constexpr char printable_byte(char c)
+{
+    auto b = static_cast<unsigned char>(c);
+    return b >= 0x20 && b < 0x7f ? c : b < 0x80 ? ' ' : '?';
+}
+
+// Split UTF-8 into glyphs, one per grapheme cluster: a base code point with the combining marks, variation
+// selectors and ZWJ joined code points after it, or a pair of regional indicators (a flag). Clusters of more
+// than one code point, and marks without a base, are interned. Invalid bytes become U+FFFD
+inline std::u32string to_glyphs(std::string_view utf8)
+{
+    std::u32string out;
+    std::u32string cluster;
+    int cluster_width = 0;
+    auto flush = [&]()
+    {
+        if (cluster.size() == 1 && codepoint_width(cluster[0]) == cluster_width)
+            out.push_back(cluster[0]);
+        else if (!cluster.empty())
+            out.push_back(GlyphTable::instance().intern(cluster, cluster_width));
+        cluster.clear();
+    };
+    auto is_regional = [](char32_t c) { return c >= 0x1f1e6 && c <= 0x1f1ff; };
+
+    for (std::size_t i = 0; i < utf8.size();)
     {
-        if (!active_window && !win_always_active)
-            return style.get_color(Colors::Disabled);
-        if (_selectable)
+        auto b = static_cast<unsigned char>(utf8[i]);
+        std::size_t len = b < 0x80 ? 1 : (b >> 5) == 0x6 ? 2 : (b >> 4) == 0xe ? 3 : (b >> 3) == 0x1e ? 4 : 0;
+        // A decoded U+FFFD is a valid character, so failure has its own flag
+        bool ok = len && i + len <= utf8.size();
+        char32_t c = 0;
+        if (ok)
+        {
+            c = len == 1 ? b : b & (0x7f >> len);
+            for (std::size_t k = 1; k < len && ok; k++)
+            {
+                ok = (utf8[i + k] & 0xc0) == 0x80;
+                c = (c << 6) | (utf8[i + k] & 0x3f);
+            }
+        }
+        i += ok ? len : 1;
+        if (!ok)
+            c = 0xfffd;
+        if (c < 0x20 || c == 0x7f)
+            c = ' '; // Controls can't be drawn
+
+        bool joins = !cluster.empty() &&
+                     (codepoint_width(c) == 0 || cluster.back() == 0x200d ||
+                      (is_regional(c) && cluster.size() == 1 && is_regional(cluster[0])));
+        if (!joins)
         {
-            if (selected)
-                return style.get_color(Colors::Selected);
-            return style.get_color(Colors::Inactive);
+            flush();
+            cluster_width = std::max(codepoint_width(c), 1); // A mark on its own still gets a column
         }
-        return style.get_color((_color != Colors::None ? _color : Colors::Primary));
+        else if (c == 0xfe0f || is_regional(c))
+            cluster_width = 2; // Emoji presentation
+        cluster.push_back(c);
     }
+    flush();
+    return out;
+}
 
-    // Helper to get effective border color from palette if set
-    template <class TStyle>
-    ANSIColor get_border_color(const TStyle& style, bool active_window, bool selected) const
-    {
-        if (!active_window)
-            return style.get_color(Colors::BorderDisabled);
 
-        if (_selectable && selected)
-            return style.get_color(Colors::BorderActive);
+// Bytes the compiler would pad a cell with to align the next glyph
+template<class TColor, class TChar>
+inline constexpr std::size_t cell_padding = (alignof(TChar) - (sizeof(TChar) + sizeof(TColor)) % alignof(TChar)) % alignof(TChar);
+
+// Single screen cell: glyph and color packed together
+template<class TColor, class TChar, std::size_t Padding = cell_padding<TColor, TChar>>
+struct Cell
+{
+    TChar glyph = ' ';
+    TColor color = TColor::None();
+    // Wide glyphs leave a gap after the color. It is always zero, so cells can be diffed and hashed as bytes
+    std::array<std::uint8_t, Padding> padding{};
+
+    constexpr bool operator==(const Cell& other) const { return glyph == other.glyph && color == other.color; }
+    constexpr bool operator!=(const Cell& other) const { return !(*this == other); }
+};
+
+template<class TColor, class TChar>
+struct Cell<TColor, TChar, 0>
+{
+    TChar glyph = ' ';
+    TColor color = TColor::None();
+
+    constexpr bool operator==(const Cell& other) const { return glyph == other.glyph && color == other.color; }
+    constexpr bool operator!=(const Cell& other) const { return !(*this == other); }
+};
+
+static_assert(sizeof(Cell<ANSIColor, char>) <= 8, "Cell should stay within 8 bytes");
+static_assert(sizeof(Cell<TrueColor, char>) <= 8, "Cell should stay within 8 bytes");
+static_assert(sizeof(Cell<IndexedColor, char>) <= 8, "Cell should stay within 8 bytes");
+static_assert(sizeof(Cell<ANSIColor, char32_t>) <= 8, "Cell should stay within 8 bytes");
 
-        return style.get_color(Colors::BorderInactive);
+
+// Damaged column span of each row, [lo, hi). Spans only grow until clear().
+// Rows are independent, so different rows may be added from different threads
+class DamageList
+{
+public:
+    void resize(int rows, int cols)
+    {
+        _cols = cols;
+        _lo.assign(rows, cols);
+        _hi.assign(rows, 0);
     }
 
-    template <class TColor>
-    static void draw_box(std::vector<std::basic_string<TChar>>& matrix, std::vector<std::vector<TColor>>& color_matrix, int x, int y,
-                         int w, int h, BoxStyle style, const TColor& color)
+    void clear()
     {
-        if (w < 2 || h < 2) return;
-        int x2 = x + w - 1, y2 = y + h - 1;
+        std::fill(_lo.begin(), _lo.end(), _cols);
+        std::fill(_hi.begin(), _hi.end(), 0);
+    }
 
-        if (style.isna()) // is a NoBoxStyle
-            return;
+    // Columns [x0, x1) of the row, already clipped by the caller
+    void add(int y, int x0, int x1)
+    {
+        _lo[y] = std::min(_lo[y], x0);
+        _hi[y] = std::max(_hi[y], x1);
+    }
+
+    void add_rect(int x, int y, int w, int h)
+    {
+        for (int j = y; j < y + h; j++)
+            add(j, x, x + w);
+    }
 
-        auto set = [&](int row, int col, char ch)
+    // Move the spans of rows [y0, y1) up by n rows, down if n is negative. Rows left behind are empty
+    void scroll(int y0, int y1, int n)
+    {
+        auto shift = [&](std::vector<int>& v, int empty)
         {
-            if (row >= 0 && row < (int)matrix.size() && col >= 0 && col < (int)matrix[0].size())
+            if (n > 0)
+            {
+                std::copy(v.begin() + y0 + n, v.begin() + y1, v.begin() + y0);
+                std::fill(v.begin() + y1 - n, v.begin() + y1, empty);
+            }
+            else
             {
-                matrix[row][col] = ch;
-                color_matrix[row][col] = color_matrix[row][col].overlay(color);
+                std::copy_backward(v.begin() + y0, v.begin() + y1 + n, v.begin() + y1);
+                std::fill(v.begin() + y0, v.begin() + y0 - n, empty);
             }
         };
+        shift(_lo, _cols);
+        shift(_hi, 0);
+    }
 
-        // Corners
-        set(y, x, style.tl);
-        set(y, x2, style.tr);
-        set(y2, x, style.bl);
-        set(y2, x2, style.br);
-        // Top and bottom edges
-        for (int i = x + 1; i < x2; ++i)
+    [[nodiscard]] bool empty() const
+    {
+        for (std::size_t j = 0; j < _lo.size(); j++)
+            if (_lo[j] < _hi[j]) return false;
+        return true;
+    }
+    [[nodiscard]] int rows() const { return static_cast<int>(_lo.size()); }
+    [[nodiscard]] bool damaged(int y) const { return _lo[y] < _hi[y]; }
+    [[nodiscard]] int lo(int y) const { return _lo[y]; }
+    [[nodiscard]] int hi(int y) const { return _hi[y]; }
+
+private:
+    std::vector<int> _lo;
+    std::vector<int> _hi;
+    int _cols = 0;
+};
+
+
+// Byte comparison kernels for the frame differ
+// =============================================
+
+// Returns the offset of the first byte that differs, or n if the ranges are equal
+using FirstDiffFn = std::size_t (*)(const unsigned char* a, const unsigned char* b, std::size_t n);
+
+inline std::size_t first_diff_scalar(const unsigned char* a, const unsigned char* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        std::uint64_t wa, wb;
+        std::memcpy(&wa, a + i, 8);
+        std::memcpy(&wb, b + i, 8);
+        if (wa != wb) break;
+    }
+    for (; i < n; i++)
+        if (a[i] != b[i]) return i;
+    return n;
+}
+
+#ifdef CURSE_IS_X86
+__attribute__((target("sse2")))
+inline std::size_t first_diff_sse2(const unsigned char* a, const unsigned char* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb))) & 0xffffu;
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + first_diff_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline std::size_t first_diff_avx2(const unsigned char* a, const unsigned char* b, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        unsigned mask = ~static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + first_diff_sse2(a + i, b + i, n - i);
+}
+#endif
+
+enum class DiffKernel
+{
+    Auto, // Best one the CPU supports
+    Scalar,
+    SSE2,
+    AVX2
+};
+
+// Resolve the kernel at runtime. Falls back to the next best one if the CPU lacks support
+inline FirstDiffFn select_diff_kernel(DiffKernel kernel = DiffKernel::Auto)
+{
+#ifdef CURSE_IS_X86
+    const bool has_avx2 = __builtin_cpu_supports("avx2");
+    const bool has_sse2 = __builtin_cpu_supports("sse2");
+    if ((kernel == DiffKernel::Auto || kernel == DiffKernel::AVX2) && has_avx2)
+        return first_diff_avx2;
+    if (kernel != DiffKernel::Scalar && has_sse2)
+        return first_diff_sse2;
+#endif
+    return first_diff_scalar;
+}
+
+// Newline scan kernels, for indexing the lines of a file
+// ======================================================
+
+// Appends base + i + 1, the start of the next line, for every '\n' at p[i]
+using NewlineScanFn = void (*)(const char* p, std::size_t n, std::uint64_t base, std::vector<std::uint64_t>& out);
+
+inline void scan_newlines_scalar(const char* p, std::size_t n, std::uint64_t base, std::vector<std::uint64_t>& out)
+{
+    for (const char *it = p, *end = p + n; (it = static_cast<const char*>(std::memchr(it, '\n', end - it))); it++)
+        out.push_back(base + static_cast<std::uint64_t>(it - p) + 1);
+}
+
+#ifdef CURSE_IS_X86
+__attribute__((target("sse2")))
+inline void scan_newlines_sse2(const char* p, std::size_t n, std::uint64_t base, std::vector<std::uint64_t>& out)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        for (unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl))); mask; mask &= mask - 1)
+            out.push_back(base + i + __builtin_ctz(mask) + 1);
+    }
+    scan_newlines_scalar(p + i, n - i, base + i, out);
+}
+
+__attribute__((target("avx2")))
+inline void scan_newlines_avx2(const char* p, std::size_t n, std::uint64_t base, std::vector<std::uint64_t>& out)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        for (unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl))); mask; mask &= mask - 1)
+            out.push_back(base + i + __builtin_ctz(mask) + 1);
+    }
+    scan_newlines_sse2(p + i, n - i, base + i, out);
+}
+#endif
+
+// Same choice as select_diff_kernel()
+inline NewlineScanFn select_newline_kernel(DiffKernel kernel = DiffKernel::Auto)
+{
+#ifdef CURSE_IS_X86
+    if ((kernel == DiffKernel::Auto || kernel == DiffKernel::AVX2) && __builtin_cpu_supports("avx2"))
+        return scan_newlines_avx2;
+    if (kernel != DiffKernel::Scalar && __builtin_cpu_supports("sse2"))
+        return scan_newlines_sse2;
+#endif
+    return scan_newlines_scalar;
+}
+
+// Row hash over the raw cell bytes
+inline std::uint64_t hash_bytes(const unsigned char* p, std::size_t n)
+{
+    std::uint64_t h = 0x9e3779b97f4a7c15ull ^ n;
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    return h ^ (h >> 29);
+}
+
+
+// Flat row-major cell buffer with a fixed stride. All drawing goes through the primitives below,
+// which clip to the surface bounds and record what they wrote in the damage list. Clearing only
+// touches the damaged cells. Writes to different rows may come from different threads
+template<class TColor, class TChar>
+class Surface
+{
+public:
+    using cell_type = Cell<TColor, TChar>;
+
+    Surface() = default;
+    Surface(int rows, int cols) { resize(rows, cols); }
+
+    void resize(int rows, int cols)
+    {
+        _rows = std::max(rows, 0);
+        _cols = std::max(cols, 0);
+        _cells.assign(static_cast<std::size_t>(_rows) * _cols, cell_type{});
+        _damage.resize(_rows, _cols);
+        if constexpr (bytewise)
         {
-            set(y, i, style.hline);
-            set(y2, i, style.hline);
+            std::vector<cell_type> blank(_cols);
+            _blank_hash = hash_bytes(reinterpret_cast<const unsigned char*>(blank.data()), blank.size() * sizeof(cell_type));
         }
-        // Left and right edges
-        for (int i = y + 1; i < y2; ++i)
+        _row_hash.assign(_rows, _blank_hash);
+        _scroll_hints.clear();
+    }
+
+    [[nodiscard]] int rows() const { return _rows; }
+    [[nodiscard]] int cols() const { return _cols; }
+    [[nodiscard]] bool empty() const { return _cells.empty(); }
+    [[nodiscard]] bool contains(int x, int y) const { return x >= 0 && y >= 0 && x < _cols && y < _rows; }
+
+    [[nodiscard]] std::span<cell_type> cells() { return _cells; }
+    [[nodiscard]] std::span<const cell_type> cells() const { return _cells; }
+
+    [[nodiscard]] std::span<cell_type> row(int y) { return {_cells.data() + static_cast<std::size_t>(y) * _cols, static_cast<std::size_t>(_cols)}; }
+    [[nodiscard]] std::span<const cell_type> row(int y) const { return {_cells.data() + static_cast<std::size_t>(y) * _cols, static_cast<std::size_t>(_cols)}; }
+
+    [[nodiscard]] cell_type& at(int x, int y) { return _cells[static_cast<std::size_t>(y) * _cols + x]; }
+    [[nodiscard]] const cell_type& at(int x, int y) const { return _cells[static_cast<std::size_t>(y) * _cols + x]; }
+
+    // Cells written since the last clear()
+    [[nodiscard]] const DamageList& damage() const { return _damage; }
+
+    // Cells can be diffed and hashed as raw bytes when they have no padding
+    static constexpr bool bytewise = std::has_unique_object_representations_v<cell_type>;
+
+    // Hash of the row contents, valid after update_row_hashes(). Always 0 if cells are not bytewise
+    [[nodiscard]] std::uint64_t row_hash(int y) const { return _row_hash[y]; }
+
+    // Rows outside the damage are blank, only damaged ones are hashed
+    void update_row_hashes() { update_row_hashes(0, _rows); }
+
+    // Same, for rows [y0, y1) only
+    void update_row_hashes(int y0, int y1)
+    {
+        if constexpr (bytewise)
         {
-            set(i, x, style.vline);
-            set(i, x2, style.vline);
+            for (int j = y0; j < y1; j++)
+                _row_hash[j] = _damage.damaged(j) ? hash_bytes(reinterpret_cast<const unsigned char*>(row(j).data()), row(j).size_bytes())
+                                                  : _blank_hash;
         }
     }
 
-    void layout()
+    // Reset the cells written since the last clear to a blank space without color
+    void clear()
     {
-        auto [ml, mt, mr, mb] = _margin.tup();
-        auto [pl, pt, pr, pb] = _padding.tup();
+        for (int j = 0; j < _rows; j++)
+        {
+            if (_damage.damaged(j))
+                std::fill(row(j).begin() + _damage.lo(j), row(j).begin() + _damage.hi(j), cell_type{});
+        }
+        _damage.clear();
+        _scroll_hints.clear();
+    }
 
-        switch (_layout)
+    // Rows [y, y + h) of columns [x, x + w) show what the rows n below showed in the previous frame,
+    // n < 0 for above. The terminal may then scroll instead of sending the rows again
+    struct ScrollHint
+    {
+        int x, y, w, h, n;
+    };
+
+    // Record a scroll of the rectangle, clipped to the surface. Cleared by clear()
+    void hint_scroll(int x, int y, int w, int h, int n)
+    {
+        if (!clip(x, y, w, h) || n == 0 || std::abs(n) >= h) return;
+        _scroll_hints.push_back({x, y, w, h, n});
+    }
+
+    [[nodiscard]] std::span<const ScrollHint> scroll_hints() const { return _scroll_hints; }
+
+    // Move whole rows [y0, y1) up by n, down if n is negative, the way the terminal scrolls a region.
+    // Rows left behind are blank. Damage and row hashes move along
+    void scroll_rows(int y0, int y1, int n)
+    {
+        y0 = std::max(y0, 0);
+        y1 = std::min(y1, _rows);
+        if (n == 0 || y0 >= y1) return;
+        n = std::clamp(n, y0 - y1, y1 - y0);
+        auto first = _cells.begin() + static_cast<std::ptrdiff_t>(y0) * _cols;
+        auto last = _cells.begin() + static_cast<std::ptrdiff_t>(y1) * _cols;
+        auto step = static_cast<std::ptrdiff_t>(std::abs(n)) * _cols;
+        if (n > 0)
         {
-        case WidgetLayout::Horizontal:
-            {
-                int x = 0, max_h = 0;
+            std::copy(first + step, last, first);
+            std::fill(last - step, last, cell_type{});
+            std::copy(_row_hash.begin() + y0 + n, _row_hash.begin() + y1, _row_hash.begin() + y0);
+            std::fill(_row_hash.begin() + y1 - n, _row_hash.begin() + y1, _blank_hash);
+        }
+        else
+        {
+            std::copy_backward(first, last - step, last);
+            std::fill(first, first + step, cell_type{});
+            std::copy_backward(_row_hash.begin() + y0, _row_hash.begin() + y1 + n, _row_hash.begin() + y1);
+            std::fill(_row_hash.begin() + y0, _row_hash.begin() + y0 - n, _blank_hash);
+        }
+        _damage.scroll(y0, y1, n);
+    }
 
-                for (int i = 0; i < _children.size(); i++)
-                {
-                    _children[i].layout();
+    // Mark columns [x0, x1) of the row as written. Needed after writing through row() or at() directly
+    void touch(int y, int x0, int x1) { _damage.add(y, x0, x1); }
 
-                    if (i > 0)
-                        x += pl;
-                    if (i < _children.size() - 1)
-                        x += pr;
+    // Glyph and color, replacing the cell
+    void set(int x, int y, TChar glyph, const TColor& color)
+    {
+        if (!contains(x, y)) return;
+        at(x, y) = {glyph, color};
+        touch(y, x, x + 1);
+    }
 
-                    x += _children[i]._wh.w();
-                    max_h = std::max(max_h, _children[i]._wh.h());
-                }
-                _wh.w() = x + ml + mr;
-                _wh.h() = max_h + mt + mb;
-                break;
-            }
-        case WidgetLayout::Vertical:
-            {
-                int y = 0, max_w = 0;
-                for (int i = 0; i < _children.size(); i++)
-                {
-                    _children[i].layout();
+    // Glyph with the color overlaid on top of the current cell color
+    void overlay(int x, int y, TChar glyph, const TColor& color)
+    {
+        if (!contains(x, y)) return;
+        cell_type& cell = at(x, y);
+        cell.glyph = glyph;
+        cell.color = cell.color.overlay(color);
+        touch(y, x, x + 1);
+    }
 
-                    if (i > 0)
-                        y += pl;
-                    if (i < _children.size() - 1)
-                        y += pr;
+    // Text run with the color overlaid, clipped to the row
+    void overlay_text(int x, int y, std::basic_string_view<TChar> text, const TColor& color)
+    {
+        if (y < 0 || y >= _rows) return;
+        if constexpr (sizeof(TChar) > 1)
+            return put_glyphs<true>(x, y, text, color);
+        int start = (x < 0) ? -x : 0;
+        int end = std::min(static_cast<int>(text.size()), _cols - x);
+        if (start >= end) return;
+        std::span<cell_type> r = row(y);
+        for (int i = start; i < end; i++)
+        {
+            r[x + i].glyph = printable_byte(text[i]);
+            r[x + i].color = r[x + i].color.overlay(color);
+        }
+        touch(y, x + start, x + end);
+    }
 
-                    y += _children[i]._wh.h();
-                    max_w = std::max(max_w, _children[i]._wh.w());
-                }
-                _wh.w() = max_w + ml + mr;
-                _wh.h() = y + mt + mb;
-                break;
-            }
-        case WidgetLayout::Floating:
+    // Text run replacing the cells, clipped to the row
+    void set_text(int x, int y, std::basic_string_view<TChar> text, const TColor& color)
+    {
+        if (y < 0 || y >= _rows) return;
+        if constexpr (sizeof(TChar) > 1)
+            return put_glyphs<false>(x, y, text, color);
+        int start = (x < 0) ? -x : 0;
+        int end = std::min(static_cast<int>(text.size()), _cols - x);
+        if (start >= end) return;
+        std::span<cell_type> r = row(y);
+        for (int i = start; i < end; i++)
+        {
+            r[x + i].glyph = printable_byte(text[i]);
+            r[x + i].color = color;
+        }
+        touch(y, x + start, x + end);
+    }
+
+    // Opaque fill of a rectangle
+    void fill(int x, int y, int w, int h, TChar glyph, const TColor& color)
+    {
+        if (!clip(x, y, w, h)) return;
+        for (int j = y; j < y + h; j++)
+            std::fill_n(row(j).begin() + x, w, cell_type{glyph, color});
+        _damage.add_rect(x, y, w, h);
+    }
+
+    // Blend the color into a rectangle: only cells without a color pick it up
+    void blend(int x, int y, int w, int h, const TColor& color)
+    {
+        if (!clip(x, y, w, h)) return;
+        for (int j = y; j < y + h; j++)
+        {
+            std::span<cell_type> r = row(j);
+            for (int i = x; i < x + w; i++)
+                r[i].color = r[i].color.blend(color);
+        }
+        _damage.add_rect(x, y, w, h);
+    }
+
+    // Compose another surface on top of this one at x, y. Cells of src inside the opaque w x h area
+    // replace the destination, cells outside of it (shadows) blend their color in and keep the glyph
+    // unless they have one. Only the damaged part of src is visited
+    void blit(const Surface& src, int x, int y, int opaque_w, int opaque_h)
+    {
+        if (src.damage().empty()) return;
+        for (int j = 0; j < src._rows; j++)
+            blit_row(src, x, y, opaque_w, opaque_h, j, 0, src._cols);
+    }
+
+    // Same as blit(), for columns [lo, hi) of row j of src only
+    void blit_row(const Surface& src, int x, int y, int opaque_w, int opaque_h, int j, int lo, int hi)
+    {
+        const DamageList& src_damage = src.damage();
+        if (j < 0 || j >= src._rows || y + j < 0 || y + j >= _rows || !src_damage.damaged(j)) return;
+        lo = std::max({lo, src_damage.lo(j), -x});
+        hi = std::min({hi, src_damage.hi(j), _cols - x});
+        if (lo >= hi) return;
+
+        std::span<const cell_type> from = src.row(j);
+        std::span<cell_type> to = row(y + j);
+        int opaque_hi = (j < opaque_h) ? std::max(lo, std::min(hi, opaque_w)) : lo;
+        std::copy(from.begin() + lo, from.begin() + opaque_hi, to.begin() + x + lo);
+        for (int i = opaque_hi; i < hi; i++)
+        {
+            if (from[i].glyph != ' ')
+                to[x + i].glyph = from[i].glyph;
+            to[x + i].color = to[x + i].color.blend(from[i].color);
+        }
+        touch(y + j, x + lo, x + hi);
+    }
+
+protected:
+    // Text run of Unicode glyphs. A double-width glyph fills its cell and a wide_tail cell after it,
+    // one cut in half by the edge of the row shows as a blank
+    template<bool Overlay>
+    void put_glyphs(int x, int y, std::basic_string_view<TChar> text, const TColor& color)
+    {
+        std::span<cell_type> r = row(y);
+        int lo = _cols, hi = 0;
+        for (TChar g : text)
+        {
+            if (x >= _cols) break;
+            int w = glyph_width(g);
+            for (int k = 0; k < w; k++, x++)
             {
-                int max_x = 0, max_y = 0;
-                for (auto& child : _children)
+                if (x < 0 || x >= _cols) continue;
+                TChar shown = (w == 2 && (x - k < 0 || x - k + 1 >= _cols)) ? TChar(' ') : k ? TChar(wide_tail) : g;
+                if constexpr (Overlay)
                 {
-                    child.layout();
-                    int child_x = child._xy.x() + child._wh.w();
-                    int child_y = child._xy.y() + child._wh.h();
-                    max_x = std::max(max_x, child_x);
-                    max_y = std::max(max_y, child_y);
+                    r[x].glyph = shown;
+                    r[x].color = r[x].color.overlay(color);
                 }
-                _wh.w() = max_x + ml + mr;
-                _wh.h() = max_y + mt + mb;
-                break;
+                else
+                    r[x] = {shown, color};
+                lo = std::min(lo, x);
+                hi = x + 1;
             }
-        case WidgetLayout::Text:
-            {
-                _wh.w() = static_cast<int>(_content.size()) + ml + mr;
-                _wh.h() = 1 + mt + mb;
+        }
+        if (lo < hi) touch(y, lo, hi);
+    }
+
+    // Clip the rectangle to the surface, false if nothing is left
+    bool clip(int& x, int& y, int& w, int& h) const
+    {
+        if (x < 0) { w += x; x = 0; }
+        if (y < 0) { h += y; y = 0; }
+        w = std::min(w, _cols - x);
+        h = std::min(h, _rows - y);
+        return w > 0 && h > 0;
+    }
+
+    std::vector<cell_type> _cells;
+    DamageList _damage;
+    std::vector<std::uint64_t> _row_hash;
+    std::uint64_t _blank_hash = 0;
+    std::vector<ScrollHint> _scroll_hints;
+    int _rows = 0;
+    int _cols = 0;
+};
+
+// The row hashes, the vectorized diff and scroll detection need cells without padding bytes
+static_assert(Surface<ANSIColor, char>::bytewise && Surface<TrueColor, char>::bytewise && Surface<IndexedColor, char>::bytewise);
+static_assert(Surface<ANSIColor, char32_t>::bytewise && Surface<TrueColor, char32_t>::bytewise && Surface<IndexedColor, char32_t>::bytewise);
+
+
+// Event types for user interaction
+enum class EventType
+{
+    None,
+    Select,
+    Click, // KeyDown
+    ArrowUp,
+    ArrowDown,
+    ArrowLeft,
+    ArrowRight,
+    OnCreate,
+    OnDestroy
+};
+
+// Keys without a character, reported as the key of Click events. They start past the last Unicode
+// code point, so they never clash with a character
+enum class Key : int
+{
+    Escape = 0x110000,
+    Home,
+    End,
+    Insert,
+    Delete,
+    PageUp,
+    PageDown,
+    BackTab,
+    F1, F2, F3, F4, F5, F6, F7, F8, F9, F10, F11, F12
+};
+
+// Dispatch phase of an event
+enum class EventPhase : std::uint8_t
+{
+    Capture, // From the window root down to the selected widget. Only if WindowStack::capture_events is set
+    Bubble // From the selected widget up to the window root
+};
+
+struct IPEvent
+{
+    EventType type;
+    int key; // For Click, can be ASCII or special key code
+    EventPhase phase = EventPhase::Bubble; // Set by the dispatcher
+    explicit IPEvent(EventType t = EventType::None, int k = 0) : type(t), key(k) {}
+};
+
+
+#ifndef CURSE_MAX_DEPTH
+#define CURSE_MAX_DEPTH 32 // Deepest widget nesting supported by WidgetPath
+#endif
+
+// Path to a widget from the window root, one child index per level. Fixed capacity, so paths live on
+// the stack and copying or comparing them never allocates
+class WidgetPath
+{
+public:
+    static constexpr std::size_t capacity = CURSE_MAX_DEPTH;
+
+    constexpr WidgetPath() = default;
+
+    constexpr WidgetPath(std::initializer_list<int> idx)
+    {
+        for (int i : idx)
+            push_back(i);
+    }
+
+    // A deeper tree would lose levels and address the wrong widget, so this fails in release builds too
+    constexpr void push_back(int i)
+    {
+        if (_size >= capacity)
+            throw std::length_error("widget tree is deeper than CURSE_MAX_DEPTH");
+        _idx[_size++] = i;
+    }
+
+    constexpr void pop_back() { if (_size) _size--; }
+    constexpr void clear() { _size = 0; }
+
+    // First n levels of the path
+    [[nodiscard]] constexpr WidgetPath prefix(std::size_t n) const
+    {
+        WidgetPath res = *this;
+        res._size = static_cast<std::uint8_t>(std::min<std::size_t>(n, _size));
+        return res;
+    }
+
+    [[nodiscard]] constexpr std::size_t size() const { return _size; }
+    [[nodiscard]] constexpr bool empty() const { return _size == 0; }
+
+    constexpr int& operator[](std::size_t i) { return _idx[i]; }
+    constexpr int operator[](std::size_t i) const { return _idx[i]; }
+    constexpr int& front() { return _idx[0]; }
+    constexpr int& back() { return _idx[_size - 1]; }
+    [[nodiscard]] constexpr int front() const { return _idx[0]; }
+    [[nodiscard]] constexpr int back() const { return _idx[_size - 1]; }
+
+    constexpr int* begin() { return _idx.data(); }
+    constexpr int* end() { return _idx.data() + _size; }
+    [[nodiscard]] constexpr const int* begin() const { return _idx.data(); }
+    [[nodiscard]] constexpr const int* end() const { return _idx.data() + _size; }
+
+    constexpr bool operator==(const WidgetPath& other) const
+    {
+        return _size == other._size && std::equal(begin(), end(), other.begin());
+    }
+
+    constexpr bool operator!=(const WidgetPath& other) const { return !(*this == other); }
+
+private:
+    std::array<int, capacity> _idx{};
+    std::uint8_t _size = 0;
+};
+
+
+// Palette color of a widget
+template <class TStyle>
+auto widget_color(const TStyle& style, Colors color, bool selectable, bool active_window, bool win_always_active, bool selected)
+{
+    if (!active_window && !win_always_active)
+        return style.get_color(Colors::Disabled);
+    if (selectable)
+    {
+        if (selected)
+            return style.get_color(Colors::Selected);
+        return style.get_color(Colors::Inactive);
+    }
+    return style.get_color((color != Colors::None ? color : Colors::Primary));
+}
+
+// Palette color of a widget border
+template <class TStyle>
+auto widget_border_color(const TStyle& style, bool selectable, bool active_window, bool selected)
+{
+    if (!active_window)
+        return style.get_color(Colors::BorderDisabled);
+
+    if (selectable && selected)
+        return style.get_color(Colors::BorderActive);
+
+    return style.get_color(Colors::BorderInactive);
+}
+
+
+// Virtualized list: rows come from a callback and only the visible window of them is fetched, laid out
+// and drawn, so the row count does not matter. Fetched rows are kept in an LRU cache. Sources that keep
+// their rows in memory (FileView, LogBuffer) can hand out views instead, then nothing is copied or cached.
+// Shared by the copies of the widget that shows it. When the rows move between two renders at the same
+// place, render() leaves a scroll hint on the surface, so the terminal can scroll them
+template<class TChar>
+class ListView
+{
+public:
+    using Row = std::basic_string<TChar>;
+    using CountFn = std::function<std::size_t()>;
+    using FetchFn = std::function<Row(std::size_t index)>;
+    using ViewFn = std::function<std::basic_string_view<TChar>(std::size_t index)>;
+    using OriginFn = std::function<std::size_t()>;
+
+    // size is the viewport in cells: width, visible rows
+    ListView(CountFn count, FetchFn fetch, Point size, std::size_t cache_rows = 1024)
+        : _count(std::move(count)), _fetch(std::move(fetch)), _viewport(size), _capacity(cache_rows) {}
+
+    // Rows are views into the source, valid until the source changes
+    static ListView from_views(CountFn count, ViewFn view, Point size)
+    {
+        ListView list(std::move(count), nullptr, size, 0);
+        list._view = std::move(view);
+        return list;
+    }
+
+    [[nodiscard]] std::size_t size() const { return _count(); }
+    [[nodiscard]] Point viewport() const { return _viewport; }
+    [[nodiscard]] std::size_t top() const { return _top; } // First visible row
+    [[nodiscard]] std::size_t cursor() const { return _cursor; }
+
+    void set_viewport(Point size) { _viewport = size; clamp(); }
+
+    // Keep the cursor on the last row while rows are added, as long as it was there (tail -f)
+    void set_follow(bool follow) { _follow = follow; }
+
+    // For sources that drop rows from the front (LogBuffer): how many were dropped so far. Row 0 is the
+    // oldest one left, the cursor and the viewport stay on their rows while older ones go
+    void set_origin(OriginFn origin) { _origin = std::move(origin); }
+
+    // Row by index, fetched on a miss. The view is valid until the next fetch
+    std::basic_string_view<TChar> row(std::size_t index)
+    {
+        if (_view)
+            return _view(index);
+        if (auto it = _cache.find(index); it != _cache.end())
+        {
+            _lru.splice(_lru.begin(), _lru, it->second); // Most recent first
+            return it->second->second;
+        }
+        std::size_t capacity = std::max<std::size_t>(_capacity, 2 * std::max(_viewport.h(), 1));
+        while (_lru.size() >= capacity)
+        {
+            _cache.erase(_lru.back().first);
+            _lru.pop_back();
+        }
+        _lru.emplace_front(index, _fetch(index));
+        _cache[index] = _lru.begin();
+        return _lru.front().second;
+    }
+
+    // Drop cached rows after the data behind them changed
+    void refresh()
+    {
+        _cache.clear();
+        _lru.clear();
+        clamp();
+    }
+
+    void refresh(std::size_t index)
+    {
+        if (auto it = _cache.find(index); it != _cache.end())
+        {
+            _lru.erase(it->second);
+            _cache.erase(it);
+        }
+    }
+
+    // Move the cursor, scrolling just enough to keep it visible
+    void scroll_to(std::size_t index)
+    {
+        _cursor = index;
+        clamp();
+    }
+
+    // Arrows move the cursor, PageUp/PageDown by a page, Home/End to the ends. Returns false if the cursor
+    // is already at the edge, so the arrow moves the focus out of the list instead
+    bool handle_event(const IPEvent& ev)
+    {
+        std::size_t n = size(), page = std::max(_viewport.h(), 1);
+        if (n == 0) return false;
+        std::size_t to = _cursor;
+        if (ev.type == EventType::ArrowUp)
+            to = _cursor ? _cursor - 1 : 0;
+        else if (ev.type == EventType::ArrowDown)
+            to = std::min(_cursor + 1, n - 1);
+        else if (ev.type == EventType::Click && ev.key == static_cast<int>(Key::PageUp))
+            to = _cursor > page ? _cursor - page : 0;
+        else if (ev.type == EventType::Click && ev.key == static_cast<int>(Key::PageDown))
+            to = std::min(_cursor + page, n - 1);
+        else if (ev.type == EventType::Click && ev.key == static_cast<int>(Key::Home))
+            to = 0;
+        else if (ev.type == EventType::Click && ev.key == static_cast<int>(Key::End))
+            to = n - 1;
+        else
+            return false;
+        if (to == _cursor) return false;
+        scroll_to(to);
+        return true;
+    }
+
+    // Visible rows at x, y clipped to the viewport. The cursor row is filled with cursor_color
+    template<class TColor>
+    void render(Surface<TColor, TChar>& surface, int x, int y, const TColor& color, const TColor& cursor_color)
+    {
+        if (!_shared)
+            update(surface, x, y);
+        std::size_t n = std::min(size(), _top + std::max(_viewport.h(), 0));
+        for (std::size_t index = _top; index < n; index++)
+        {
+            int row_y = y + static_cast<int>(index - _top);
+            if (row_y < 0 || row_y >= surface.rows()) continue;
+            if (index == _cursor)
+                surface.fill(x, row_y, _viewport.w(), 1, ' ', cursor_color);
+            surface.overlay_text(x, row_y, clip_width(cached_row(index), _viewport.w()),
+                                 index == _cursor ? cursor_color : color);
+        }
+    }
+
+    // Raster bands render the list on several threads. share() does the updates of render() once on
+    // the calling thread, after that render() only reads until unshare()
+    template<class TColor>
+    void share(Surface<TColor, TChar>& surface, int x, int y)
+    {
+        update(surface, x, y);
+        _shared = true;
+    }
+
+    void unshare() { _shared = false; }
+
+protected:
+    // Clamp, leave a scroll hint if the rows moved, and fetch the visible rows
+    template<class TColor>
+    void update(Surface<TColor, TChar>& surface, int x, int y)
+    {
+        clamp();
+
+        // Rows that moved since the last render at the same place can be scrolled on the terminal
+        std::size_t first = _last_origin + _top;
+        if (_drawn && x == _drawn_at.x() && y == _drawn_at.y() && _viewport == _drawn_viewport && first != _drawn_first)
+        {
+            auto moved = static_cast<std::ptrdiff_t>(first - _drawn_first);
+            if (std::abs(moved) < _viewport.h())
+                surface.hint_scroll(x, y, _viewport.w(), _viewport.h(), static_cast<int>(moved));
+        }
+        _drawn = true;
+        _drawn_at = {x, y};
+        _drawn_viewport = _viewport;
+        _drawn_first = first;
+
+        if (_view) return;
+        std::size_t n = std::min(size(), _top + std::max(_viewport.h(), 0));
+        for (std::size_t index = _top; index < n; index++)
+            (void)row(index);
+    }
+
+    // Visible row after update(), without touching the cache
+    [[nodiscard]] std::basic_string_view<TChar> cached_row(std::size_t index) const
+    {
+        if (_view)
+            return _view(index);
+        auto it = _cache.find(index);
+        return it != _cache.end() ? std::basic_string_view<TChar>(it->second->second) : std::basic_string_view<TChar>();
+    }
+
+    // Keep the cursor inside the rows and the viewport over the cursor
+    void clamp()
+    {
+        std::size_t n = size(), page = std::max(_viewport.h(), 1);
+        if (std::size_t origin = _origin ? _origin() : 0; origin != _last_origin)
+        {
+            // Rows dropped from the front, indices move down
+            std::size_t dropped = origin - _last_origin;
+            _top -= std::min(_top, dropped);
+            _cursor -= std::min(_cursor, dropped);
+            _last_size -= std::min(_last_size, dropped);
+            _last_origin = origin;
+            _cache.clear();
+            _lru.clear();
+        }
+        if (_follow && _cursor + 1 >= _last_size)
+            _cursor = n;
+        _last_size = n;
+        _cursor = n ? std::min(_cursor, n - 1) : 0;
+        if (_cursor < _top)
+            _top = _cursor;
+        else if (_cursor >= _top + page)
+            _top = _cursor - page + 1;
+        _top = std::min(_top, n > page ? n - page : 0);
+    }
+
+    CountFn _count;
+    FetchFn _fetch;
+    ViewFn _view;
+    Point _viewport;
+    std::size_t _capacity;
+    std::size_t _top = 0;
+    std::size_t _cursor = 0;
+    std::size_t _last_size = 0; // Row count at the last clamp, for following
+    bool _follow = false;
+    OriginFn _origin;
+    std::size_t _last_origin = 0;
+    std::list<std::pair<std::size_t, Row>> _lru;
+    std::unordered_map<std::size_t, typename std::list<std::pair<std::size_t, Row>>::iterator> _cache;
+
+    bool _shared = false; // Between share() and unshare()
+
+    // Last render, for scroll hints
+    bool _drawn = false;
+    Point _drawn_at{0, 0};
+    Point _drawn_viewport{0, 0};
+    std::size_t _drawn_first = 0; // Counting the rows dropped by the source
+};
+
+
+template<class TChar> class Widget;
+template<class TChar> class WindowStack;
+// Event handler signature now returns bool for event handling
+template<class TChar>
+using EventHandler = bool(*)(Widget<TChar>*, WindowStack<TChar>*, const IPEvent&, const WidgetPath& path);
+
+
+template<class TChar>
+class Widget
+{
+public:
+    Point _xy; // Relative to the parent
+    Point _wh; // width, height
+    Colors _color;
+    Quad _margin; // left, top, right, bottom
+    Quad _padding; // left, top, right, bottom
+    std::vector<Widget> _children;
+    std::basic_string<TChar> _content; // Text content
+    ShadowStyle _shadow_style;
+
+    WidgetLayout _layout;
+
+    const BoxStyle* _box_style;
+
+    bool _selectable = false;
+    EventHandler<TChar> on_event = nullptr;
+
+    std::shared_ptr<ListView<TChar>> _list; // Rows of a List layout
+
+    // Incremental layout. A changed widget marks itself and its ancestors dirty, layout() skips clean
+    // subtrees and keeps their cached _wh. _parent is kept valid when the tree is copied or moved
+    Widget* _parent = nullptr;
+    bool _layout_dirty = true;
+    std::size_t _layout_gen = 0; // Bumped every time layout() recomputes this widget
+
+
+    Widget()
+        : _xy{0, 0}, _wh{0, 0}, _color(Colors::Primary),
+          _margin{0, 0, 0, 0}, _padding{0, 0, 0, 0}, _shadow_style(ShadowStyle::None)
+          , _layout(WidgetLayout::Text), _box_style(nullptr) {}
+
+    // Text box
+    explicit Widget(std::basic_string<TChar> text, Colors color = Colors::Primary, Quad margin = Quad(0, 0, 0, 0),
+                      const BoxStyle* box = nullptr, const ShadowStyle shadow = ShadowStyle::None)
+        : _content(std::move(text)), _color(color), _margin(std::move(margin)), _box_style(box), _shadow_style(shadow),
+          _layout(WidgetLayout::Text) {}
+
+    // Virtualized list, selectable. The size comes from the viewport of the list
+    explicit Widget(std::shared_ptr<ListView<TChar>> list, Colors color = Colors::Primary, Quad margin = Quad(0, 0, 0, 0),
+                    const BoxStyle* box = nullptr, const ShadowStyle shadow = ShadowStyle::None)
+        : _color(color), _margin(std::move(margin)), _padding{0, 0, 0, 0}, _shadow_style(shadow), _layout(WidgetLayout::List),
+          _box_style(box), _selectable(true), _list(std::move(list)) {}
+
+    // Horizontal/Vertical layout
+    Widget(WidgetLayout layout, std::vector<Widget> children, Colors color = Colors::Primary,
+             Quad margin = Quad(0, 0, 0, 0), Quad padding = Quad(0, 0, 0, 0), const BoxStyle* box = nullptr,
+             ShadowStyle shadow = ShadowStyle::None, Point xy = {0, 0})
+        : _xy(xy), _wh{0, 0}, _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
+          _content(), _shadow_style(shadow), _layout(layout), _box_style(box) {}
+
+    // Floating layout
+    Widget(const Point& xy, std::vector<Widget> children, Colors color = Colors::Primary,
+             Quad margin = Quad(0, 0, 0, 0), Quad padding = Quad(0, 0, 0, 0), const BoxStyle* box = nullptr,
+             ShadowStyle shadow = ShadowStyle::None)
+        : _xy(xy), _wh{0, 0}, _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
+          _content(), _shadow_style(shadow), _layout(WidgetLayout::Floating), _box_style(box) {}
+
+    // Full constructor
+    Widget(const Point& xy, const Point& wh, Colors color, Quad margin, Quad padding,
+             std::vector<Widget> children, std::basic_string<TChar> content, ShadowStyle shadow, WidgetLayout layout,
+             const BoxStyle* box)
+        : _xy(xy), _wh(wh), _color(color), _margin(margin), _padding(padding), _children(std::move(children)),
+          _content(std::move(content)), _shadow_style(shadow), _layout(layout), _box_style(box) { relink(); }
+
+    Widget(const Widget& other)
+        : Widget(other._xy, other._wh, other._color, other._margin, other._padding, other._children, other._content,
+                 other._shadow_style, other._layout, other._box_style)
+    {
+        _selectable = other._selectable;
+        on_event = other.on_event;
+        _list = other._list;
+        _layout_dirty = other._layout_dirty;
+    }
+
+    // Keeps the parent, so vector reallocation does not unlink the children
+    Widget(Widget&& other) noexcept
+        : Widget(other._xy, other._wh, other._color, other._margin, other._padding, std::move(other._children),
+                 std::move(other._content), other._shadow_style, other._layout, other._box_style)
+    {
+        _selectable = other._selectable;
+        on_event = other.on_event;
+        _list = std::move(other._list);
+        _layout_dirty = other._layout_dirty;
+        _parent = other._parent;
+    }
+
+    Widget& operator=(const Widget& other)
+    {
+        if (this != &other)
+        {
+            _xy = other._xy;
+            refresh(other);
+        }
+        return *this;
+    }
+
+    Widget& operator=(Widget&& other) noexcept
+    {
+        if (this != &other)
+        {
+            _xy = other._xy;
+            _wh = other._wh;
+            _color = other._color;
+            _margin = other._margin;
+            _padding = other._padding;
+            _children = std::move(other._children);
+            _content = std::move(other._content);
+            _shadow_style = other._shadow_style;
+            _layout = other._layout;
+            _box_style = other._box_style;
+            _selectable = other._selectable;
+            on_event = other.on_event;
+            _list = std::move(other._list);
+            relink();
+            invalidate();
+        }
+        return *this;
+    }
+
+    // Mark this widget and its ancestors for layout. Call it after changing the public fields directly.
+    // The whole path is walked, a widget can be dirty under a clean parent (a new one, or one changed
+    // through the fields) and the parent would skip it
+    void invalidate()
+    {
+        for (Widget* w = this; w; w = w->_parent)
+            w->_layout_dirty = true;
+    }
+
+    void set_text(const std::basic_string<TChar>& s)
+    {
+        if (_content == s) return;
+        _content = s;
+        invalidate();
+    }
+
+    void set_selectable(bool selectable) { _selectable = selectable; invalidate(); }
+    void set_color(Colors color) { _color = color; invalidate(); }
+    void set_margin(const Quad& margin) { _margin = margin; invalidate(); }
+    void set_padding(const Quad& padding) { _padding = padding; invalidate(); }
+    void set_box_style(const BoxStyle* box) { _box_style = box; invalidate(); }
+    void set_shadow_style(ShadowStyle shadow) { _shadow_style = shadow; invalidate(); }
+
+    Widget<TChar>& add_child(Widget<TChar>& wid) { _children.push_back(std::move(wid)); return adopt_back(); }
+
+    Widget<TChar>& add_child(const Widget<TChar>& wid) { _children.push_back(wid); return adopt_back(); }
+
+    Widget<TChar>& at(std::size_t i) { return _children[i]; }
+    Widget<TChar>& back() { return _children.back(); }
+    Widget<TChar>& front() { return _children.front(); }
+    std::size_t widgets_num() { return _children.size(); }
+
+    void refresh(const Widget<TChar>& rhs) // Similar to =, but preserves current widget position
+    {
+        // we don't copy _xy
+        _wh = rhs._wh;
+        _color = rhs._color;
+        _margin = rhs._margin;
+        _padding = rhs._padding;
+        _children = rhs._children;
+        _content = rhs._content;
+        _shadow_style = rhs._shadow_style;
+        _layout = rhs._layout;
+        _box_style = rhs._box_style;
+        _selectable = rhs._selectable;
+        on_event = rhs.on_event;
+        _list = rhs._list;
+        relink();
+        invalidate();
+    }
+
+    // Layout/rendering logic
+    // ======================
+
+    // Helper to get effective color from palette if set
+    template <class TStyle>
+    auto get_effective_color(const TStyle& style, bool active_window, bool win_always_active, bool selected) const
+    {
+        return widget_color(style, _color, _selectable, active_window, win_always_active, selected);
+    }
+
+    // Helper to get effective border color from palette if set
+    template <class TStyle>
+    auto get_border_color(const TStyle& style, bool active_window, bool selected) const
+    {
+        return widget_border_color(style, _selectable, active_window, selected);
+    }
+
+    template <class TColor>
+    static void draw_box(Surface<TColor, TChar>& surface, int x, int y, int w, int h, BoxStyle style, const TColor& color)
+    {
+        if (w < 2 || h < 2) return;
+        int x2 = x + w - 1, y2 = y + h - 1;
+
+        if (style.isna()) // is a NoBoxStyle
+            return;
+
+        // Corners
+        surface.overlay(x, y, BoxStyle::glyph<TChar>(style.tl), color);
+        surface.overlay(x2, y, BoxStyle::glyph<TChar>(style.tr), color);
+        surface.overlay(x, y2, BoxStyle::glyph<TChar>(style.bl), color);
+        surface.overlay(x2, y2, BoxStyle::glyph<TChar>(style.br), color);
+        // Top and bottom edges
+        TChar hline = BoxStyle::glyph<TChar>(style.hline), vline = BoxStyle::glyph<TChar>(style.vline);
+        for (int i = x + 1; i < x2; ++i)
+        {
+            surface.overlay(i, y, hline, color);
+            surface.overlay(i, y2, hline, color);
+        }
+        // Left and right edges
+        for (int i = y + 1; i < y2; ++i)
+        {
+            surface.overlay(x, i, vline, color);
+            surface.overlay(x2, i, vline, color);
+        }
+    }
+
+    // Recompute _wh of the dirty part of the subtree. Returns false if nothing had to be recomputed
+    bool layout()
+    {
+        if (!_layout_dirty)
+            return false;
+
+        auto [ml, mt, mr, mb] = _margin.tup();
+        auto [pl, pt, pr, pb] = _padding.tup();
+
+        switch (_layout)
+        {
+        case WidgetLayout::Horizontal:
+            {
+                int x = 0, max_h = 0;
+
+                for (int i = 0; i < _children.size(); i++)
+                {
+                    _children[i]._parent = this;
+                    _children[i].layout();
+
+                    if (i > 0)
+                        x += pl;
+                    if (i < _children.size() - 1)
+                        x += pr;
+
+                    x += _children[i]._wh.w();
+                    max_h = std::max(max_h, _children[i]._wh.h());
+                }
+                _wh.w() = x + ml + mr;
+                _wh.h() = max_h + mt + mb;
+                break;
+            }
+        case WidgetLayout::Vertical:
+            {
+                int y = 0, max_w = 0;
+                for (int i = 0; i < _children.size(); i++)
+                {
+                    _children[i]._parent = this;
+                    _children[i].layout();
+
+                    if (i > 0)
+                        y += pl;
+                    if (i < _children.size() - 1)
+                        y += pr;
+
+                    y += _children[i]._wh.h();
+                    max_w = std::max(max_w, _children[i]._wh.w());
+                }
+                _wh.w() = max_w + ml + mr;
+                _wh.h() = y + mt + mb;
+                break;
+            }
+        case WidgetLayout::Floating:
+            {
+                int max_x = 0, max_y = 0;
+                for (auto& child : _children)
+                {
+                    child._parent = this;
+                    child.layout();
+                    int child_x = child._xy.x() + child._wh.w();
+                    int child_y = child._xy.y() + child._wh.h();
+                    max_x = std::max(max_x, child_x);
+                    max_y = std::max(max_y, child_y);
+                }
+                _wh.w() = max_x + ml + mr;
+                _wh.h() = max_y + mt + mb;
+                break;
+            }
+        case WidgetLayout::Text:
+            {
+                _wh.w() = text_width<TChar>(_content) + ml + mr;
+                _wh.h() = 1 + mt + mb;
+                break;
+            }
+        case WidgetLayout::List:
+            {
+                Point size = _list ? _list->viewport() : Point{0, 0};
+                _wh = {size.w() + ml + mr, size.h() + mt + mb};
+                break;
+            }
+        }
+
+        // If box is present, increment size for box border
+        if (_box_style && !_box_style->isna())
+        {
+            //_margin += 1;
+            _wh += 2;
+        }
+
+        _layout_dirty = false;
+        _layout_gen++;
+        return true;
+    }
+
+    template <class TColor, template<class> class TStyle>
+    void render(Surface<TColor, TChar>& surface, const TStyle<TColor>& style, bool active_window, bool win_always_active, int x, int y,
+                const TColor& parent_color = TColor::None(), bool top_level = false, WidgetPath cur_path = {},
+                const WidgetPath* selected_path = nullptr)
+    {
+        // Nothing to draw if the widget and its shadow miss the surface. Children stay inside their parent
+        if (y >= surface.rows() || y + _wh.h() + 2 <= 0 || x >= surface.cols() || x + _wh.w() + 2 <= 0)
+            return;
+
+        bool selected;
+        if (selected_path && cur_path == *selected_path)
+            selected = true; // Force lazy eval
+        else
+            selected = false;
+
+        TColor effective_color = get_effective_color(style, active_window, win_always_active, selected).blend(parent_color);
+        auto [ml, mt, mr, mb] = _margin.tup();
+        auto [pl, pt, pr, pb] = _padding.tup();
+        // Opaque fill for top-level window
+        if (top_level)
+            surface.fill(x, y, _wh.w(), _wh.h(), ' ', effective_color);
+        // Draw box if needed
+        if (_box_style && !_box_style->isna())
+        {
+            TColor border_color = get_border_color(style, active_window, selected).blend(parent_color);
+            draw_box(surface, x, y, _wh.w(), _wh.h(), *_box_style, border_color);
+            x += 1;
+            y += 1;
+        }
+
+        cur_path.push_back(0); // Add last elem
+
+        switch (_layout)
+        {
+        case WidgetLayout::Horizontal:
+            {
+                int cur_x = x + ml;
+                for (int i = 0; i < _children.size(); i++)
+                {
+                    cur_path.back() = i;
+                    if (i > 0)
+                        cur_x += pl;
+                    if (cur_x >= surface.cols())
+                        break; // The rest is past the right edge
+                    _children[i].render(surface, style, active_window, win_always_active, cur_x, y + mt, effective_color,
+                                        false, cur_path, selected_path);
+                    if (i < _children.size() - 1)
+                        cur_x += pr;
+                    cur_x += _children[i]._wh.w();
+                }
+                break;
+            }
+        case WidgetLayout::Vertical:
+            {
+                int cur_y = y + mt;
+                for (int i = 0; i < _children.size(); i++)
+                {
+                    cur_path.back() = i;
+                    if (i > 0)
+                        cur_y += pt;
+                    if (cur_y >= surface.rows())
+                        break; // The rest is below the surface, e.g. the band being rasterized
+                    _children[i].render(surface, style, active_window, win_always_active, x + ml, cur_y, effective_color,
+                                        false, cur_path, selected_path);
+                    if (i < _children.size() - 1)
+                        cur_y += pb;
+                    cur_y += _children[i]._wh.h();
+                }
+                break;
+            }
+        case WidgetLayout::Floating:
+            {
+                for (std::size_t i = 0; i < _children.size(); i++)
+                {
+                    Widget& child = _children[i];
+                    cur_path.back() = static_cast<int>(i);
+                    child.render(surface, style, active_window, win_always_active, x + child._xy.x() + ml,
+                                 y + child._xy.y() + mt, effective_color, false, cur_path, selected_path);
+                }
+                break;
+            }
+        case WidgetLayout::Text:
+            {
+                surface.overlay_text(x + ml, y + mt, _content, effective_color);
+                break;
+            }
+        case WidgetLayout::List:
+            {
+                // Rows in the plain color, the cursor row highlighted like a selectable widget
+                if (_list)
+                    _list->render(surface, x + ml, y + mt,
+                                  widget_color(style, _color, false, active_window, win_always_active, false).blend(parent_color),
+                                  effective_color);
+                break;
+            }
+        }
+
+        // Fill the rectangle with color if the flag is set
+        int box_offset = ((_box_style && _box_style->isna()) ? 0 : 2);
+        int shadow_size = ((_box_style && _box_style->isna()) ? 1 : 2);
+
+        int shadow_rows = _wh.h() - box_offset + shadow_size - 1;
+        int shadow_cols = _wh.w() - box_offset + shadow_size - 1;
+
+        switch (_shadow_style)
+        {
+        case ShadowStyle::Fill:
+            surface.blend(x, y, _wh.w() - box_offset, _wh.h() - box_offset, effective_color);
+            break;
+        case ShadowStyle::Shadow:
+            surface.blend(x, y, shadow_cols + 1, shadow_rows + 1, effective_color);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Call fn(list, x, y) for every list under this widget, at the place render() draws it
+    template <class Fn>
+    void for_each_list(int x, int y, Fn&& fn)
+    {
+        auto [ml, mt, mr, mb] = _margin.tup();
+        auto [pl, pt, pr, pb] = _padding.tup();
+        if (_box_style && !_box_style->isna())
+        {
+            x += 1;
+            y += 1;
+        }
+        if (_layout == WidgetLayout::List && _list)
+            fn(*_list, x + ml, y + mt);
+
+        int cur_x = x + ml, cur_y = y + mt;
+        for (std::size_t i = 0; i < _children.size(); i++)
+        {
+            Widget& child = _children[i];
+            switch (_layout)
+            {
+            case WidgetLayout::Horizontal:
+                if (i > 0) cur_x += pl;
+                child.for_each_list(cur_x, y + mt, fn);
+                if (i + 1 < _children.size()) cur_x += pr;
+                cur_x += child._wh.w();
+                break;
+            case WidgetLayout::Vertical:
+                if (i > 0) cur_y += pt;
+                child.for_each_list(x + ml, cur_y, fn);
+                if (i + 1 < _children.size()) cur_y += pb;
+                cur_y += child._wh.h();
+                break;
+            default:
+                child.for_each_list(x + child._xy.x() + ml, y + child._xy.y() + mt, fn);
+                break;
+            }
+        }
+    }
+
+protected:
+    void relink()
+    {
+        for (auto& child : _children)
+            child._parent = this;
+    }
+
+    Widget<TChar>& adopt_back()
+    {
+        relink(); // push_back may have moved the children
+        invalidate();
+        return _children.back();
+    }
+};
+
+
+// Uniform grid over the selectable widgets of one window, used for directional focus. Rects are absolute
+// (relative to the window origin) and follow the same placement rules as Widget::render
+template<class TChar>
+class FocusIndex
+{
+public:
+    struct Item
+    {
+        Quad rect;
+        WidgetPath path;
+    };
+
+    std::size_t _serial = std::numeric_limits<std::size_t>::max(); // Window the index was built for
+    std::size_t _layout_gen = 0;
+
+    [[nodiscard]] bool current(std::size_t serial, const Widget<TChar>& root) const
+    {
+        return _serial == serial && _layout_gen == root._layout_gen;
+    }
+
+    [[nodiscard]] const std::vector<Item>& items() const { return _items; }
+
+    // Collect the selectable widgets of a laid out window and bucket them by center
+    void build(const Widget<TChar>& root, std::size_t serial)
+    {
+        _serial = serial;
+        _layout_gen = root._layout_gen;
+        _items.clear();
+        WidgetPath path;
+        collect(root, 0, 0, path);
+
+        // Aim for about two items per cell, cells follow the aspect of the window
+        int w = std::max(1, root._wh.w()), h = std::max(1, root._wh.h());
+        double cells = std::max<double>(1.0, _items.size() / 2.0);
+        _gx = std::clamp(static_cast<int>(std::sqrt(cells * w / h) + 0.5), 1, w);
+        _gy = std::clamp(static_cast<int>(std::ceil(cells / _gx)), 1, h);
+        _cw = (w + _gx - 1) / _gx;
+        _ch = (h + _gy - 1) / _gy;
+
+        // Counting sort of the items into cells
+        _cell_start.assign(static_cast<std::size_t>(_gx * _gy) + 1, 0);
+        for (const Item& it : _items)
+            _cell_start[cell_of(it) + 1]++;
+        for (std::size_t c = 1; c < _cell_start.size(); ++c)
+            _cell_start[c] += _cell_start[c - 1];
+        _cell_items.resize(_items.size());
+        _x2 = {std::numeric_limits<int>::max(), std::numeric_limits<int>::min()};
+        _y2 = _x2;
+        for (const Item& it : _items)
+        {
+            _x2 = {std::min(_x2.x(), cx2(it)), std::max(_x2.y(), cx2(it))};
+            _y2 = {std::min(_y2.x(), cy2(it)), std::max(_y2.y(), cy2(it))};
+        }
+        _fill.assign(_cell_start.begin(), _cell_start.end() - 1);
+        for (std::size_t i = 0; i < _items.size(); ++i)
+            _cell_items[_fill[cell_of(_items[i])]++] = static_cast<std::uint32_t>(i);
+    }
+
+    // Index of the item for path, or -1. The last result is tried first, it is usually the selection
+    [[nodiscard]] int find(const WidgetPath& path) const
+    {
+        if (_hint >= 0 && _hint < (int)_items.size() && _items[_hint].path == path)
+            return _hint;
+        for (std::size_t i = 0; i < _items.size(); ++i)
+            if (_items[i].path == path)
+                return _hint = static_cast<int>(i);
+        return -1;
+    }
+
+    // Nearest item from item `from` in direction dir, or -1. Candidates in the 90 degree cone around dir
+    // win over the rest of the half plane. from = -1 starts at the window origin.
+    // Rings of cells are visited outwards until they can't beat the best cone candidate, or, past the
+    // last ring that can hold a cone candidate, the best half plane one
+    [[nodiscard]] int nearest(int from, EventType dir, int* best_dist = nullptr) const
+    {
+        if (_items.empty()) return -1;
+        int px = 0, py = 0; // Doubled center coordinates
+        if (from >= 0)
+        {
+            px = cx2(_items[from]);
+            py = cy2(_items[from]);
+        }
+        int gx = std::clamp(px / 2 / _cw, 0, _gx - 1);
+        int gy = std::clamp(py / 2 / _ch, 0, _gy - 1);
+
+        // Farthest any item lies along dir. A cone candidate is no farther than that on either axis
+        long long reach;
+        switch (dir)
+        {
+        case EventType::ArrowUp: reach = py - _y2.x(); break;
+        case EventType::ArrowDown: reach = _y2.y() - py; break;
+        case EventType::ArrowLeft: reach = px - _x2.x(); break;
+        case EventType::ArrowRight: reach = _x2.y() - px; break;
+        default: return -1;
+        }
+        if (reach <= 0) return -1;
+        long long cone_r = reach / (2LL * std::min(_cw, _ch)) + 1;
+
+        long long cone_dist = std::numeric_limits<long long>::max(), half_dist = cone_dist;
+        int cone = -1, half = -1;
+        int max_r = std::max(_gx, _gy);
+        for (int r = 0; r <= max_r; ++r)
+        {
+            // Closest a point in ring r can be, in doubled units
+            long long lb = 2LL * std::max(0, r - 1) * std::min(_cw, _ch);
+            if (cone >= 0 && lb * lb > cone_dist)
+                break;
+            if (cone < 0 && half >= 0 && r > cone_r && lb * lb > half_dist)
+                break;
+
+            for (int y = gy - r; y <= gy + r; ++y)
+            {
+                if (y < 0 || y >= _gy) continue;
+                bool edge_row = (y == gy - r || y == gy + r);
+                for (int x = gx - r; x <= gx + r; x += (edge_row ? 1 : 2 * std::max(r, 1)))
+                {
+                    if (x < 0 || x >= _gx) continue;
+                    int c = y * _gx + x;
+                    for (std::uint32_t k = _cell_start[c]; k < _cell_start[c + 1]; ++k)
+                    {
+                        int i = static_cast<int>(_cell_items[k]);
+                        if (i == from) continue;
+                        long long dx = cx2(_items[i]) - px, dy = cy2(_items[i]) - py;
+                        long long along, across;
+                        switch (dir)
+                        {
+                        case EventType::ArrowUp: along = -dy; across = dx; break;
+                        case EventType::ArrowDown: along = dy; across = dx; break;
+                        case EventType::ArrowLeft: along = -dx; across = dy; break;
+                        case EventType::ArrowRight: along = dx; across = dy; break;
+                        default: return -1;
+                        }
+                        if (along <= 0) continue;
+                        long long d = dx * dx + dy * dy;
+                        if (along >= std::abs(across))
+                        {
+                            if (d < cone_dist || (d == cone_dist && i < cone)) { cone_dist = d; cone = i; }
+                        }
+                        else if (d < half_dist || (d == half_dist && i < half))
+                        {
+                            half_dist = d;
+                            half = i;
+                        }
+                    }
+                }
+            }
+        }
+        int best = cone >= 0 ? cone : half;
+        if (best >= 0)
+            _hint = best;
+        if (best_dist && best >= 0)
+            *best_dist = static_cast<int>(std::min<long long>((cone >= 0 ? cone_dist : half_dist) / 4,
+                                                              std::numeric_limits<int>::max()));
+        return best;
+    }
+
+protected:
+    static int cx2(const Item& it) { return it.rect.l() + it.rect.r(); }
+    static int cy2(const Item& it) { return it.rect.t() + it.rect.b(); }
+
+    [[nodiscard]] std::size_t cell_of(const Item& it) const
+    {
+        int x = std::clamp(cx2(it) / 2 / _cw, 0, _gx - 1);
+        int y = std::clamp(cy2(it) / 2 / _ch, 0, _gy - 1);
+        return static_cast<std::size_t>(y * _gx + x);
+    }
+
+    // Mirrors the child placement of Widget::render
+    void collect(const Widget<TChar>& w, int x, int y, WidgetPath& path)
+    {
+        if (w._selectable && !path.empty())
+            _items.push_back({{x, y, x + w._wh.w(), y + w._wh.h()}, path});
+        if (w._layout == WidgetLayout::Text || w._children.empty())
+            return;
+
+        auto [ml, mt, mr, mb] = w._margin.tup();
+        auto [pl, pt, pr, pb] = w._padding.tup();
+        if (w._box_style && !w._box_style->isna())
+        {
+            x += 1;
+            y += 1;
+        }
+
+        int cur_x = x + ml, cur_y = y + mt;
+        int n = static_cast<int>(w._children.size());
+        path.push_back(0);
+        for (int i = 0; i < n; ++i)
+        {
+            const Widget<TChar>& child = w._children[i];
+            path.back() = i;
+            switch (w._layout)
+            {
+            case WidgetLayout::Horizontal:
+                if (i > 0) cur_x += pl;
+                collect(child, cur_x, y + mt, path);
+                if (i < n - 1) cur_x += pr;
+                cur_x += child._wh.w();
+                break;
+            case WidgetLayout::Vertical:
+                if (i > 0) cur_y += pt;
+                collect(child, x + ml, cur_y, path);
+                if (i < n - 1) cur_y += pb;
+                cur_y += child._wh.h();
+                break;
+            default:
+                collect(child, x + child._xy.x() + ml, y + child._xy.y() + mt, path);
+                break;
+            }
+        }
+        path.pop_back();
+    }
+
+    std::vector<Item> _items;
+    std::vector<std::uint32_t> _cell_start, _cell_items, _fill;
+    Point _x2, _y2; // Range of the doubled item centers, min and max
+    int _gx = 1, _gy = 1, _cw = 1, _ch = 1;
+    mutable int _hint = -1;
+};
+
+
+// Handle to a WidgetTree node. The generation catches handles to nodes that were removed
+struct WidgetHandle
+{
+    static constexpr std::uint32_t npos = std::numeric_limits<std::uint32_t>::max();
+
+    std::uint32_t index = npos;
+    std::uint32_t gen = 0;
+
+    [[nodiscard]] constexpr bool isna() const { return index == npos; }
+    constexpr bool operator==(const WidgetHandle& other) const = default;
+};
+
+
+// Flat widget tree. Nodes live in one table and are linked with parent/child/sibling indices, so adding
+// nodes never invalidates handles and layout/render are iterative passes over contiguous memory.
+// Removed nodes go to a free list and bump their generation
+template<class TChar>
+class WidgetTree
+{
+public:
+    static constexpr std::uint32_t npos = WidgetHandle::npos;
+
+    struct Node
+    {
+        Point _xy; // Relative to the parent, used by Floating layout
+        Point _wh; // Computed by layout()
+        Colors _color = Colors::Primary;
+        Quad _margin{0, 0, 0, 0};
+        Quad _padding{0, 0, 0, 0};
+        std::basic_string<TChar> _content;
+        ShadowStyle _shadow_style = ShadowStyle::None;
+        WidgetLayout _layout = WidgetLayout::Text;
+        const BoxStyle* _box_style = nullptr;
+        bool _selectable = false;
+        std::shared_ptr<ListView<TChar>> _list;
+
+        std::uint32_t parent = npos;
+        std::uint32_t first_child = npos;
+        std::uint32_t last_child = npos;
+        std::uint32_t prev_sibling = npos;
+        std::uint32_t next_sibling = npos;
+        std::uint32_t children = 0;
+        std::uint32_t gen = 0;
+        bool alive = false;
+        bool dirty = true;
+
+        [[nodiscard]] bool has_box() const { return _box_style && !_box_style->isna(); }
+    };
+
+    WidgetTree() = default;
+
+    // Node data, nullptr if the handle is stale
+    Node* get(WidgetHandle h)
+    {
+        if (h.index >= _nodes.size() || !_nodes[h.index].alive || _nodes[h.index].gen != h.gen)
+            return nullptr;
+        return &_nodes[h.index];
+    }
+
+    const Node* get(WidgetHandle h) const { return const_cast<WidgetTree*>(this)->get(h); }
+
+    [[nodiscard]] bool valid(WidgetHandle h) const { return get(h) != nullptr; }
+    [[nodiscard]] std::size_t size() const { return _nodes.size() - _free.size(); }
+
+    [[nodiscard]] WidgetHandle handle(std::uint32_t index) const { return {index, _nodes[index].gen}; }
+    [[nodiscard]] WidgetHandle parent(WidgetHandle h) const { const Node* n = get(h); return (n && n->parent != npos) ? handle(n->parent) : WidgetHandle{}; }
+
+    // Add a node as the last child of parent, or as a root if parent is empty
+    WidgetHandle add(WidgetHandle parent, Node data)
+    {
+        std::uint32_t p = npos;
+        if (!parent.isna())
+        {
+            if (!get(parent)) return {};
+            p = parent.index;
+        }
+
+        std::uint32_t idx;
+        if (!_free.empty())
+        {
+            idx = _free.back();
+            _free.pop_back();
+        }
+        else
+        {
+            idx = static_cast<std::uint32_t>(_nodes.size());
+            _nodes.emplace_back();
+        }
+
+        Node& n = _nodes[idx];
+        std::uint32_t gen = n.gen;
+        n = std::move(data);
+        n.gen = gen;
+        n.alive = true;
+        n.dirty = true;
+        n.parent = p;
+        n.first_child = n.last_child = n.prev_sibling = n.next_sibling = npos;
+        n.children = 0;
+
+        if (p != npos)
+        {
+            Node& pn = _nodes[p];
+            n.prev_sibling = pn.last_child;
+            if (pn.last_child != npos)
+                _nodes[pn.last_child].next_sibling = idx;
+            else
+                pn.first_child = idx;
+            pn.last_child = idx;
+            pn.children++;
+            invalidate(p);
+        }
+        return {idx, gen};
+    }
+
+    WidgetHandle add_text(WidgetHandle parent, std::basic_string<TChar> text, Colors color = Colors::Primary)
+    {
+        Node n;
+        n._content = std::move(text);
+        n._color = color;
+        return add(parent, std::move(n));
+    }
+
+    // Remove the node with its subtree. All handles to them become stale
+    void remove(WidgetHandle h)
+    {
+        Node* n = get(h);
+        if (!n) return;
+
+        if (n->parent != npos)
+        {
+            Node& pn = _nodes[n->parent];
+            if (n->prev_sibling != npos) _nodes[n->prev_sibling].next_sibling = n->next_sibling;
+            else pn.first_child = n->next_sibling;
+            if (n->next_sibling != npos) _nodes[n->next_sibling].prev_sibling = n->prev_sibling;
+            else pn.last_child = n->prev_sibling;
+            pn.children--;
+            invalidate(n->parent);
+        }
+
+        _stack.clear();
+        _stack.push_back({h.index});
+        while (!_stack.empty())
+        {
+            std::uint32_t idx = _stack.back().node;
+            _stack.pop_back();
+            for (std::uint32_t c = _nodes[idx].first_child; c != npos; c = _nodes[c].next_sibling)
+                _stack.push_back({c});
+            std::uint32_t gen = _nodes[idx].gen + 1;
+            _nodes[idx] = Node{};
+            _nodes[idx].gen = gen;
+            _free.push_back(idx);
+        }
+    }
+
+    // Mark a node and its ancestors for layout. Call it after changing the node fields directly
+    void invalidate(WidgetHandle h) { if (get(h)) invalidate(h.index); }
+
+    void set_text(WidgetHandle h, const std::basic_string<TChar>& text)
+    {
+        Node* n = get(h);
+        if (!n || n->_content == text) return;
+        n->_content = text;
+        invalidate(h.index);
+    }
+
+    // Copy a Widget tree under parent (or as a new root). Returns the handle of its root
+    WidgetHandle import(const Widget<TChar>& root, WidgetHandle parent = {})
+    {
+        WidgetHandle h = add(parent, from_widget(root));
+        for (const auto& child : root._children)
+            import(child, h);
+        return h;
+    }
+
+    // Recompute _wh of the dirty nodes under root. Clean subtrees keep their cached size
+    void layout(WidgetHandle root)
+    {
+        if (!get(root) || !_nodes[root.index].dirty) return;
+
+        // Post-order: a node is computed after all of its children
+        _stack.clear();
+        _stack.push_back({root.index});
+        while (!_stack.empty())
+        {
+            Frame& f = _stack.back();
+            if (!f.exit)
+            {
+                f.exit = true;
+                std::uint32_t idx = f.node;
+                for (std::uint32_t c = _nodes[idx].first_child; c != npos; c = _nodes[c].next_sibling)
+                    if (_nodes[c].dirty)
+                        _stack.push_back({c});
+                continue;
+            }
+            std::uint32_t idx = f.node;
+            _stack.pop_back();
+            layout_node(_nodes[idx]);
+        }
+    }
+
+    // Same output as Widget::render for the imported tree. selected replaces the path of the selected widget
+    template <class TColor, template<class> class TStyle>
+    void render(WidgetHandle root, Surface<TColor, TChar>& surface, const TStyle<TColor>& style, bool active_window,
+                bool win_always_active, int x, int y, WidgetHandle selected = {}, bool top_level = true)
+    {
+        if (!get(root)) return;
+        std::vector<RenderFrame<TColor>>& stack = render_stack<TColor>();
+        stack.clear();
+        stack.push_back({root.index, x, y, TColor::None(), false});
+
+        while (!stack.empty())
+        {
+            RenderFrame<TColor> f = stack.back();
+            stack.pop_back();
+            const Node& n = _nodes[f.node];
+            auto [ml, mt, mr, mb] = n._margin.tup();
+            auto [pl, pt, pr, pb] = n._padding.tup();
+
+            if (f.exit)
+            {
+                // Shadow goes over the children, f.x and f.y are already inside the box
+                int box_offset = ((n._box_style && n._box_style->isna()) ? 0 : 2);
+                int shadow_size = ((n._box_style && n._box_style->isna()) ? 1 : 2);
+                if (n._shadow_style == ShadowStyle::Fill)
+                    surface.blend(f.x, f.y, n._wh.w() - box_offset, n._wh.h() - box_offset, f.color);
+                else if (n._shadow_style == ShadowStyle::Shadow)
+                    surface.blend(f.x, f.y, n._wh.w() - box_offset + shadow_size, n._wh.h() - box_offset + shadow_size, f.color);
+                continue;
+            }
+
+            bool is_selected = !selected.isna() && selected.index == f.node && selected.gen == n.gen;
+            TColor color = widget_color(style, n._color, n._selectable, active_window, win_always_active, is_selected).blend(f.color);
+            int cx = f.x, cy = f.y;
+            if (top_level && f.node == root.index)
+                surface.fill(cx, cy, n._wh.w(), n._wh.h(), ' ', color);
+            if (n.has_box())
+            {
+                TColor border = widget_border_color(style, n._selectable, active_window, is_selected).blend(f.color);
+                Widget<TChar>::draw_box(surface, cx, cy, n._wh.w(), n._wh.h(), *n._box_style, border);
+                cx += 1;
+                cy += 1;
+            }
+
+            stack.push_back({f.node, cx, cy, color, true});
+            if (n._layout == WidgetLayout::Text)
+            {
+                surface.overlay_text(cx + ml, cy + mt, n._content, color);
+                continue;
+            }
+            if (n._layout == WidgetLayout::List)
+            {
+                if (n._list)
+                    n._list->render(surface, cx + ml, cy + mt,
+                                    widget_color(style, n._color, false, active_window, win_always_active, false).blend(f.color),
+                                    color);
+                continue;
+            }
+
+            // Children go on the stack in reverse, so the first one is rendered first
+            std::size_t first = stack.size();
+            int cur_x = cx + ml, cur_y = cy + mt;
+            std::uint32_t i = 0;
+            for (std::uint32_t c = n.first_child; c != npos; c = _nodes[c].next_sibling, i++)
+            {
+                const Node& child = _nodes[c];
+                switch (n._layout)
+                {
+                case WidgetLayout::Horizontal:
+                    if (i > 0) cur_x += pl;
+                    stack.push_back({c, cur_x, cy + mt, color, false});
+                    if (i + 1 < n.children) cur_x += pr;
+                    cur_x += child._wh.w();
+                    break;
+                case WidgetLayout::Vertical:
+                    if (i > 0) cur_y += pt;
+                    stack.push_back({c, cx + ml, cur_y, color, false});
+                    if (i + 1 < n.children) cur_y += pb;
+                    cur_y += child._wh.h();
+                    break;
+                default:
+                    stack.push_back({c, cx + child._xy.x() + ml, cy + child._xy.y() + mt, color, false});
+                    break;
+                }
+            }
+            std::reverse(stack.begin() + static_cast<std::ptrdiff_t>(first), stack.end());
+        }
+    }
+
+protected:
+    struct Frame
+    {
+        std::uint32_t node;
+        bool exit = false;
+    };
+
+    template<class TColor>
+    struct RenderFrame
+    {
+        std::uint32_t node;
+        int x, y;
+        TColor color; // Parent color on enter, own color on exit
+        bool exit;
+    };
+
+    // One reusable stack per color type
+    template<class TColor>
+    static std::vector<RenderFrame<TColor>>& render_stack()
+    {
+        thread_local std::vector<RenderFrame<TColor>> stack;
+        return stack;
+    }
+
+    static Node from_widget(const Widget<TChar>& w)
+    {
+        Node n;
+        n._xy = w._xy;
+        n._wh = w._wh;
+        n._color = w._color;
+        n._margin = w._margin;
+        n._padding = w._padding;
+        n._content = w._content;
+        n._shadow_style = w._shadow_style;
+        n._layout = w._layout;
+        n._box_style = w._box_style;
+        n._selectable = w._selectable;
+        n._list = w._list;
+        return n;
+    }
+
+    void invalidate(std::uint32_t idx)
+    {
+        for (; idx != npos && !_nodes[idx].dirty; idx = _nodes[idx].parent)
+            _nodes[idx].dirty = true;
+    }
+
+    // Same rules as Widget::layout, children are already up to date
+    void layout_node(Node& n)
+    {
+        auto [ml, mt, mr, mb] = n._margin.tup();
+        auto [pl, pt, pr, pb] = n._padding.tup();
+        switch (n._layout)
+        {
+        case WidgetLayout::Horizontal:
+        case WidgetLayout::Vertical:
+            {
+                bool horizontal = n._layout == WidgetLayout::Horizontal;
+                int along = 0, across = 0;
+                std::uint32_t i = 0;
+                for (std::uint32_t c = n.first_child; c != npos; c = _nodes[c].next_sibling, i++)
+                {
+                    const Node& child = _nodes[c];
+                    if (i > 0) along += pl;
+                    if (i + 1 < n.children) along += pr;
+                    along += horizontal ? child._wh.w() : child._wh.h();
+                    across = std::max(across, horizontal ? child._wh.h() : child._wh.w());
+                }
+                n._wh = horizontal ? Point{along + ml + mr, across + mt + mb} : Point{across + ml + mr, along + mt + mb};
+                break;
+            }
+        case WidgetLayout::Floating:
+            {
+                int max_x = 0, max_y = 0;
+                for (std::uint32_t c = n.first_child; c != npos; c = _nodes[c].next_sibling)
+                {
+                    const Node& child = _nodes[c];
+                    max_x = std::max(max_x, child._xy.x() + child._wh.w());
+                    max_y = std::max(max_y, child._xy.y() + child._wh.h());
+                }
+                n._wh = {max_x + ml + mr, max_y + mt + mb};
+                break;
+            }
+        case WidgetLayout::Text:
+            n._wh = {text_width<TChar>(n._content) + ml + mr, 1 + mt + mb};
+            break;
+        case WidgetLayout::List:
+            {
+                Point size = n._list ? n._list->viewport() : Point{0, 0};
+                n._wh = {size.w() + ml + mr, size.h() + mt + mb};
+                break;
+            }
+        }
+        if (n.has_box())
+            n._wh += 2;
+        n.dirty = false;
+    }
+
+    std::vector<Node> _nodes;
+    std::vector<std::uint32_t> _free;
+    std::vector<Frame> _stack; // Reused by the iterative passes
+};
+
+
+enum class IPWindowFlags : std::size_t
+{
+    Modal = 0b1,
+    AlwaysActive = 0b10,
+};
+// Last window flag
+static constexpr IPWindowFlags IPWindowFlagsLast = IPWindowFlags::AlwaysActive;
+
+
+// Window stack and selector logic
+template<class TChar>
+class WindowStack
+{
+public:
+    std::vector<Widget<TChar>> stack; // Topmost is last
+    std::vector<int> window_ids;
+    int selector_idx = -1; // Index of selected widget in stack
+    std::vector<WidgetPath> selection_paths; // Selected widget in each window
+    std::vector<Widget<TChar>> overlays; // Overlay windows, not selectable
+    std::vector<std::size_t> flags;
+    std::vector<std::size_t> serials; // Unique per pushed window, stays the same while it is on the stack
+    std::vector<std::size_t> overlay_serials;
+    std::size_t _next_serial = 0;
+    bool capture_events = false; // Deliver events from the root down before bubbling them up
+
+    // Scratch for occlusion culling, reused between frames
+    std::vector<int> _order;
+    std::vector<Quad> _opaque;
+    std::vector<std::pair<int, int>> _spans, _spans_scratch;
+    std::vector<FocusIndex<TChar>> _focus; // Directional focus, per window. Checked against serials on use
+
+    int _dbg_best_dist = std::numeric_limits<int>::max(); // DEBUG: best distance in selector
+
+    WindowStack() = default;
+
+    void push(Widget<TChar> w, std::size_t win_flags = 0, const int id = -1)
+    {
+        stack.push_back(std::move(w));
+        window_ids.push_back(id);
+        flags.push_back(win_flags);
+        serials.push_back(_next_serial++);
+        selector_idx = static_cast<int>(stack.size()) - 1;
+        // Default: select first selectable child in new window
+        WidgetPath path;
+        find_first_selectable_path(stack.back()._children, path);
+        selection_paths.push_back(path);
+        if (stack[selector_idx].on_event)
+            stack[selector_idx].on_event(&stack[selector_idx], this, IPEvent(EventType::OnCreate), {0});
+        // Widget should be 0
+    }
+
+    // Add overlay window (not selectable)
+    void push_overlay(Widget<TChar> w)
+    {
+        overlays.push_back(std::move(w));
+        overlay_serials.push_back(_next_serial++);
+    }
+
+    void pop(int index)
+    {
+        if (!stack.empty() && index >= 0)
+        {
+            if (stack[index].on_event)
+                stack[index].on_event(&stack[index], this, IPEvent(EventType::OnDestroy), {0});
+            // We are deleting the whole window
+
+            stack.erase(stack.begin() + index);
+            selection_paths.erase(selection_paths.begin() + index);
+            window_ids.erase(window_ids.begin() + index);
+            flags.erase(flags.begin() + index);
+            serials.erase(serials.begin() + index);
+
+            if (stack.size() - 1 >= index)
+                selector_idx = index;
+            else if (!stack.empty())
+                selector_idx = static_cast<int>(stack.size()) - 1;
+            else
+                selector_idx = -1;
+        }
+    }
+
+    Widget<TChar>* top() { return stack.empty() ? nullptr : &stack.back(); }
+
+    [[nodiscard]] bool check_modal_flag() const
+    {
+        if (selector_idx < 0 || selector_idx >= stack.size())
+            return false;
+
+        return flags[selector_idx] & (std::size_t)IPWindowFlags::Modal;
+    }
+
+    // Tab cycles through windows
+    void move_selector_tab(int dir)
+    {
+        if (stack.empty()) return;
+        if (check_modal_flag()) return;
+        const int n = static_cast<int>(stack.size());
+        int start = selector_idx;
+        for (int i = 1; i <= n; ++i)
+        {
+            int idx = (start + dir * i + n) % n;
+            selector_idx = idx;
+            return;
+        }
+    }
+
+    // Find first selectable widget path (depth-first)
+    static bool find_first_selectable_path(const std::vector<Widget<TChar>>& widgets, WidgetPath& path)
+    {
+        for (int i = 0; i < (int)widgets.size(); ++i)
+        {
+            if (widgets[i]._selectable)
+            {
+                path.push_back(i);
+                return true;
+            }
+            if (!widgets[i]._children.empty())
+            {
+                path.push_back(i);
+                if (find_first_selectable_path(widgets[i]._children, path)) return true;
+                path.pop_back();
+            }
+        }
+        return false;
+    }
+
+    // Move selection within the top window's widgets in a direction. The focus index of the window is
+    // rebuilt only after its layout changes
+    void move_child_selector_dir(EventType dir)
+    {
+        if (selector_idx < 0 || selector_idx >= (int)stack.size()) return;
+        Widget<TChar>& root = stack[selector_idx];
+        root.layout();
+
+        if (_focus.size() < stack.size())
+            _focus.resize(stack.size());
+        FocusIndex<TChar>& index = _focus[selector_idx];
+        if (!index.current(serials[selector_idx], root))
+            index.build(root, serials[selector_idx]);
+
+        WidgetPath& sel_path = selection_paths[selector_idx];
+        _dbg_best_dist = std::numeric_limits<int>::max();
+        int best = index.nearest(index.find(sel_path), dir, &_dbg_best_dist);
+        if (best >= 0) sel_path = index.items()[best].path;
+    }
+
+    // Deepest existing widget on the selection path of window idx. The path is cut to the levels that exist
+    Widget<TChar>* resolve_selected(int idx, WidgetPath& path)
+    {
+        Widget<TChar>* cur = &stack[idx];
+        for (std::size_t d = 0; d < path.size(); ++d)
+        {
+            int i = path[d];
+            if (i < 0 || i >= (int)cur->_children.size())
+            {
+                path = path.prefix(d);
+                break;
+            }
+            cur = &cur->_children[i];
+        }
+        return cur;
+    }
+
+    // Widget at path in window idx, nullptr if the window or any level of the path is gone
+    Widget<TChar>* resolve_path(int idx, const WidgetPath& path)
+    {
+        if (idx < 0 || idx >= (int)stack.size())
+            return nullptr;
+        Widget<TChar>* cur = &stack[idx];
+        for (std::size_t d = 0; d < path.size(); ++d)
+        {
+            if (path[d] < 0 || path[d] >= (int)cur->_children.size())
+                return nullptr;
+            cur = &cur->_children[path[d]];
+        }
+        return cur;
+    }
+
+    // Route event to the selected widget of the selected window, then up through its parents.
+    // With capture_events set, the handlers first see it from the root down with EventPhase::Capture.
+    // Handlers may change the tree or the windows: the path is resolved again after each of them,
+    // and the event is dropped once the selected window or a level of the path is gone
+    bool handle_event(const IPEvent& ev)
+    {
+        if (selector_idx >= 0 && selector_idx < stack.size())
+        {
+            int idx = selector_idx;
+            WidgetPath path = selection_paths[idx];
+            Widget<TChar>* leaf = resolve_selected(idx, path);
+            const WidgetPath leaf_path = path;
+
+            IPEvent e = ev;
+            if (capture_events)
+            {
+                e.phase = EventPhase::Capture;
+                Widget<TChar>* cur = &stack[idx];
+                WidgetPath sub;
+                for (std::size_t d = 0;; ++d)
+                {
+                    if (cur->on_event && cur->on_event(cur, this, e, sub))
+                        return true;
+                    if (d == path.size())
+                        break;
+                    // The handler may have changed the children or the windows, walk down again from the root.
+                    // The event is dropped once its path is gone
+                    sub.push_back(path[d]);
+                    cur = selector_idx == idx ? resolve_path(idx, sub) : nullptr;
+                    if (!cur)
+                        return false;
+                }
+                leaf = cur;
+            }
+
+            e.phase = EventPhase::Bubble;
+            Widget<TChar>* cur = leaf;
+            for (std::size_t d = path.size();; --d)
+            {
+                if (cur->on_event && cur->on_event(cur, this, e, path))
+                    return true;
+                if (d == 0)
+                    break;
+                // Same as above, the handler may have moved cur along with its siblings
+                path.pop_back();
+                cur = selector_idx == idx ? resolve_path(idx, path) : nullptr;
+                if (!cur)
+                    return false;
+            }
+
+            // Unhandled keys scroll a selected list, the arrows move the focus once it hits an edge.
+            // The handlers ran since leaf was resolved
+            leaf = selector_idx == idx ? resolve_path(idx, leaf_path) : nullptr;
+            if (!leaf)
+                return false;
+            if (leaf->_list && leaf->_list->handle_event(ev))
+            {
+                leaf->invalidate();
+                return true;
+            }
+
+            // THEN we handle it on window level
+            window_event_process(ev);
+            return false;
+        }
+        return false;
+    }
+
+    bool window_event_process(const IPEvent& ev)
+    {
+        if (int(ev.type) >= (int)EventType::ArrowUp && int(ev.type) <= (int)EventType::ArrowRight)
+        {
+            move_child_selector_dir(ev.type);
+            return true;
+        }
+        return false;
+    }
+
+    // Window geometry
+    // ===============
+
+    // Top-left corner of the window on screen
+    [[nodiscard]] Point window_pos(int idx) const
+    {
+        return {2 + 2 * idx + stack[idx]._xy.x(), 2 + 2 * idx + stack[idx]._xy.y()};
+    }
+
+    // Opaque area of a laid out widget at pos: the top-level fill covers all of _wh
+    static Quad opaque_rect(const Widget<TChar>& w, const Point& pos)
+    {
+        return {pos.x(), pos.y(), pos.x() + w._wh.w(), pos.y() + w._wh.h()};
+    }
+
+    // Everything the widget may paint at pos, including the shadow
+    static Quad paint_rect(const Widget<TChar>& w, const Point& pos)
+    {
+        return {pos.x(), pos.y(), pos.x() + w._wh.w() + 2, pos.y() + w._wh.h() + 2};
+    }
+
+    // Window indices in paint order, bottom first. The selected window is painted last
+    void z_order(std::vector<int>& order) const
+    {
+        order.clear();
+        int n = (int)stack.size();
+        if (n == 0) return;
+        int start = (selector_idx + 1) % n;
+        for (int i = 0; i < n; ++i)
+            order.push_back((start + i) % n);
+    }
+
+    // Lay out all windows, then compute their opaque rects in paint order. Everything after position i
+    // occludes the window at i. Overlays are not included, they may be rendered separately or not at all
+    void layout_all(std::vector<int>& order, std::vector<Quad>& opaque)
+    {
+        z_order(order);
+        opaque.clear();
+        for (int idx : order)
+        {
+            stack[idx].layout();
+            opaque.push_back(opaque_rect(stack[idx], window_pos(idx)));
+        }
+    }
+
+    // Same for the overlays, which are painted in order
+    void layout_overlays(std::vector<Quad>& opaque)
+    {
+        opaque.clear();
+        for (auto& overlay : overlays)
+        {
+            overlay.layout();
+            opaque.push_back(opaque_rect(overlay, overlay._xy));
+        }
+    }
+
+    // Render all windows, overlays last. Overlays are not _selectable.
+    // Windows hidden by the opaque windows above them are skipped
+    template <class TColor, template<class> class TStyle>
+    void render_all(Surface<TColor, TChar>& surface, const TStyle<TColor>& style)
+    {
+        int n = (int)stack.size();
+        if (n == 0) return;
+        layout_all(_order, _opaque);
+        for (int i = 0; i < n; ++i)
+        {
+            int idx = _order[i];
+            if (fully_covered(paint_rect(stack[idx], window_pos(idx)), std::span<const Quad>(_opaque).subspan(i + 1),
+                              _spans, _spans_scratch))
+                continue;
+
+            bool active = (idx == selector_idx);
+            // Paint the window in disabled style only if it has this flag
+            bool win_always_active = (flags[idx] & (std::size_t)IPWindowFlags::AlwaysActive);
+            stack[idx].render(surface, style, active, win_always_active, 2 + 2 * idx + stack[idx]._xy.x(), 2 + 2 * idx + stack[idx]._xy.y(), TColor::None(), true, {},
+                              (active ? &selection_paths[idx] : nullptr));
+        }
+    }
+
+    template <class TColor, template<class> class TStyle>
+    void render_overlays(Surface<TColor, TChar>& surface, const TStyle<TColor>& style)
+    {
+        // Render overlays last (not _selectable, not active)
+        for (auto& overlay : overlays)
+        {
+            overlay.layout();
+            overlay.render(surface, style, true, false, overlay._xy.x(), overlay._xy.y(), TColor::None(), true);
+        }
+    }
+
+    // Find the window according to its id. Returns the first match
+    int find(const int id)
+    {
+        for (int i = 0; i < window_ids.size(); i++)
+        {
+            if (window_ids[i] == id)
+                return i;
+        }
+        return -1;
+    }
+};
+
+
+// Occlusion helpers
+// =================
+
+// Parts of the row span [x0, x1) not covered by any of the rects (left, top, right, bottom; right and
+// bottom exclusive) on row y. scratch is reused between calls to avoid allocations
+inline void visible_spans(int y, int x0, int x1, std::span<const Quad> occluders,
+                          std::vector<std::pair<int, int>>& out, std::vector<std::pair<int, int>>& scratch)
+{
+    out.clear();
+    scratch.clear();
+    for (const Quad& q : occluders)
+    {
+        if (y < q.t() || y >= q.b()) continue;
+        int l = std::max(q.l(), x0), r = std::min(q.r(), x1);
+        if (l < r) scratch.emplace_back(l, r);
+    }
+    std::sort(scratch.begin(), scratch.end());
+
+    int x = x0;
+    for (auto [l, r] : scratch)
+    {
+        if (l > x) out.emplace_back(x, l);
+        x = std::max(x, r);
+    }
+    if (x < x1) out.emplace_back(x, x1);
+}
+
+// True if the rects cover the whole area
+inline bool fully_covered(const Quad& area, std::span<const Quad> occluders,
+                          std::vector<std::pair<int, int>>& out, std::vector<std::pair<int, int>>& scratch)
+{
+    for (int y = area.t(); y < area.b(); y++)
+    {
+        visible_spans(y, area.l(), area.r(), occluders, out, scratch);
+        if (!out.empty()) return false;
+    }
+    return true;
+}
+
+
+// Fixed set of worker threads for fork-join loops. The calling thread works too, so a pool of n threads
+// starts n - 1 workers
+class ThreadPool
+{
+public:
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+    {
+        for (unsigned i = 1; i < threads; i++)
+            _workers.emplace_back([this] { work(); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for (std::thread& t : _workers)
+            t.join();
+    }
+
+    [[nodiscard]] unsigned size() const { return static_cast<unsigned>(_workers.size()) + 1; }
+
+    // Call fn(i) for every i in [0, n) and wait until all calls returned. Not reentrant
+    template<class F>
+    void parallel_for(std::size_t n, F&& fn)
+    {
+        if (n <= 1 || _workers.empty())
+        {
+            for (std::size_t i = 0; i < n; i++)
+                fn(i);
+            return;
+        }
+
+        std::function<void(std::size_t)> job = [&fn](std::size_t i) { fn(i); };
+        {
+            std::lock_guard lock(_mutex);
+            _job = &job;
+            _n = n;
+            _next = 0;
+            _busy = _workers.size();
+            _generation++;
+        }
+        _wake.notify_all();
+        run();
+
+        std::unique_lock lock(_mutex);
+        _done.wait(lock, [this] { return _busy == 0; });
+        _job = nullptr;
+    }
+
+private:
+    void run()
+    {
+        for (std::size_t i; (i = _next.fetch_add(1, std::memory_order_relaxed)) < _n;)
+            (*_job)(i);
+    }
+
+    void work()
+    {
+        std::size_t seen = 0;
+        for (;;)
+        {
+            {
+                std::unique_lock lock(_mutex);
+                _wake.wait(lock, [&] { return _stop || _generation != seen; });
+                if (_stop) return;
+                seen = _generation;
+            }
+            run();
+            std::lock_guard lock(_mutex);
+            if (--_busy == 0)
+                _done.notify_one();
+        }
+    }
+
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _wake, _done;
+    const std::function<void(std::size_t)>* _job = nullptr;
+    std::size_t _n = 0;
+    std::atomic<std::size_t> _next = 0;
+    std::size_t _busy = 0;
+    std::size_t _generation = 0;
+    bool _stop = false;
+};
+
+
+// Retained rendering for a WindowStack. Each window is rasterized into its own offscreen surface, which
+// is redrawn only when the window subtree, its active state or its selection changes. Frames are built
+// by blitting the cached surfaces in z-order, so moving a window with _xy costs one blit
+template<class TColor, class TChar>
+class WindowCompositor
+{
+public:
+    template<template<class> class TStyle>
+    void render_all(WindowStack<TChar>& ws, Surface<TColor, TChar>& surface, const TStyle<TColor>& style)
+    {
+        check_style(&style);
+        _frame++;
+        ws.layout_all(_order, _opaque);
+        for (int i = 0; i < (int)_order.size(); ++i)
+        {
+            int idx = _order[i];
+            bool active = (idx == ws.selector_idx);
+            bool win_always_active = (ws.flags[idx] & (std::size_t)IPWindowFlags::AlwaysActive);
+            Widget<TChar>& win = ws.stack[idx];
+            Entry& e = entry(ws.serials[idx]);
+            const WidgetPath* sel = active ? &ws.selection_paths[idx] : nullptr;
+
+            // Hidden windows are neither rasterized nor blitted, the cache catches up once they show
+            Point pos = ws.window_pos(idx);
+            auto above = std::span<const Quad>(_opaque).subspan(i + 1);
+            if (fully_covered(WindowStack<TChar>::paint_rect(win, pos), above, _spans, _spans_scratch))
+                continue;
+
+            bool drawn = !e.valid || e.layout_gen != win._layout_gen || e.active != active ||
+                         e.always_active != win_always_active || e.selected != (sel != nullptr) ||
+                         (sel && e.selection != *sel);
+            if (drawn)
+                rasterize(e, win, style, active, win_always_active, sel);
+            forward_hints(surface, e, pos, drawn);
+
+            if (_pool)
+                _visible.push_back({static_cast<std::size_t>(&e - _entries.data()), &win, pos, static_cast<std::size_t>(i + 1)});
+            else
+                blit_visible(surface, e, win, pos, above);
+        }
+        if (_pool)
+            blit_parallel(surface);
+        prune();
+    }
+
+    template<template<class> class TStyle>
+    void render_overlays(WindowStack<TChar>& ws, Surface<TColor, TChar>& surface, const TStyle<TColor>& style)
+    {
+        check_style(&style);
+        ws.layout_overlays(_opaque);
+        for (std::size_t i = 0; i < ws.overlays.size(); i++)
+        {
+            Widget<TChar>& overlay = ws.overlays[i];
+            Entry& e = entry(ws.overlay_serials[i]);
+            auto above = std::span<const Quad>(_opaque).subspan(i + 1);
+            if (fully_covered(WindowStack<TChar>::paint_rect(overlay, overlay._xy), above, _spans, _spans_scratch))
+                continue;
+
+            bool drawn = !e.valid || e.layout_gen != overlay._layout_gen;
+            if (drawn)
+                rasterize(e, overlay, style, true, false, nullptr);
+            forward_hints(surface, e, overlay._xy, drawn);
+            blit_visible(surface, e, overlay, overlay._xy, above);
+        }
+    }
+
+    // Drop all cached surfaces, e.g. after changing the palette in place
+    void invalidate_all()
+    {
+        for (Entry& e : _entries)
+            e.valid = false;
+    }
+
+    // Rasterize and compose in row bands on n threads. 0 or 1 renders on the calling thread only.
+    // The output does not depend on the thread count
+    void set_threads(unsigned n)
+    {
+        if (n <= 1)
+            _pool.reset();
+        else if (!_pool || _pool->size() != n)
+            _pool = std::make_unique<ThreadPool>(n);
+    }
+
+    [[nodiscard]] unsigned threads() const { return _pool ? _pool->size() : 1; }
+
+    static constexpr int band_rows = 8; // Smallest band worth a task
+
+protected:
+    struct Entry
+    {
+        std::size_t serial = 0;
+        std::size_t frame = 0; // Last frame the window was on the stack
+        Surface<TColor, TChar> surface;
+        WidgetPath selection;
+        std::size_t layout_gen = 0;
+        Point pos{0, 0}; // Where it was blitted last
+        bool selected = false;
+        bool active = false;
+        bool always_active = false;
+        bool valid = false;
+    };
+
+    Entry& entry(std::size_t serial)
+    {
+        for (Entry& e : _entries)
+        {
+            if (e.serial == serial)
+            {
+                e.frame = _frame;
+                return e;
+            }
+        }
+        _entries.emplace_back();
+        _entries.back().serial = serial;
+        _entries.back().frame = _frame;
+        return _entries.back();
+    }
+
+    template<template<class> class TStyle>
+    void rasterize(Entry& e, Widget<TChar>& win, const TStyle<TColor>& style, bool active, bool win_always_active,
+                   const WidgetPath* sel)
+    {
+        // Room for the shadow, which goes past _wh
+        int rows = win._wh.h() + 2, cols = win._wh.w() + 2;
+        if (e.surface.rows() != rows || e.surface.cols() != cols)
+            e.surface.resize(rows, cols);
+        else
+            e.surface.clear();
+
+        int bands = _pool ? std::min<int>(rows / band_rows, static_cast<int>(_pool->size()) * 2) : 1;
+        if (bands <= 1)
+            win.render(e.surface, style, active, win_always_active, 0, 0, TColor::None(), true, {}, sel);
+        else
+            rasterize_bands(e.surface, bands, win, style, active, win_always_active, sel);
+        e.layout_gen = win._layout_gen;
+        e.active = active;
+        e.always_active = win_always_active;
+        e.selected = (sel != nullptr);
+        if (sel) e.selection = *sel;
+        e.valid = true;
+    }
+
+    // Scroll hints left by a fresh rasterization go to the screen surface. They describe what the window
+    // showed before, so they only hold if it is still at the same place
+    static void forward_hints(Surface<TColor, TChar>& surface, Entry& e, const Point& pos, bool drawn)
+    {
+        if (drawn && pos == e.pos)
+        {
+            for (const auto& h : e.surface.scroll_hints())
+                surface.hint_scroll(pos.x() + h.x, pos.y() + h.y, h.w, h.h, h.n);
+        }
+        e.pos = pos;
+    }
+
+    // Blit only the parts of the window that no opaque rect above covers
+    void blit_visible(Surface<TColor, TChar>& surface, const Entry& e, const Widget<TChar>& win, const Point& pos,
+                      std::span<const Quad> above)
+    {
+        for (int j = 0; j < e.surface.rows(); j++)
+        {
+            visible_spans(pos.y() + j, pos.x(), pos.x() + e.surface.cols(), above, _spans, _spans_scratch);
+            for (auto [l, r] : _spans)
+                surface.blit_row(e.surface, pos.x(), pos.y(), win._wh.w(), win._wh.h(), j, l - pos.x(), r - pos.x());
+        }
+    }
+
+    // Every band renders the tree into its own surface, offset so that only its rows land inside, and
+    // Widget::render skips the subtrees outside of them. The drawn spans are then copied to the window
+    // surface. Drawing never reads other rows, so the cells are the same as from a single render.
+    // Lists are updated (scroll hints, fetches) once up front, the bands only read them
+    template<template<class> class TStyle>
+    void rasterize_bands(Surface<TColor, TChar>& target, int bands, Widget<TChar>& win, const TStyle<TColor>& style,
+                         bool active, bool win_always_active, const WidgetPath* sel)
+    {
+        int rows = target.rows(), cols = target.cols();
+        if ((int)_band_surfaces.size() < bands)
+            _band_surfaces.resize(bands);
+        win.for_each_list(0, 0, [&](ListView<TChar>& list, int x, int y) { list.share(target, x, y); });
+        _pool->parallel_for(bands, [&](std::size_t b)
+        {
+            int y0 = rows * (int)b / bands, y1 = rows * ((int)b + 1) / bands;
+            Surface<TColor, TChar>& band = _band_surfaces[b];
+            if (band.rows() != y1 - y0 || band.cols() != cols)
+                band.resize(y1 - y0, cols);
+            else
+                band.clear();
+
+            win.render(band, style, active, win_always_active, 0, -y0, TColor::None(), true, {}, sel);
+            for (int j = 0; j < y1 - y0; j++)
+            {
+                const DamageList& damage = band.damage();
+                if (!damage.damaged(j)) continue;
+                std::copy(band.row(j).begin() + damage.lo(j), band.row(j).begin() + damage.hi(j),
+                          target.row(y0 + j).begin() + damage.lo(j));
+                target.touch(y0 + j, damage.lo(j), damage.hi(j));
+            }
+        });
+        win.for_each_list(0, 0, [](ListView<TChar>& list, int, int) { list.unshare(); });
+    }
+
+    // Compose the visible windows in screen row bands. Each band applies the windows in z-order to its
+    // own rows, so the result matches the serial blit
+    void blit_parallel(Surface<TColor, TChar>& surface)
+    {
+        int rows = surface.rows();
+        int bands = std::max(1, std::min<int>(rows / band_rows, static_cast<int>(_pool->size()) * 2));
+        if ((int)_band_scratch.size() < bands)
+            _band_scratch.resize(bands);
+        _pool->parallel_for(bands, [&](std::size_t b)
+        {
+            int y0 = rows * (int)b / bands, y1 = rows * ((int)b + 1) / bands;
+            auto& [spans, scratch] = _band_scratch[b];
+            for (const Visible& v : _visible)
+            {
+                auto above = std::span<const Quad>(_opaque).subspan(v.above);
+                const Surface<TColor, TChar>& src = _entries[v.entry].surface;
+                int j0 = std::max(0, y0 - v.pos.y()), j1 = std::min(src.rows(), y1 - v.pos.y());
+                for (int j = j0; j < j1; j++)
+                {
+                    visible_spans(v.pos.y() + j, v.pos.x(), v.pos.x() + src.cols(), above, spans, scratch);
+                    for (auto [l, r] : spans)
+                        surface.blit_row(src, v.pos.x(), v.pos.y(), v.win->_wh.w(), v.win->_wh.h(), j, l - v.pos.x(),
+                                         r - v.pos.x());
+                }
+            }
+        });
+        _visible.clear();
+    }
+
+    // Forget the windows that were popped
+    void prune()
+    {
+        std::erase_if(_entries, [&](const Entry& e) { return e.frame + 1 < _frame; });
+    }
+
+    void check_style(const void* style)
+    {
+        if (style != _style)
+            invalidate_all();
+        _style = style;
+    }
+
+    std::vector<Entry> _entries;
+    std::size_t _frame = 0;
+    const void* _style = nullptr;
+
+    // Occlusion scratch, reused between frames
+    std::vector<int> _order;
+    std::vector<Quad> _opaque;
+    std::vector<std::pair<int, int>> _spans, _spans_scratch;
+
+    // Parallel mode
+    struct Visible
+    {
+        std::size_t entry; // Index in _entries, which may grow during the frame
+        const Widget<TChar>* win;
+        Point pos;
+        std::size_t above; // Index of the first occluder in _opaque
+    };
+
+    std::unique_ptr<ThreadPool> _pool;
+    std::vector<Visible> _visible;
+    std::vector<Surface<TColor, TChar>> _band_surfaces;
+    std::vector<std::pair<std::vector<std::pair<int, int>>, std::vector<std::pair<int, int>>>> _band_scratch;
+};
+
+
+#ifdef CURSE_IS_POSIX
+static termios original_term{}; // Store original terminal state
+static std::atomic_bool term_modified = false;
+static int resize_pipe[2] = {-1, -1}; // SIGWINCH writes a byte here when an EventLoop listens
+#endif
+
+
+// Contiguous byte buffer for one frame of terminal output. The storage is reused between frames,
+// so encoding does not allocate once the buffer has grown to the size of a full repaint
+class FrameBuffer
+{
+public:
+    FrameBuffer() = default;
+
+    void clear() { _buf.clear(); }
+    void reserve(std::size_t n) { _buf.reserve(n); }
+
+    void put(char c) { _buf.push_back(c); }
+    void put(std::string_view s) { _buf.append(s); }
+
+    // Decimal number without going through iostreams
+    void put_uint(std::size_t v)
+    {
+        char tmp[20];
+        int n = 0;
+        do
+        {
+            tmp[n++] = static_cast<char>('0' + v % 10);
+            v /= 10;
+        } while (v);
+        while (n)
+            _buf.push_back(tmp[--n]);
+    }
+
+    // Single glyph. Wide characters are encoded as UTF-8, interned clusters are copied from the GlyphTable
+    template<class TChar>
+    void put_glyph(TChar ch)
+    {
+        auto cp = static_cast<std::uint32_t>(ch);
+        if constexpr (sizeof(TChar) == 1)
+            _buf.push_back(static_cast<char>(ch));
+        else if (cp >= 0x110000)
+        {
+            if (GlyphTable::is_cluster(cp))
+                put(GlyphTable::instance().utf8(cp));
+        }
+        else if (cp < 0x80)
+            _buf.push_back(static_cast<char>(cp));
+        else if (cp < 0x800)
+        {
+            _buf.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+            _buf.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+        else if (cp < 0x10000)
+        {
+            _buf.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+            _buf.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            _buf.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+        else
+        {
+            _buf.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+            _buf.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+            _buf.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            _buf.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        }
+    }
+
+    // Move cursor (1-based for ANSI)
+    void put_move(std::size_t row, std::size_t col)
+    {
+        put("\033[");
+        put_uint(row + 1);
+        put(';');
+        put_uint(col + 1);
+        put('H');
+    }
+
+    // Scroll rows [top, bottom) up by n lines, down if n is negative: set the scroll region (DECSTBM),
+    // scroll it (SU/SD) and reset the region. Leaves the cursor at home
+    void put_scroll(std::size_t top, std::size_t bottom, int n)
+    {
+        put("\033[");
+        put_uint(top + 1);
+        put(';');
+        put_uint(bottom);
+        put("r\033[");
+        put_uint(static_cast<std::size_t>(std::abs(n)));
+        put(n > 0 ? 'S' : 'T');
+        put("\033[r");
+    }
+
+    [[nodiscard]] const char* data() const { return _buf.data(); }
+    [[nodiscard]] std::size_t size() const { return _buf.size(); }
+    [[nodiscard]] bool empty() const { return _buf.empty(); }
+    [[nodiscard]] std::string_view view() const { return _buf; }
+
+private:
+    std::string _buf;
+};
+
+
+// Encodes cells into a FrameBuffer. Tracks the SGR state and the cursor position of the terminal,
+// so a color is sent only when it differs from the previous cell, and a cursor move only when
+// the cell is not where the cursor already is
+template<class TColor>
+class FrameEncoder
+{
+public:
+    explicit FrameEncoder(FrameBuffer& out, std::size_t cols, ColorDepth depth = ColorDepth::TrueColor)
+        : _out(out), _cols(cols), _depth(depth) {}
+
+    template<class TGlyph>
+    void cell(std::size_t row, std::size_t col, TGlyph glyph, const TColor& color)
+    {
+        if (!_cursor_valid || row != _row || col != _col)
+            _out.put_move(row, col);
+        if (!_color_valid || color != _color)
+        {
+            if constexpr (requires { color.write_sgr(_out, _depth); })
+                color.write_sgr(_out, _depth);
+            else
+                color.write_sgr(_out);
+            _color = color;
+            _color_valid = true;
+        }
+        _out.put_glyph(glyph);
+
+        // Cursor stays on the last column, don't rely on the wrapping behavior
+        _row = row;
+        _col = col + glyph_width(glyph);
+        _cursor_valid = _col < _cols;
+    }
+
+    // Forget the cursor position, e.g. after something else has moved it
+    void invalidate_cursor() { _cursor_valid = false; }
+
+    // Reset attributes at the end of the frame, so nothing leaks outside of it
+    void finish()
+    {
+        if (_color_valid)
+            _out.put(TColor::reset());
+        _color_valid = false;
+    }
+
+private:
+    FrameBuffer& _out;
+    std::size_t _cols;
+    ColorDepth _depth;
+    TColor _color = TColor::None();
+    std::size_t _row = 0, _col = 0;
+    bool _color_valid = false;
+    bool _cursor_valid = false;
+};
+
+
+#ifdef CURSE_IS_POSIX
+// After a failed write: true if it is worth trying again. A non-blocking fd that is full is waited on
+inline bool write_again(int fd)
+{
+    if (errno == EINTR) return true;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+    pollfd p{fd, POLLOUT, 0};
+    while (poll(&p, 1, -1) < 0)
+        if (errno != EINTR) return false;
+    return true;
+}
+#endif
+
+// Write the whole buffer to fd, or to os if fd is negative. Returns the amount of bytes sent
+inline std::size_t write_frame(const char* data, std::size_t size, std::ostream& os, int fd)
+{
+#ifdef CURSE_IS_POSIX
+    if (fd >= 0)
+    {
+        std::size_t done = 0;
+        while (done < size) // write(2) may be partial on a slow tty
+        {
+            ssize_t n = ::write(fd, data + done, size - done);
+            if (n < 0)
+            {
+                if (write_again(fd)) continue;
+                break;
+            }
+            done += static_cast<std::size_t>(n);
+        }
+        return done;
+    }
+#endif
+    os.write(data, static_cast<std::streamsize>(size));
+    os.flush();
+    return size;
+}
+
+
+// Turns terminal input bytes into events. Characters (UTF-8 decoded) become Click events with the code
+// point as the key, arrows become Arrow events, other CSI/SS3 keys become Click events with a Key.
+// Bytes of an incomplete sequence are kept until the next feed(). A lone ESC stays pending until
+// flush() is called, since it may be the start of a sequence that has not arrived yet
+class InputDecoder
+{
+public:
+    void feed(const char* data, std::size_t size, std::vector<IPEvent>& out)
+    {
+        _pending.append(data, size);
+        std::size_t i = 0;
+        while (i < _pending.size())
+        {
+            std::size_t used = decode(i, out);
+            if (used == 0) break; // Incomplete, wait for more bytes
+            i += used;
+        }
+        _pending.erase(0, i);
+    }
+
+    // Give up on the pending bytes: a lone ESC is the Escape key, the rest is decoded as plain characters
+    void flush(std::vector<IPEvent>& out)
+    {
+        std::size_t i = 0;
+        if (!_pending.empty() && _pending[0] == '\033')
+        {
+            key(out, static_cast<int>(Key::Escape));
+            i = 1;
+        }
+        for (; i < _pending.size(); ++i)
+            key(out, static_cast<unsigned char>(_pending[i]));
+        _pending.clear();
+    }
+
+    [[nodiscard]] bool pending() const { return !_pending.empty(); }
+
+protected:
+    static void key(std::vector<IPEvent>& out, int k) { out.emplace_back(EventType::Click, k); }
+
+    static void special(std::vector<IPEvent>& out, char final, int param)
+    {
+        switch (final)
+        {
+        case 'A': out.emplace_back(EventType::ArrowUp); return;
+        case 'B': out.emplace_back(EventType::ArrowDown); return;
+        case 'C': out.emplace_back(EventType::ArrowRight); return;
+        case 'D': out.emplace_back(EventType::ArrowLeft); return;
+        case 'H': key(out, static_cast<int>(Key::Home)); return;
+        case 'F': key(out, static_cast<int>(Key::End)); return;
+        case 'Z': key(out, static_cast<int>(Key::BackTab)); return;
+        case 'P': case 'Q': case 'R': case 'S': // SS3 F1-F4
+            key(out, static_cast<int>(Key::F1) + (final - 'P'));
+            return;
+        case '~':
+            break;
+        default:
+            return; // Unknown sequence, dropped
+        }
+
+        // VT style keys, ESC [ <param> ~
+        static constexpr std::array<std::pair<int, Key>, 20> vt = {{
+            {1, Key::Home}, {2, Key::Insert}, {3, Key::Delete}, {4, Key::End}, {5, Key::PageUp},
+            {6, Key::PageDown}, {7, Key::Home}, {8, Key::End}, {11, Key::F1}, {12, Key::F2}, {13, Key::F3},
+            {14, Key::F4}, {15, Key::F5}, {17, Key::F6}, {18, Key::F7}, {19, Key::F8}, {20, Key::F9},
+            {21, Key::F10}, {23, Key::F11}, {24, Key::F12}
+        }};
+        for (auto [p, k] : vt)
+            if (p == param)
+                key(out, static_cast<int>(k));
+    }
+
+    // Decode one event at i. Returns the bytes consumed, 0 if the sequence is incomplete
+    std::size_t decode(std::size_t i, std::vector<IPEvent>& out)
+    {
+        std::size_t n = _pending.size() - i;
+        auto byte = [&](std::size_t k) { return static_cast<unsigned char>(_pending[i + k]); };
+        unsigned char c = byte(0);
+
+        if (c == '\033')
+        {
+            if (n < 2) return 0;
+            if (byte(1) == '[')
+            {
+                // CSI: parameters 0x30-0x3F, intermediates 0x20-0x2F, final 0x40-0x7E
+                int param = 0;
+                bool first = true;
+                for (std::size_t k = 2; k < n; ++k)
+                {
+                    unsigned char b = byte(k);
+                    if (b >= 0x40 && b <= 0x7E)
+                    {
+                        special(out, static_cast<char>(b), param);
+                        return k + 1;
+                    }
+                    if (b < 0x20 || b > 0x3F)
+                        return k; // Broken sequence, drop what was read
+                    if (b == ';') first = false; // Modifiers are ignored
+                    else if (first && b >= '0' && b <= '9') param = std::min(param * 10 + (b - '0'), 1 << 16);
+                }
+                return 0;
+            }
+            if (byte(1) == 'O')
+            {
+                if (n < 3) return 0;
+                special(out, static_cast<char>(byte(2)), 0);
+                return 3;
+            }
+            // ESC followed by anything else is Alt+key, reported as Escape and the key
+            key(out, static_cast<int>(Key::Escape));
+            return 1;
+        }
+
+        // UTF-8
+        std::size_t len = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 1;
+        if (len == 1)
+        {
+            key(out, c);
+            return 1;
+        }
+        if (n < len) return 0;
+        int cp = c & (0x7F >> len);
+        for (std::size_t k = 1; k < len; ++k)
+        {
+            if ((byte(k) & 0xC0) != 0x80)
+            {
+                key(out, c); // Not UTF-8, pass the byte through
+                return 1;
+            }
+            cp = (cp << 6) | (byte(k) & 0x3F);
+        }
+        key(out, cp);
+        return len;
+    }
+
+    std::string _pending;
+};
+
+
+#ifdef CURSE_IS_POSIX
+// Keyboard input from a tty. Raw mode is entered once and kept until leave_raw() or destruction.
+// Everything that is available is read in bulk, so a paste or key repeat arrives as one batch of events
+class InputReader
+{
+public:
+    explicit InputReader(int fd = STDIN_FILENO, int esc_timeout_ms = 25) : _fd(fd), _esc_timeout(esc_timeout_ms) {}
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    ~InputReader() { leave_raw(); }
+
+    [[nodiscard]] int fd() const { return _fd; }
+    [[nodiscard]] bool eof() const { return _eof; }
+
+    // No echo, no line buffering. Signals stay enabled, so Ctrl+C still reaches the signal handler.
+    // The state to go back to is kept per reader. original_term is only filled if nothing saved it
+    // before (a valid state never has an empty c_cflag), so the signal handler has something to restore
+    void enter_raw()
+    {
+        if (_raw) return;
+        tcgetattr(_fd, &_saved);
+        if (original_term.c_cflag == 0)
+            original_term = _saved;
+        termios t = _saved;
+        t.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+        t.c_iflag &= ~(IXON);
+        t.c_cc[VMIN] = 1;
+        t.c_cc[VTIME] = 0;
+        tcsetattr(_fd, TCSANOW, &t);
+        term_modified = true;
+        _raw = true;
+    }
+
+    void leave_raw()
+    {
+        if (!_raw) return;
+        tcsetattr(_fd, TCSANOW, &_saved);
+        term_modified = false;
+        _raw = false;
+    }
+
+    // How long a poll for this reader may sleep, given the caller's timeout (-1 is forever).
+    // Shorter while an ESC is waiting for the rest of its sequence
+    [[nodiscard]] int timeout(int timeout_ms) const
+    {
+        if (!_decoder.pending()) return timeout_ms;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(_esc_deadline - std::chrono::steady_clock::now());
+        int esc = std::max(0, static_cast<int>(left.count()));
+        return timeout_ms < 0 ? esc : std::min(timeout_ms, esc);
+    }
+
+    // Wait up to timeout_ms for input (-1 forever, 0 don't wait), read all of it and append the events
+    // to out. Returns the number of events added
+    std::size_t read(std::vector<IPEvent>& out, int timeout_ms = -1)
+    {
+        pollfd p{_fd, POLLIN, 0};
+        int r = poll(&p, 1, timeout(timeout_ms));
+        if (r < 0) return 0; // EINTR, e.g. SIGWINCH
+        if (r > 0)
+            return drain(out);
+        return expire(out);
+    }
+
+    // Report a pending ESC as the Escape key once its timeout has passed
+    std::size_t expire(std::vector<IPEvent>& out)
+    {
+        if (!_decoder.pending() || std::chrono::steady_clock::now() < _esc_deadline)
+            return 0;
+        std::size_t before = out.size();
+        _decoder.flush(out);
+        return out.size() - before;
+    }
+
+    // Read what is available without waiting, e.g. when the fd is watched by another poll loop
+    std::size_t drain(std::vector<IPEvent>& out)
+    {
+        std::size_t before = out.size();
+        for (;;)
+        {
+            ssize_t n = ::read(_fd, _buf.data(), _buf.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0)
+            {
+                _eof = n == 0;
                 break;
             }
+            _decoder.feed(_buf.data(), static_cast<std::size_t>(n), out);
+            if (static_cast<std::size_t>(n) < _buf.size()) break;
+
+            // The buffer was filled, read again only if it won't block
+            pollfd p{_fd, POLLIN, 0};
+            if (poll(&p, 1, 0) <= 0) break;
         }
+        if (_decoder.pending())
+            _esc_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_esc_timeout);
+        return out.size() - before;
+    }
 
-        // If box is present, increment size for box border
-        if (_box_style && !_box_style->isna())
+protected:
+    int _fd;
+    int _esc_timeout;
+    termios _saved{};
+    bool _raw = false;
+    bool _eof = false;
+    InputDecoder _decoder;
+    std::chrono::steady_clock::time_point _esc_deadline{};
+    std::array<char, 4096> _buf{};
+};
+#endif
+
+
+// Write the parts in order, as one writev(2) to fd, or to os if fd is negative. Returns the amount of bytes sent
+inline std::size_t write_frame(std::span<const std::string_view> parts, std::ostream& os, int fd)
+{
+#ifdef CURSE_IS_POSIX
+    if (fd >= 0)
+    {
+        std::vector<iovec> iov;
+        iov.reserve(parts.size());
+        for (std::string_view part : parts)
+            if (!part.empty())
+                iov.push_back({const_cast<char*>(part.data()), part.size()});
+
+        std::size_t done = 0;
+        for (std::size_t i = 0; i < iov.size();)
+        {
+            int count = static_cast<int>(std::min<std::size_t>(iov.size() - i, IOV_MAX));
+            ssize_t n = writev(fd, iov.data() + i, count);
+            if (n < 0)
+            {
+                if (write_again(fd)) continue;
+                break;
+            }
+            done += static_cast<std::size_t>(n);
+            // Skip what was written, a partial write leaves the rest of an iovec
+            for (auto left = static_cast<std::size_t>(n); left > 0 && i < iov.size();)
+            {
+                std::size_t step = std::min(left, iov[i].iov_len);
+                iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + step;
+                iov[i].iov_len -= step;
+                left -= step;
+                if (iov[i].iov_len == 0) i++;
+            }
+        }
+        return done;
+    }
+#endif
+    std::size_t done = 0;
+    for (std::string_view part : parts)
+    {
+        os.write(part.data(), static_cast<std::streamsize>(part.size()));
+        done += part.size();
+    }
+    os.flush();
+    return done;
+}
+
+
+// POSIX terminal output with a double buffer
+template<class TColor, class TChar>
+class CurseTerminal
+{
+public:
+    std::ostream& _os;
+    int _fd = -1; // When set, frames go straight to this fd with write(2). Otherwise _os is used
+
+    FrameBuffer _frame; // Encoded frame, reused
+    std::size_t _frame_bytes = 0; // Bytes emitted by the last render_matrix()
+
+    FirstDiffFn _first_diff = select_diff_kernel(); // Vectorized row comparison, chosen at runtime
+
+    bool _debug_damage = false; // DEBUG: paint damaged cells with _debug_damage_color
+    TColor _debug_damage_color = TColor::None();
+
+    // Pointers to the data
+    //const std::vector<GSymbol>& _stack; // Symbols stack
+    //const std::array<std::size_t, ContextSize>& _context; //
+
+    // Back buffer for rendering and front buffer with the frame the terminal currently shows.
+    // They are swapped after each frame
+    Surface<TColor, TChar> _surface;
+    Surface<TColor, TChar> _prev_surface;
+    std::size_t _rows = 0;
+    std::size_t _cols = 0;
+    bool _first_frame = true;
+    ColorDepth _color_depth = ColorDepth::TrueColor; // Deepest, nothing gets quantized
+    bool _scroll_regions = true;
+    std::vector<std::pair<int, int>> _scrolled; // Row ranges scrolled in the current frame
+    std::unordered_map<std::uint64_t, int> _prev_rows; // Row of each hash in the front buffer, -1 if not unique
+    std::vector<std::tuple<int, int, int>> _shifts; // Rows [a, b) that were n rows lower: {a, b, n}
+
+    // Parallel encoding
+    std::unique_ptr<ThreadPool> _pool;
+    std::vector<FrameBuffer> _bands;
+    std::vector<std::string_view> _parts;
+
+    explicit CurseTerminal(std::ostream& os, int fd = -1) : _os(os), _fd(fd)
+    {
+#ifdef CURSE_IS_POSIX
+        // Save the original terminal state once at initialization
+        tcgetattr(STDIN_FILENO, &original_term);
+#endif
+    }
+
+    /*void set_data(const std::vector<GSymbol>& stack, const std::array<std::size_t, ContextSize>& context) {
+        _stack = stack;
+        _context = context;
+    }*/
+
+    [[nodiscard]] std::size_t rows() const { return _rows; }
+    [[nodiscard]] std::size_t cols() const { return _cols; }
+    [[nodiscard]] std::size_t last_frame_bytes() const { return _frame_bytes; }
+
+    // Terminal fd for the direct output mode, -1 if there is none
+    static int tty_fd()
+    {
+#ifdef CURSE_IS_POSIX
+        return STDOUT_FILENO;
+#else
+        return -1;
+#endif
+    }
+
+    void update_terminal_size()
+    {
+        std::size_t new_rows = 24, new_cols = 80;
+    #ifdef CURSE_IS_POSIX
+        winsize w{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0)
+        {
+            new_rows = w.ws_row;
+            new_cols = w.ws_col;
+        }
+    #endif
+        resize(new_rows, new_cols);
+    }
+
+    // Diff and encode row bands on n threads. 0 or 1 keeps it on the calling thread
+    void set_threads(unsigned n)
+    {
+        if (n <= 1)
+            _pool.reset();
+        else if (!_pool || _pool->size() != n)
+            _pool = std::make_unique<ThreadPool>(n);
+    }
+
+    static constexpr int band_rows = 8; // Smallest band worth a task
+
+    // Colors beyond the depth are quantized when encoded, e.g. detect_color_depth() for TrueColor
+    // on a 256 color terminal. The next frame repaints everything in the new depth
+    void set_color_depth(ColorDepth depth)
+    {
+        if (depth == _color_depth) return;
+        _color_depth = depth;
+        _prev_surface.resize(static_cast<int>(_rows), static_cast<int>(_cols));
+        _first_frame = true;
+    }
+
+    [[nodiscard]] ColorDepth color_depth() const { return _color_depth; }
+
+    // Set the size explicitly, e.g. when the output is not a tty
+    void resize(std::size_t rows, std::size_t cols)
+    {
+        if (rows != _rows || cols != _cols)
+            init_matrix(rows, cols);   // re-alloc only when size actually changed
+    }
+
+    // Rows that moved up or down since the last frame are scrolled on the terminal with a scroll region
+    // instead of being sent again, see detect_scrolls(). On by default
+    void set_scroll_regions(bool enabled) { _scroll_regions = enabled; }
+
+    // Force a specific row comparison kernel. Output does not depend on the choice
+    void set_diff_kernel(DiffKernel kernel) { _first_diff = select_diff_kernel(kernel); }
+
+    // Surface that widgets render into
+    Surface<TColor, TChar>& surface() { return _surface; }
+
+    // Regions drawn in the current frame. Only these and the ones of the previous frame get diffed
+    [[nodiscard]] const DamageList& damage() const { return _surface.damage(); }
+
+    // DEBUG: overlay the color on every damaged cell to see what gets diffed each frame
+    void set_debug_damage(bool enabled, const TColor& color)
+    {
+        _debug_damage = enabled;
+        _debug_damage_color = color;
+    }
+
+    // The back buffer is already blank after render_matrix(), this only clears what was drawn since
+    void reset_output_matrix()
+    {
+        _surface.clear();
+    }
+
+    void set_cell(std::size_t row, std::size_t col, TChar value, const TColor& color = TColor())
+    {
+        if (row < _rows && col < _cols)
+            _surface.set(static_cast<int>(col), static_cast<int>(row), value, color);
+    }
+
+    void set_text(std::size_t row, std::size_t col, const std::basic_string<TChar>& text, const TColor& color = TColor())
+    {
+        if (row < _rows && col + text.size() <= _cols)
+            _surface.set_text(static_cast<int>(col), static_cast<int>(row), text, color);
+    }
+
+    void init_renderer() const
+    {
+        // Enter alternate screen buffer and hide cursor for smooth rendering
+        static constexpr std::string_view seq = "\033[?1049h"; // Enter alternate buffer
+        write_frame(seq.data(), seq.size(), _os, _fd);
+    }
+
+    void render_matrix()
+    {
+        _frame.clear();
+        if (_first_frame)
+        {
+            _frame.put("\033[2J\033[H"); // Clear and home
+            _first_frame = false;
+        }
+        _frame.put("\033[?25l"); // Hide cursor
+        if (_debug_damage)
+            paint_damage();
+
+        int bands = _pool ? std::min<int>(static_cast<int>(_rows) / band_rows, static_cast<int>(_pool->size()) * 2) : 1;
+        auto band = [&](std::size_t b)
+        {
+            return std::pair(static_cast<int>(_rows) * (int)b / bands, static_cast<int>(_rows) * ((int)b + 1) / bands);
+        };
+        if (bands <= 1)
+            _surface.update_row_hashes();
+        else
+            _pool->parallel_for(bands, [&](std::size_t b) { _surface.update_row_hashes(band(b).first, band(b).second); });
+        _scrolled.clear();
+        if (_scroll_regions)
+        {
+            apply_scroll_hints();
+            detect_scrolls();
+        }
+
+        if (bands <= 1)
+        {
+            FrameEncoder<TColor> enc(_frame, _cols, _color_depth);
+            encode_rows(enc, 0, static_cast<int>(_rows));
+            // The whole frame leaves in a single write
+            _frame_bytes = write_frame(_frame.data(), _frame.size(), _os, _fd);
+        }
+        else
+        {
+            // Row bands are diffed and encoded concurrently, each into its own buffer. An encoder starts
+            // without assumptions about the cursor and color, so bands can be joined in any state
+            if ((int)_bands.size() < bands)
+                _bands.resize(bands);
+            _pool->parallel_for(bands, [&](std::size_t b)
+            {
+                auto [y0, y1] = band(b);
+                _bands[b].clear();
+                FrameEncoder<TColor> enc(_bands[b], _cols, _color_depth);
+                encode_rows(enc, y0, y1);
+            });
+
+            // Still a single write
+            _parts.clear();
+            _parts.push_back(_frame.view());
+            for (int b = 0; b < bands; b++)
+                _parts.push_back(_bands[b].view());
+            _frame_bytes = write_frame(_parts, _os, _fd);
+        }
+        // Current frame becomes the front buffer. The old front buffer is reused for the next frame,
+        // so only the cells it had drawn need to be blanked
+        std::swap(_surface, _prev_surface);
+        _surface.clear();
+    }
+
+    // Call this on program exit to restore the screen and cursor
+    static void restore_terminal(std::ostream& os = std::cout)
+    {
+        os << "\033[?25h\033[?1049l" << std::flush; // Show cursor, exit alt buffer
+    }
+
+    static void signal_handler(int signal)
+    {
+#ifdef CURSE_IS_POSIX
+        if (signal == SIGWINCH)
+        {
+            if (resize_pipe[1] >= 0)
+            {
+                int saved = errno;
+                char c = 0;
+                (void)!::write(resize_pipe[1], &c, 1); // Non-blocking, a full pipe already means "resized"
+                errno = saved;
+            }
+            return;
+        }
+        // Restore original terminal attributes if they were modified
+        if (term_modified.load())
+        {
+            tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
+            term_modified = false;
+        }
+#endif
+        restore_terminal();
+        exit(signal);
+    }
+
+    static void init_signal_handler()
+    {
+#ifdef CURSE_IS_POSIX
+        std::signal(SIGINT, signal_handler);
+        std::signal(SIGWINCH, signal_handler);
+#endif
+    }
+
+    // Helper for raw input
+    static int getch()
+    {
+#ifdef CURSE_IS_POSIX
+        termios newt = original_term;
+        newt.c_lflag &= ~(ICANON | ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
+        term_modified = true;
+
+        int c = getchar();
+
+        // Restore immediately after reading
+        tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
+        term_modified = false;
+
+        return c;
+#else
+        return -1;
+#endif
+    }
+
+    /*static int get_terminal_width()
+    {
+#ifdef CURSE_IS_POSIX
+        winsize w{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) return w.ws_col;
+#endif
+        return 80;
+    }
+
+    static int get_terminal_height()
+    {
+#ifdef CURSE_IS_POSIX
+        winsize w{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) return w.ws_row;
+#endif
+        return 24;
+    }*/
+
+    void print()
+    {
+        // Render the output
+        render_matrix();
+    }
+
+protected:
+    // Encode rows [y0, y1), then reset the attributes. Cells outside of the damage of both frames are
+    // blank in both, they are skipped
+    void encode_rows(FrameEncoder<TColor>& enc, int y0, int y1)
+    {
+        const DamageList& damage = _surface.damage();
+        const DamageList& prev_damage = _prev_surface.damage();
+        for (int r = y0; r < y1; ++r)
         {
-            //_margin += 1;
-            _wh += 2;
+            int lo = std::min(damage.lo(r), prev_damage.lo(r));
+            int hi = std::max(damage.hi(r), prev_damage.hi(r));
+            if (lo >= hi) continue;
+            diff_row(enc, r, lo, hi);
         }
+        enc.finish();
     }
 
-    template <class TColor, template<class> class TStyle>
-    void render(std::vector<std::basic_string<TChar>>& matrix, std::vector<std::vector<TColor>>& color_matrix,
-                const TStyle<TColor>& style, bool active_window, bool win_always_active, int x, int y,
-                const TColor& parent_color = TColor::None(), bool top_level = false, std::vector<int> cur_path = {},
-                const std::vector<int>* selected_path = nullptr)
+    // Encode the cells of [lo, hi) that differ from the frame on screen
+    void diff_row(FrameEncoder<TColor>& enc, int r, int lo, int hi)
     {
-        bool selected;
-        if (selected_path && cur_path == *selected_path)
-            selected = true; // Force lazy eval
-        else
-            selected = false;
+        auto cur = _surface.row(r);
+        auto prev = _prev_surface.row(r);
 
-        ANSIColor effective_color = get_effective_color(style, active_window, win_always_active, selected).blend(parent_color);
-        auto [ml, mt, mr, mb] = _margin.tup();
-        auto [pl, pt, pr, pb] = _padding.tup();
-        // Opaque fill for top-level window
-        if (top_level)
+        if constexpr (Surface<TColor, TChar>::bytewise)
         {
-            for (int row = 0; row < _wh.h(); ++row)
+            // Row hashes only pick candidate rows (detect_scrolls), a collision must not hide a change.
+            // An unchanged row costs one pass of the vector compare
+            constexpr std::size_t size = sizeof(Cell<TColor, TChar>);
+            const auto* a = reinterpret_cast<const unsigned char*>(cur.data());
+            const auto* b = reinterpret_cast<const unsigned char*>(prev.data());
+            std::size_t c = lo;
+            while (c < static_cast<std::size_t>(hi))
             {
-                int abs_y = y + row;
-                if (abs_y < 0 || abs_y >= (int)color_matrix.size()) continue;
-                for (int col = 0; col < _wh.w(); ++col)
-                {
-                    int abs_x = x + col;
-                    if (abs_x < 0 || abs_x >= (int)color_matrix[0].size()) continue;
-                    matrix[abs_y][abs_x] = ' ';
-                    color_matrix[abs_y][abs_x] = effective_color;
-                }
+                // Skip the unchanged run a vector at a time, then emit the changed one
+                c += _first_diff(a + c * size, b + c * size, (hi - c) * size) / size;
+                while (c < static_cast<std::size_t>(hi) && cur[c] != prev[c])
+                    c = emit_cell(enc, r, cur, c);
             }
         }
-        // Draw box if needed
-        if (_box_style && !_box_style->isna())
+        else
         {
-            ANSIColor border_color = get_border_color(style, active_window, selected).blend(parent_color);
-            draw_box(matrix, color_matrix, x, y, _wh.w(), _wh.h(), *_box_style, border_color);
-            x += 1;
-            y += 1;
+            for (std::size_t c = lo; c < static_cast<std::size_t>(hi);)
+            {
+                if (cur[c] != prev[c])
+                    c = emit_cell(enc, r, cur, c);
+                else
+                    ++c;
+            }
         }
+    }
 
-        cur_path.push_back(0); // Add last elem
-
-        switch (_layout)
+    // Encode the cell, returns the column after it. A double-width glyph is sent together with its
+    // wide_tail cell, whichever of the two changed. Halves without the other one are sent as blanks
+    std::size_t emit_cell(FrameEncoder<TColor>& enc, int r, std::span<const Cell<TColor, TChar>> cur, std::size_t c)
+    {
+        if constexpr (sizeof(TChar) > 1)
         {
-        case WidgetLayout::Horizontal:
+            if (static_cast<char32_t>(cur[c].glyph) == wide_tail)
             {
-                int cur_x = x + ml;
-                for (int i = 0; i < _children.size(); i++)
-                {
-                    cur_path.front() = i;
-                    if (i > 0)
-                        cur_x += pl;
-                    _children[i].render(matrix, color_matrix, style, active_window, win_always_active, cur_x, y + mt, effective_color,
-                                        false, cur_path, selected_path);
-                    if (i < _children.size() - 1)
-                        cur_x += pr;
-                    cur_x += _children[i]._wh.w();
-                }
-                break;
+                if (c > 0 && glyph_width(cur[c - 1].glyph) == 2)
+                    enc.cell(r, c - 1, cur[c - 1].glyph, cur[c - 1].color);
+                else
+                    enc.cell(r, c, TChar(' '), cur[c].color);
+                return c + 1;
             }
-        case WidgetLayout::Vertical:
+            if (glyph_width(cur[c].glyph) == 2)
             {
-                int cur_y = y + mt;
-                for (int i = 0; i < _children.size(); i++)
+                if (c + 1 < cur.size() && static_cast<char32_t>(cur[c + 1].glyph) == wide_tail)
                 {
-                    cur_path.front() = i;
-                    if (i > 0)
-                        cur_y += pt;
-                    _children[i].render(matrix, color_matrix, style, active_window, win_always_active, x + ml, cur_y, effective_color,
-                                        false, cur_path, selected_path);
-                    if (i < _children.size() - 1)
-                        cur_y += pb;
-                    cur_y += _children[i]._wh.h();
+                    enc.cell(r, c, cur[c].glyph, cur[c].color);
+                    return c + 2;
                 }
-                break;
+                enc.cell(r, c, TChar(' '), cur[c].color);
+                return c + 1;
             }
-        case WidgetLayout::Floating:
+        }
+        enc.cell(r, c, cur[c].glyph, cur[c].color);
+        return c + 1;
+    }
+
+    // Scroll the regions that the surface hints at, see Surface::hint_scroll
+    void apply_scroll_hints()
+    {
+        for (const auto& h : _surface.scroll_hints())
+            try_scroll(h.y, h.y + h.h, h.n);
+    }
+
+    // Find runs of changed rows whose content is in the front buffer some rows lower or higher, and scroll
+    // them there. Rows are matched by hash, a row whose hash appears once in the front buffer gives the
+    // shift, which is then extended up and down over the rows that match with it. Longest runs go first
+    void detect_scrolls()
+    {
+        if constexpr (Surface<TColor, TChar>::bytewise)
+        {
+            const DamageList& damage = _surface.damage();
+            int rows = static_cast<int>(_rows);
+            _prev_rows.clear();
+            for (int r = 0; r < rows; r++)
             {
-                for (auto& child : _children)
+                if (!_prev_surface.damage().damaged(r)) continue; // Blank
+                auto [it, added] = _prev_rows.try_emplace(_prev_surface.row_hash(r), r);
+                if (!added) it->second = -1;
+            }
+            if (_prev_rows.empty()) return;
+
+            auto moved = [&](int r, int n)
+            {
+                return r + n >= 0 && r + n < rows && _surface.row_hash(r) == _prev_surface.row_hash(r + n);
+            };
+            _shifts.clear();
+            for (int r = 0; r < rows;)
+            {
+                auto it = damage.damaged(r) && _surface.row_hash(r) != _prev_surface.row_hash(r)
+                        ? _prev_rows.find(_surface.row_hash(r)) : _prev_rows.end();
+                if (it == _prev_rows.end() || it->second < 0)
                 {
-                    cur_path.front()++;
-                    child.render(matrix, color_matrix, style, active_window, win_always_active, x + child._xy.x() + ml,
-                                 y + child._xy.y() + mt, effective_color, false, cur_path, selected_path);
+                    r++;
+                    continue;
                 }
-                break;
+                int n = it->second - r, a = r, b = r + 1;
+                while (a > 0 && moved(a - 1, n)) a--;
+                while (b < rows && moved(b, n)) b++;
+                _shifts.emplace_back(a, b, n);
+                r = b;
             }
-        case WidgetLayout::Text:
+            std::sort(_shifts.begin(), _shifts.end(), [](const auto& x, const auto& y)
             {
-                int cur_x = x + ml, cur_y = y + mt;
+                return std::get<1>(x) - std::get<0>(x) > std::get<1>(y) - std::get<0>(y);
+            });
 
-                if (!matrix.empty() && cur_y >= 0 && cur_y < static_cast<int>(matrix.size()) && cur_x < static_cast<int>(matrix[0].size()))
-                {
-                    // Clamp characters
-                    int start_i = (cur_x < 0) ? -cur_x : 0;
-                    int draw_x = cur_x + start_i;
-
-                    for (size_t i = start_i; i < _content.size(); ++i, ++draw_x)
-                    {
-                        if (draw_x >= static_cast<int>(matrix[0].size())) break;
-                        matrix[cur_y][cur_x + i] = _content[i];
-                        color_matrix[cur_y][cur_x + i] = color_matrix[cur_y][cur_x + i].overlay(effective_color);
-                    }
-                }
-                break;
+            if (_shifts.size() > max_shifts)
+                _shifts.resize(max_shifts);
+            // Regions of a frame never overlap, so each one still sees the front buffer rows it was matched with
+            for (auto [a, b, n] : _shifts)
+            {
+                if (n > 0)
+                    try_scroll(a, b + n, n);
+                else
+                    try_scroll(a + n, b, n);
             }
         }
+    }
 
-        // Fill the rectangle with color if the flag is set
-        int box_offset = ((_box_style && _box_style->isna()) ? 0 : 2);
-        int shadow_size = ((_box_style && _box_style->isna()) ? 1 : 2);
-
-        int shadow_rows = _wh.h() - box_offset + shadow_size - 1;
-        int shadow_cols = _wh.w() - box_offset + shadow_size - 1;
-
-        switch (_shadow_style)
+    // Scroll rows [y0, y1) by n if that leaves fewer cells to send, and move the rows of the front buffer
+    // the same way. The terminal scrolls whole rows, so all columns count. Regions overlapping one that
+    // was scrolled in this frame are skipped
+    bool try_scroll(int y0, int y1, int n)
+    {
+        if (std::any_of(_scrolled.begin(), _scrolled.end(), [&](auto s) { return y0 < s.second && s.first < y1; }))
+            return false;
+        // Estimated bytes: each changed cell, a cursor move for each run of them, a color change when the
+        // color differs from the last cell sent
+        struct Estimate
         {
-        case ShadowStyle::Fill:
-            for (int row = 0; row < _wh.h() - box_offset; ++row)
+            std::size_t bytes = 0;
+            const TColor* color = nullptr;
+            bool run = false;
+
+            void cell(bool changed, const Cell<TColor, TChar>& cell)
             {
-                int abs_y = y + row;
-                if (abs_y < 0 || abs_y >= static_cast<int>(color_matrix.size())) continue;
-                for (int col = 0; col < _wh.w() - box_offset; ++col)
+                if (changed)
                 {
-                    int abs_x = x + col;
-                    if (abs_x < 0 || abs_x >= static_cast<int>(color_matrix[0].size())) continue;
-                    color_matrix[abs_y][abs_x] = color_matrix[abs_y][abs_x].blend(effective_color);
+                    bytes += 1 + !run * move_cost + (!color || *color != cell.color) * sgr_cost;
+                    color = &cell.color;
                 }
+                run = changed;
             }
-            break;
-        case ShadowStyle::Shadow:
-            for (int row = 0; row <= shadow_rows; ++row)
+        } before, after;
+        const Cell<TColor, TChar> blank{};
+        for (int r = y0; r < y1; r++)
+        {
+            auto cur = _surface.row(r);
+            auto prev = _prev_surface.row(r);
+            int src = r + n;
+            bool inside = src >= y0 && src < y1;
+            before.run = after.run = false;
+            for (int c = 0; c < static_cast<int>(_cols); c++)
             {
-                int abs_y = y + row;
-                if (abs_y < 0 || abs_y >= static_cast<int>(color_matrix.size())) continue;
-                for (int col = 0; col <= shadow_cols; ++col)
-                {
-                    int abs_x = x + col;
-                    if (abs_x < 0 || abs_x >= static_cast<int>(color_matrix[0].size())) continue;
-                    color_matrix[abs_y][abs_x] = color_matrix[abs_y][abs_x].blend(effective_color);
-                }
+                before.cell(cur[c] != prev[c], cur[c]);
+                after.cell(cur[c] != (inside ? _prev_surface.at(c, src) : blank), cur[c]);
             }
-            break;
-        default:
-            break;
         }
+        if (after.bytes + scroll_cost >= before.bytes) return false;
+        _frame.put_scroll(y0, y1, n);
+        _prev_surface.scroll_rows(y0, y1, n);
+        _scrolled.emplace_back(y0, y1);
+        return true;
+    }
+
+    static constexpr std::size_t max_shifts = 8; // Runs tried per frame, each costs a pass over its rows
+    static constexpr std::size_t move_cost = 6; // Bytes of a cursor move
+    static constexpr std::size_t sgr_cost = 8; // Bytes of a color change
+    static constexpr std::size_t scroll_cost = 16; // Bytes of a scroll sequence
+
+    void paint_damage()
+    {
+        const DamageList& damage = _surface.damage();
+        for (int r = 0; r < damage.rows(); ++r)
+        {
+            if (!damage.damaged(r)) continue;
+            auto row = _surface.row(r);
+            for (int c = damage.lo(r); c < damage.hi(r); ++c)
+                row[c].color = row[c].color.overlay(_debug_damage_color);
+        }
+    }
+
+    void init_matrix(std::size_t rows, std::size_t cols)
+    {
+        _rows = rows;
+        _cols = cols;
+        _surface.resize(static_cast<int>(rows), static_cast<int>(cols));
+        _prev_surface.resize(static_cast<int>(rows), static_cast<int>(cols));
+        _frame.reserve(rows * cols * 16); // Roughly one full repaint
+        _first_frame = true;
     }
 };
 
 
-// Helper: recursively find nearest _selectable widget in a direction, returning path
-template<class TChar>
-void find_nearest_selectable_recursive(const std::vector<Widget<TChar>>& widgets, std::vector<int> path,
-                                              const Point& cur_xy, EventType dir, std::vector<int>& best_path,
-                                              int& best_dist, const std::vector<int>& current_sel_path = {},
-                                              Point accumulated_xy = {})
+// Intrusive lock-free multi-producer single-consumer queue (Vyukov). push() never blocks and can be called
+// from any thread, pop() from one consumer thread only. T must be default constructible
+template<class T>
+class MPSCQueue
 {
-    path.push_back(0);
-    for (int i = 0; i < (int)widgets.size(); ++i)
+public:
+    MPSCQueue() : _head(&_stub), _tail(&_stub) {}
+
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    ~MPSCQueue()
+    {
+        T tmp;
+        while (pop(tmp)) {}
+    }
+
+    void push(T value)
     {
-        path.front() = i;
-        // Skip if this is the currently selected widget
-        if (!current_sel_path.empty() && path == current_sel_path) continue;
+        Node* n = new Node;
+        n->value = std::move(value);
+        link(n);
+    }
 
-        Point abs_xy = accumulated_xy + widgets[i]._xy;
-        if (widgets[i]._selectable)
+    // Take the oldest value. Returns false if the queue is empty, or if the next value is still being
+    // pushed; it shows up on a later call
+    bool pop(T& out)
+    {
+        Node* tail = _tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &_stub)
         {
-            int dx = abs_xy.x() - cur_xy.x();
-            int dy = abs_xy.y() - cur_xy.y();
-            bool in_quadrant = false;
-            switch (dir)
-            {
-            // TODO fix quadrant selection
-            case EventType::ArrowUp: in_quadrant = (std::abs(dy) >= std::abs(dx));
-                break;
-            case EventType::ArrowDown: in_quadrant = (std::abs(dy) >= std::abs(dx));
-                break;
-            case EventType::ArrowLeft: in_quadrant = (std::abs(dx) >= std::abs(dy));
-                break;
-            case EventType::ArrowRight: in_quadrant = (std::abs(dx) >= std::abs(dy));
-                break;
-            default: break;
-            }
-            if (in_quadrant)
-            {
-                int dist = dx * dx + dy * dy;
-                if (dist < best_dist)
-                {
-                    best_path = path;
-                    best_dist = dist;
-                }
-            }
+            if (!next) return false;
+            _tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
         }
-        if (!widgets[i]._children.empty())
+        if (!next)
         {
-            find_nearest_selectable_recursive(widgets[i]._children, path, cur_xy, dir, best_path, best_dist,
-                                              current_sel_path, abs_xy);
+            if (tail != _head.load(std::memory_order_acquire))
+                return false; // A producer is between its exchange and its link
+            link(&_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (!next) return false;
         }
+        _tail = next;
+        out = std::move(tail->value);
+        delete tail;
+        return true;
     }
-}
 
+    // Only meaningful on the consumer thread
+    [[nodiscard]] bool empty() const
+    {
+        return _tail == &_stub ? _stub.next.load(std::memory_order_acquire) == nullptr : false;
+    }
 
-enum class IPWindowFlags : std::size_t
-{
-    Modal = 0b1,
-    AlwaysActive = 0b10,
+private:
+    struct Node
+    {
+        std::atomic<Node*> next{nullptr};
+        T value{};
+    };
+
+    void link(Node* n)
+    {
+        n->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = _head.exchange(n, std::memory_order_acq_rel);
+        prev->next.store(n, std::memory_order_release);
+    }
+
+    Node _stub;
+    alignas(64) std::atomic<Node*> _head; // Producers
+    alignas(64) Node* _tail; // Consumer
 };
-// Last window flag
-static constexpr IPWindowFlags IPWindowFlagsLast = IPWindowFlags::AlwaysActive;
 
 
-// Window stack and selector logic
+// Changes to a WindowStack posted from other threads. Workers post commands, the UI thread applies them
+// all at once before a frame, so widgets are only ever touched by the UI thread and no lock is taken.
+// wake_fd() becomes readable when commands arrive, to wake a poll loop
 template<class TChar>
-class WindowStack
+class UpdateQueue
 {
 public:
-    std::vector<Widget<TChar>> stack; // Topmost is last
-    std::vector<int> window_ids;
-    int selector_idx = -1; // Index of selected widget in stack
-    std::vector<std::vector<int>> selection_paths; // Selected widget in each window
-    std::vector<Widget<TChar>> overlays; // Overlay windows, not selectable
-    std::vector<std::size_t> flags;
+    using Command = std::function<void(WindowStack<TChar>&)>;
 
-    int _dbg_best_dist = std::numeric_limits<int>::max(); // DEBUG: best distance in selector
+    UpdateQueue()
+    {
+#ifdef CURSE_IS_POSIX
+        if (pipe(_wake) == 0)
+        {
+            for (int fd : _wake)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        else
+            _wake[0] = _wake[1] = -1;
+#endif
+    }
 
-    WindowStack() = default;
+    UpdateQueue(const UpdateQueue&) = delete;
+    UpdateQueue& operator=(const UpdateQueue&) = delete;
 
-    void push(Widget<TChar> w, std::size_t win_flags = 0, const int id = -1)
+    ~UpdateQueue()
     {
-        stack.push_back(std::move(w));
-        window_ids.push_back(id);
-        flags.push_back(win_flags);
-        selector_idx = static_cast<int>(stack.size()) - 1;
-        // Default: select first selectable child in new window
-        std::vector<int> path;
-        find_first_selectable_path(stack.back()._children, path);
-        selection_paths.push_back(path);
-        if (stack[selector_idx].on_event)
-            stack[selector_idx].on_event(&stack[selector_idx], this, IPEvent(EventType::OnCreate), {0});
-        // Widget should be 0
+#ifdef CURSE_IS_POSIX
+        for (int fd : _wake)
+            if (fd >= 0) close(fd);
+#endif
     }
 
-    // Add overlay window (not selectable)
-    void push_overlay(Widget<TChar> w)
+    // Any thread
+    // ==========
+
+    void post(Command cmd)
     {
-        overlays.push_back(std::move(w));
+        _queue.push(std::move(cmd));
+        // One wake-up byte per batch, the flag is cleared by apply()
+        if (!_wake_pending.exchange(true))
+            wake();
     }
 
-    void pop(int index)
+    // Set the text of the widget at path in the window with the given id. Ignored if there is no such widget
+    void set_text(int window_id, const WidgetPath& path, std::basic_string<TChar> text)
     {
-        if (!stack.empty() && index >= 0)
+        post([=, text = std::move(text)](WindowStack<TChar>& ws)
         {
-            if (stack[index].on_event)
-                stack[index].on_event(&stack[index], this, IPEvent(EventType::OnDestroy), {0});
-            // We are deleting the whole window
+            if (Widget<TChar>* w = widget(ws, window_id, path))
+                w->set_text(text);
+        });
+    }
 
-            stack.erase(stack.begin() + index);
-            selection_paths.erase(selection_paths.begin() + index);
-            window_ids.erase(window_ids.begin() + index);
-            flags.erase(flags.begin() + index);
+    void push_window(Widget<TChar> w, std::size_t win_flags = 0, int id = -1)
+    {
+        post([w = std::move(w), win_flags, id](WindowStack<TChar>& ws) mutable { ws.push(std::move(w), win_flags, id); });
+    }
 
-            if (stack.size() - 1 >= index)
-                selector_idx = index;
-            else if (!stack.empty())
-                selector_idx = static_cast<int>(stack.size()) - 1;
-            else
-                selector_idx = -1;
-        }
+    void pop_window(int window_id)
+    {
+        post([window_id](WindowStack<TChar>& ws)
+        {
+            int idx = ws.find(window_id);
+            if (idx >= 0) ws.pop(idx);
+        });
     }
 
-    Widget<TChar>* top() { return stack.empty() ? nullptr : &stack.back(); }
+    // UI thread
+    // =========
 
-    [[nodiscard]] bool check_modal_flag() const
+    [[nodiscard]] int wake_fd() const { return _wake[0]; }
+
+    // Empty the wake-up pipe. Commands stay queued until apply()
+    void consume_wake()
     {
-        if (selector_idx < 0 || selector_idx >= stack.size())
-            return false;
+#ifdef CURSE_IS_POSIX
+        char buf[64];
+        while (_wake[0] >= 0 && read(_wake[0], buf, sizeof(buf)) > 0) {}
+#endif
+    }
 
-        return flags[selector_idx] & (std::size_t)IPWindowFlags::Modal;
+    // Run all queued commands in order. Returns how many ran
+    std::size_t apply(WindowStack<TChar>& ws)
+    {
+        _wake_pending.store(false); // Commands posted from now on wake the loop again
+        std::size_t n = 0;
+        Command cmd;
+        while (_queue.pop(cmd))
+        {
+            if (cmd) cmd(ws);
+            n++;
+        }
+        return n;
     }
 
-    // Tab cycles through windows
-    void move_selector_tab(int dir)
+    // Widget at path in the window with the given id, nullptr if there is none
+    static Widget<TChar>* widget(WindowStack<TChar>& ws, int window_id, const WidgetPath& path)
     {
-        if (stack.empty()) return;
-        if (check_modal_flag()) return;
-        const int n = static_cast<int>(stack.size());
-        int start = selector_idx;
-        for (int i = 1; i <= n; ++i)
+        int idx = ws.find(window_id);
+        if (idx < 0) return nullptr;
+        Widget<TChar>* cur = &ws.stack[idx];
+        for (int i : path)
         {
-            int idx = (start + dir * i + n) % n;
-            selector_idx = idx;
+            if (i < 0 || i >= (int)cur->_children.size()) return nullptr;
+            cur = &cur->_children[i];
+        }
+        return cur;
+    }
+
+private:
+    void wake()
+    {
+#ifdef CURSE_IS_POSIX
+        char c = 0;
+        if (_wake[1] >= 0)
+            (void)!::write(_wake[1], &c, 1);
+#endif
+    }
+
+    MPSCQueue<Command> _queue;
+    std::atomic_bool _wake_pending = false;
+    int _wake[2] = {-1, -1};
+};
+
+
+// Bounded log that producers stream lines into, for a live output pane. append() can be called from any
+// thread at any rate, the text is queued without a lock or a copy. The UI thread moves the queued text
+// into a ring of fixed size with poll(), once per frame, dropping the oldest lines when it is full.
+// The queue is bounded too, so a stalled UI thread doesn't make it grow. Lines are views into the ring,
+// list() shows them and follows the end like tail -f
+template<class TChar>
+class LogBuffer
+{
+public:
+    // Room for capacity characters of text and max_lines lines, allocated once
+    explicit LogBuffer(std::size_t capacity = 1 << 20, std::size_t max_lines = 1 << 16)
+        : _text(std::max<std::size_t>(capacity, 2)), _lines(std::max<std::size_t>(max_lines, 1)) {}
+
+    LogBuffer(const LogBuffer&) = delete;
+    LogBuffer& operator=(const LogBuffer&) = delete;
+
+    // Any thread
+    // ==========
+
+    // One or more lines separated by '\n'. A batch of lines in one call is one queue push
+    void append(std::basic_string<TChar> text)
+    {
+        // Counted before the push, so a pop never subtracts text that isn't counted yet
+        std::size_t n = text.size();
+        std::size_t queued = _queued.fetch_add(n) + n;
+        if (queued > 2 * _text.size())
+        {
+            // Another thread holds the queue and can't trim it now, this batch is the one that goes
+            _queued.fetch_sub(n);
+            _lost.fetch_add(count_lines(text), std::memory_order_relaxed);
             return;
         }
+        _queue.push(std::move(text));
+        if (queued > _text.size())
+            trim_queue();
+        // One notification per batch, the flag is cleared by poll()
+        if (!_pending.exchange(true) && _notify)
+            _notify();
     }
 
-    // Find first selectable widget path (depth-first)
-    static bool find_first_selectable_path(const std::vector<Widget<TChar>>& widgets, std::vector<int>& path)
+    // UI thread
+    // =========
+
+    // poll() on the UI thread of updates when lines arrive and invalidate the widget at path in the window
+    // with the given id, so the pane is drawn with the next frame. Call it before appending starts, the
+    // buffer must outlive the queue
+    void attach(UpdateQueue<TChar>& updates, int window_id, WidgetPath path)
     {
-        for (int i = 0; i < (int)widgets.size(); ++i)
+        _notify = [this, &updates, window_id, path]
         {
-            if (widgets[i]._selectable)
-            {
-                path.push_back(i);
-                return true;
-            }
-            if (!widgets[i]._children.empty())
+            updates.post([this, window_id, path](WindowStack<TChar>& ws)
             {
-                path.push_back(i);
-                if (find_first_selectable_path(widgets[i]._children, path)) return true;
-                path.pop_back();
-            }
-        }
-        return false;
+                if (!poll()) return;
+                if (Widget<TChar>* w = UpdateQueue<TChar>::widget(ws, window_id, path))
+                    w->invalidate();
+            });
+        };
     }
 
-    // Move selection within the top window's widgets in a direction (recursive)
-    void move_child_selector_dir(EventType dir)
+    // Move the queued text into the ring. Returns true if lines were added
+    bool poll()
     {
-        if (selector_idx < 0 || selector_idx >= (int)stack.size()) return;
-        Widget<TChar>& root = stack[selector_idx];
-        std::vector<int>& sel_path = selection_paths[selector_idx];
-        Point cur_xy = {0, 0};
-        std::vector<Widget<TChar>>* cur_level = &root._children;
-
-        for (int d = 0; d < (int)sel_path.size(); ++d)
+        _pending.store(false); // Text appended from now on notifies again
+        bool added = false;
+        std::basic_string<TChar> text;
+        std::lock_guard lock(_pop_mutex);
+        // Only the text queued so far, producers that keep appending can't hold the UI thread here. What
+        // they append meanwhile can't be trimmed until the lock is released, so the pass is kept short
+        for (std::size_t left = _queued.load(); left && _queue.pop(text);)
         {
-            int idx = sel_path[d];
-            if (idx < 0 || idx >= (int)cur_level->size()) break;
-            cur_xy += (*cur_level)[idx]._xy; // We need to accumulate total pos, since _xy is relative
-            cur_level = &(*cur_level)[idx]._children;
+            left -= std::min(left, text.size());
+            _queued.fetch_sub(text.size());
+            std::basic_string_view<TChar> rest = text;
+            while (!rest.empty())
+            {
+                std::size_t end = rest.find(TChar('\n'));
+                std::basic_string_view<TChar> line = rest.substr(0, end);
+                rest.remove_prefix(end == rest.npos ? rest.size() : end + 1);
+                if (!line.empty() && line.back() == TChar('\r')) line.remove_suffix(1);
+                push_line(line);
+                added = true;
+            }
         }
-        std::vector<int> best_path;
-        _dbg_best_dist = std::numeric_limits<int>::max();
-        find_nearest_selectable_recursive(root._children, {}, cur_xy, dir, best_path, _dbg_best_dist, sel_path);
-        if (!best_path.empty()) sel_path = best_path;
+        return added;
     }
 
-    // Route event to selected window and its selected child (recursive, path-based)
-    bool handle_event(const IPEvent& ev)
-    {
-        if (selector_idx >= 0 && selector_idx < stack.size())
-        {
-            Widget<TChar>* root = &stack[selector_idx];
-            std::vector<int>& sel_path = selection_paths[selector_idx];
+    // Lines in the ring, the oldest is 0
+    [[nodiscard]] std::size_t lines() const { return _count; }
+    // Lines dropped from the front since the start
+    [[nodiscard]] std::size_t dropped() const { return _dropped; }
 
-            // Try to handle event recursively from leaf to root
-            for (int d = (int)sel_path.size(); d >= 0; --d)
-            {
-                std::vector<int> subpath(sel_path.begin(), sel_path.begin() + d);
-                Widget<TChar>* cur = root;
-                std::vector<Widget<TChar>>* cur_level = &root->_children;
+    // Lines dropped before they reached the ring. The queue holds about as much text as the ring: when
+    // appending gets further ahead of poll(), the oldest batches are dropped as a whole, the ring would
+    // drop their lines anyway once the newer ones are in. While poll() or another producer holds the
+    // queue it can't be trimmed, then a batch that would take it past twice the ring is dropped instead
+    [[nodiscard]] std::size_t lost() const { return _lost.load(std::memory_order_relaxed); }
 
-                // Inefficient logic
-                for (int i = 0; i < (int)subpath.size(); ++i)
-                {
-                    int idx = subpath[i];
-                    if (idx < 0 || idx >= (int)cur_level->size())
-                    {
-                        cur = nullptr;
-                        break;
-                    }
-                    cur = &(*cur_level)[idx];
-                    cur_level = &cur->_children;
-                }
-                if (cur && cur->on_event && cur->on_event(cur, this, ev, subpath))
-                {
-                    return true;
-                }
-            }
-            // If not handled, process at root widget level
-            if (root->on_event && root->on_event(root, this, ev, {}))
-                return true;
+    // Characters appended and not polled yet
+    [[nodiscard]] std::size_t queued() const { return _queued.load(std::memory_order_relaxed); }
 
-            // THEN we handle it on window level
-            window_event_process(ev);
-            return false;
-        }
-        return false;
+    // Line without the line break. Valid until the next poll()
+    [[nodiscard]] std::basic_string_view<TChar> line(std::size_t i) const
+    {
+        if (i >= _count) return {};
+        const Span& span = _lines[(_first + i) % _lines.size()];
+        return {_text.data() + span.offset, span.length};
     }
 
-    bool window_event_process(const IPEvent& ev)
+    void clear()
     {
-        if (int(ev.type) >= (int)EventType::ArrowUp && int(ev.type) <= (int)EventType::ArrowRight)
-        {
-            move_child_selector_dir(ev.type);
-            return true;
-        }
-        return false;
+        _dropped += _count;
+        _first = _count = _head = 0;
     }
 
-    // Render all windows, overlays last. Overlays are not _selectable.
-    template <class TColor, template<class> class TStyle>
-    void render_all(std::vector<std::basic_string<TChar>>& matrix, std::vector<std::vector<TColor>>& color_matrix,
-                    const TStyle<TColor>& style)
+    // Virtualized list over the lines that stays on the last line. The list keeps the buffer alive
+    static std::shared_ptr<ListView<TChar>> list(std::shared_ptr<LogBuffer> log, Point size)
     {
-        int n = (int)stack.size();
-        if (n == 0) return;
-        int start = (selector_idx + 1) % n;
-        for (int i = 0; i < n; ++i)
-        {
-            int idx = (start + i) % n;
-            bool active = (idx == selector_idx);
-            // Paint the window in disabled style only if it has this flag
-            bool win_always_active = (flags[idx] & (std::size_t)IPWindowFlags::AlwaysActive);
-            stack[idx].layout();
-            stack[idx].render(matrix, color_matrix, style, active, win_always_active, 2 + 2 * idx + stack[idx]._xy.x(), 2 + 2 * idx + stack[idx]._xy.y(), TColor::None(), true, {},
-                              (active ? &selection_paths[idx] : nullptr));
-        }
+        auto list = std::make_shared<ListView<TChar>>(ListView<TChar>::from_views(
+            [log] { return log->lines(); },
+            [log](std::size_t i) { return log->line(i); },
+            size));
+        list->set_origin([log] { return log->dropped(); });
+        list->set_follow(true);
+        return list;
     }
 
-    template <class TColor, template<class> class TStyle>
-    void render_overlays(std::vector<std::basic_string<TChar>>& matrix, std::vector<std::vector<TColor>>& color_matrix,
-                         const TStyle<TColor>& style)
+protected:
+    struct Span
     {
-        // Render overlays last (not _selectable, not active)
-        for (auto& overlay : overlays)
+        std::size_t offset;
+        std::size_t length;
+    };
+
+    // Lines are contiguous in the ring and followed by a '\n', so every line takes room. One that does not
+    // fit before the end goes to the start, the end stays unused until the ring wraps again. Lines longer
+    // than the ring are cut
+    void push_line(std::basic_string_view<TChar> s)
+    {
+        std::size_t capacity = _text.size();
+        std::size_t length = std::min(s.size(), capacity - 1);
+        if (_count == _lines.size())
+            drop();
+        std::size_t pos = _head;
+        if (pos + length + 1 > capacity)
         {
-            overlay.layout();
-            overlay.render(matrix, color_matrix, style, true, false, overlay._xy.x(), overlay._xy.y(), TColor::None(), true);
+            // The lines past the head are the oldest ones
+            while (_count && oldest().offset >= _head)
+                drop();
+            pos = 0;
         }
+        while (_count && oldest().offset >= pos && oldest().offset <= pos + length)
+            drop();
+        std::copy_n(s.data(), length, _text.data() + pos);
+        _text[pos + length] = TChar('\n');
+        _lines[(_first + _count) % _lines.size()] = {pos, length};
+        _count++;
+        _head = pos + length + 1;
     }
 
-    // Find the window according to its id. Returns the first match
-    int find(const int id)
+    [[nodiscard]] const Span& oldest() const { return _lines[_first]; }
+
+    // Drop the oldest batches until the queue fits the ring again. Whoever holds _pop_mutex pops: a
+    // producer that finds it taken leaves the trimming to poll() or to the producer holding it
+    void trim_queue()
     {
-        for (int i = 0; i < window_ids.size(); i++)
+        std::unique_lock lock(_pop_mutex, std::try_to_lock);
+        if (!lock) return;
+        std::basic_string<TChar> text;
+        while (_queued.load() > _text.size() && _queue.pop(text))
         {
-            if (window_ids[i] == id)
-                return i;
+            _queued.fetch_sub(text.size());
+            _lost.fetch_add(count_lines(text), std::memory_order_relaxed);
         }
-        return -1;
     }
-};
 
+    // As many lines as poll() makes of the text
+    static std::size_t count_lines(const std::basic_string<TChar>& text)
+    {
+        auto breaks = static_cast<std::size_t>(std::count(text.begin(), text.end(), TChar('\n')));
+        return breaks + (!text.empty() && text.back() != TChar('\n'));
+    }
 
-#ifdef CURSE_IS_POSIX
-static termios original_term{}; // Store original terminal state
-static std::atomic_bool term_modified = false;
-#endif
+    void drop()
+    {
+        _first = (_first + 1) % _lines.size();
+        _count--;
+        _dropped++;
+    }
 
+    std::vector<TChar> _text;
+    std::vector<Span> _lines; // Ring of line spans, _count of them from _first
+    std::size_t _first = 0;
+    std::size_t _count = 0;
+    std::size_t _head = 0; // Where the next line goes
+    std::size_t _dropped = 0;
+
+    MPSCQueue<std::basic_string<TChar>> _queue;
+    std::mutex _pop_mutex; // One consumer at a time: poll(), or a producer trimming the queue
+    std::atomic<std::size_t> _queued = 0; // Characters in the queue
+    std::atomic<std::size_t> _lost = 0;
+    std::atomic_bool _pending = false;
+    std::function<void()> _notify;
+};
 
-// POSIX terminal output with a double buffer
-template<class TColor, class TChar>
-class CurseTerminal
+
+// Decides when frames are rendered. Any number of invalidations between two frames make a single frame,
+// and frames are at least 1/max_fps apart. Without invalidations nothing is rendered and no wake-up is asked for
+class FrameScheduler
 {
 public:
-    std::ostream& _os;
+    using Clock = std::chrono::steady_clock;
 
-    // Pointers to the data
-    //const std::vector<GSymbol>& _stack; // Symbols stack
-    //const std::array<std::size_t, ContextSize>& _context; //
+    explicit FrameScheduler(int max_fps = 60) { set_max_fps(max_fps); }
 
-    // Output matrix for rendering: each string is a row
-    std::vector<std::basic_string<TChar>> _output_matrix;
-    std::vector<std::vector<TColor>> _color_matrix;
-    std::vector<std::basic_string<TChar>> _prev_output_matrix;
-    std::vector<std::vector<TColor>> _prev_color_matrix;
-    std::size_t _rows = 0;
-    std::size_t _cols = 0;
-    bool _first_frame = true;
+    // 0 or less removes the cap
+    void set_max_fps(int fps)
+    {
+        _interval = fps > 0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::seconds(1)) / fps
+                            : Clock::duration::zero();
+    }
+
+    void invalidate() { _dirty = true; }
+    [[nodiscard]] bool dirty() const { return _dirty; }
 
-    explicit CurseTerminal(std::ostream& os) : _os(os)
+    // A frame is pending and the cap allows it now
+    [[nodiscard]] bool due(Clock::time_point now = Clock::now()) const { return _dirty && now >= _last + _interval; }
+
+    // How long to sleep, given the caller's timeout (-1 is forever), to render the pending frame on time
+    [[nodiscard]] int timeout(int timeout_ms, Clock::time_point now = Clock::now()) const
     {
-#ifdef CURSE_IS_POSIX
-        // Save the original terminal state once at initialization
-        tcgetattr(STDIN_FILENO, &original_term);
-#endif
+        if (!_dirty) return timeout_ms;
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(_last + _interval - now).count();
+        int wait = static_cast<int>(std::max<decltype(left)>(0, left));
+        return timeout_ms < 0 ? wait : std::min(timeout_ms, wait);
     }
 
-    /*void set_data(const std::vector<GSymbol>& stack, const std::array<std::size_t, ContextSize>& context) {
-        _stack = stack;
-        _context = context;
-    }*/
+    void rendered(Clock::time_point now = Clock::now())
+    {
+        _dirty = false;
+        _last = now;
+        _frames++;
+    }
 
-    [[nodiscard]] std::size_t rows() const { return _rows; }
-    [[nodiscard]] std::size_t cols() const { return _cols; }
+    [[nodiscard]] std::size_t frames() const { return _frames; }
 
-    void update_terminal_size()
+private:
+    Clock::duration _interval{};
+    Clock::time_point _last{};
+    std::size_t _frames = 0;
+    bool _dirty = true; // The first frame
+};
+
+
+#ifdef CURSE_IS_POSIX
+// Input, dispatch and rendering for one terminal, driven by poll. It can run on its own with run(), or
+// inside a host event loop: watch input_fd() and resize_fd() there and call pump() when either is ready
+// or timeout() has passed. A frame is rendered only when something changed, at most FrameScheduler::set_max_fps
+// times per second
+template<class TColor, class TChar, template<class> class TStyle = AppStyle>
+class EventLoop
+{
+public:
+    using Terminal = CurseTerminal<TColor, TChar>;
+
+    // Called for each event before it goes to the window stack. Return true to consume it
+    bool (*on_event)(EventLoop& loop, const IPEvent& ev) = nullptr;
+    // Called before each frame is rendered
+    void (*on_render)(EventLoop& loop) = nullptr;
+    void* user = nullptr; // For the callbacks
+
+    EventLoop(Terminal& terminal, WindowStack<TChar>& windows, const TStyle<TColor>& style, int input_fd = STDIN_FILENO)
+        : _terminal(terminal), _windows(windows), _style(style), _input(input_fd)
     {
-        std::size_t new_rows = 24, new_cols = 80;
-    #ifdef CURSE_IS_POSIX
-        winsize w{};
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0)
+        if (resize_pipe[0] < 0 && pipe(resize_pipe) == 0)
         {
-            new_rows = w.ws_row;
-            new_cols = w.ws_col;
+            for (int fd : resize_pipe)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            _owns_pipe = true;
         }
-    #endif
-        if (new_rows != _rows || new_cols != _cols)
-            init_matrix(new_rows, new_cols);   // re-alloc only when size actually changed
+        std::signal(SIGWINCH, Terminal::signal_handler);
+        _input.enter_raw();
     }
 
-    void reset_output_matrix()
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop()
     {
-        for (std::size_t i = 0; i < _output_matrix.size(); i++)
+        _input.leave_raw();
+        if (_owns_pipe)
         {
-            for (std::size_t j = 0; j < _output_matrix[0].size(); j++)
-            {
-                _output_matrix[i][j] = ' ';
-                _color_matrix[i][j] = TColor::None();
-            }
+            int r = resize_pipe[0], w = resize_pipe[1];
+            resize_pipe[0] = resize_pipe[1] = -1;
+            close(r);
+            close(w);
         }
     }
 
-    void set_cell(std::size_t row, std::size_t col, char value, const TColor& color = TColor())
+    [[nodiscard]] int input_fd() const { return _input.fd(); }
+    [[nodiscard]] int resize_fd() const { return resize_pipe[0]; }
+
+    // How long the host may sleep before calling pump() even without activity, -1 for no limit
+    [[nodiscard]] int timeout() const { return _input.timeout(_scheduler.timeout(-1)); }
+
+    Terminal& terminal() { return _terminal; }
+    WindowStack<TChar>& windows() { return _windows; }
+    WindowCompositor<TColor, TChar>& compositor() { return _compositor; }
+    FrameScheduler& scheduler() { return _scheduler; }
+
+    // Apply the commands of queue before each frame. Its wake_fd() is polled along with the input
+    void attach(UpdateQueue<TChar>& queue) { _updates = &queue; }
+    [[nodiscard]] int wake_fd() const { return _updates ? _updates->wake_fd() : -1; }
+
+    // Request a frame, e.g. after changing widgets outside of an event handler
+    void invalidate() { _scheduler.invalidate(); }
+    [[nodiscard]] bool dirty() const { return _scheduler.dirty(); }
+
+    void quit() { _running = false; }
+    [[nodiscard]] bool running() const { return _running && !_input.eof(); }
+
+    // Wait up to timeout_ms (-1 forever) for input or a resize, handle it and render if needed.
+    // Returns false once the loop has stopped
+    bool poll_once(int timeout_ms)
     {
-        if (row < _rows && col < _cols)
+        // A pending frame shortens the wait to its slot, input that arrives meanwhile goes into the same frame
+        // Negative fds are skipped by poll
+        pollfd fds[3] = {{input_fd(), POLLIN, 0}, {resize_fd(), POLLIN, 0}, {wake_fd(), POLLIN, 0}};
+        int n = poll(fds, 3, _input.timeout(_scheduler.timeout(timeout_ms)));
+        if (n > 0 && (fds[1].revents & POLLIN))
+            drain_resize();
+        if (n > 0 && (fds[2].revents & POLLIN))
         {
-            _output_matrix[row][col] = value;
-            _color_matrix[row][col] = color;
+            _updates->consume_wake();
+            _scheduler.invalidate(); // The commands are applied with the frame
         }
+
+        _events.clear();
+        if (n > 0 && (fds[0].revents & (POLLIN | POLLHUP)))
+            _input.drain(_events);
+        else
+            _input.expire(_events);
+        dispatch();
+
+        if (_running && _scheduler.due())
+            render();
+        return running();
     }
 
-    void set_text(std::size_t row, std::size_t col, const std::basic_string<TChar>& text, const TColor& color = TColor())
+    // Handle whatever is ready without blocking
+    bool pump() { return poll_once(0); }
+
+    // Run until quit() or the end of input
+    void run()
     {
-        if (row < _rows && col + text.size() <= _cols)
+        while (poll_once(-1)) {}
+    }
+
+    // Render a frame now
+    void render()
+    {
+        if (_resized)
         {
-            for (size_t i = 0; i < text.size(); ++i)
-            {
-                _output_matrix[row][col + i] = text[i];
-                _color_matrix[row][col + i] = color;
-            }
+            _terminal.update_terminal_size();
+            _resized = false;
         }
+        if (_updates)
+            _updates->apply(_windows);
+        if (on_render)
+            on_render(*this);
+        _terminal.reset_output_matrix();
+        _compositor.render_all(_windows, _terminal.surface(), _style);
+        _compositor.render_overlays(_windows, _terminal.surface(), _style);
+        _terminal.render_matrix();
+        _scheduler.rendered();
     }
 
-    void init_renderer() const
+protected:
+    void drain_resize()
     {
-        // Enter alternate screen buffer and hide cursor for smooth rendering
-        _os << "\033[?1049h"; // Enter alternate buffer
+        char buf[64];
+        while (read(resize_pipe[0], buf, sizeof(buf)) > 0) {}
+        _resized = true;
+        _scheduler.invalidate();
     }
 
-    void render_matrix()
+    void dispatch()
     {
-        if (_first_frame)
+        for (const IPEvent& ev : _events)
         {
-            _os << "\033[2J\033[H"; // Clear and home
-            _first_frame = false;
+            if (!_running) break;
+            if (!on_event || !on_event(*this, ev))
+                _windows.handle_event(ev);
+            _scheduler.invalidate();
         }
-        _os << "\033[?25l"; // Hide cursor
-        for (std::size_t r = 0; r < _rows; ++r)
+    }
+
+    Terminal& _terminal;
+    WindowStack<TChar>& _windows;
+    const TStyle<TColor>& _style;
+    WindowCompositor<TColor, TChar> _compositor;
+    InputReader _input;
+    FrameScheduler _scheduler;
+    UpdateQueue<TChar>* _updates = nullptr;
+    std::vector<IPEvent> _events;
+    bool _owns_pipe = false;
+    bool _running = true;
+    bool _resized = true; // Size is read for the first frame
+};
+
+
+// Read-only file shown as lines, for files of any size. The file is mmap'd and lines are views into the
+// mapping, nothing is copied. Line starts are indexed on a background thread, lines that are already
+// indexed can be shown meanwhile. The mapping reserves address space past the end of the file, so a
+// growing file is followed by poll() without mapping it again. Invalidate the widget showing it when
+// poll() returns true, or attach() it to an update queue to have that done as blocks are indexed. With
+// ListView::set_follow() it stays on the last line like tail -f.
+// Only for files that grow or are replaced: a file truncated in place is only seen at the next poll(), and
+// touching the mapping past the new end before that (lines, the indexer) raises SIGBUS. Truncating writers
+// such as copytruncate rotation need a copy of the file instead
+class FileView
+{
+public:
+    FileView() = default;
+    ~FileView() { close(); }
+
+    FileView(const FileView&) = delete;
+    FileView& operator=(const FileView&) = delete;
+
+    // False with errno set if the file can't be opened or mapped
+    bool open(const char* path, DiffKernel kernel = DiffKernel::Auto)
+    {
+        close();
+        _kernel = kernel;
+        _scan = select_newline_kernel(kernel);
+        _fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (_fd < 0) return false;
+        struct stat st{};
+        if (fstat(_fd, &st) != 0 || !map(static_cast<std::size_t>(st.st_size)))
         {
-            for (std::size_t c = 0; c < _cols; ++c)
-            {
-                if (_output_matrix[r][c] != _prev_output_matrix[r][c] ||
-                    _color_matrix[r][c] != _prev_color_matrix[r][c])
-                {
-                    // Move cursor (1-based for ANSI)
-                    _os << "\033[" << (r + 1) << ";" << (c + 1) << "H";
-                    _os << _color_matrix[r][c].code() << _output_matrix[r][c] << TColor::reset();
-                }
-            }
+            int err = errno;
+            close();
+            errno = err;
+            return false;
         }
-        _os.flush();
-        // Save current frame as previous
-        _prev_output_matrix = _output_matrix;
-        _prev_color_matrix = _color_matrix;
+        _path = path;
+        _size.store(static_cast<std::size_t>(st.st_size), std::memory_order_release);
+        start_indexer();
+        return true;
     }
 
-    // Call this on program exit to restore the screen and cursor
-    static void restore_terminal(std::ostream& os = std::cout)
+    void close()
     {
-        os << "\033[?25h\033[?1049l" << std::flush; // Show cursor, exit alt buffer
+        stop_indexer();
+        _notify_pending.store(false);
+        if (_data) munmap(const_cast<char*>(_data), _reserved);
+        if (_fd >= 0) ::close(_fd);
+        _data = nullptr;
+        _reserved = 0;
+        _fd = -1;
+        _size.store(0, std::memory_order_relaxed);
+        std::lock_guard lock(_mutex);
+        _starts.assign(1, 0);
+        _indexed = 0;
+        _polled = 0;
     }
 
-    static void signal_handler(int signal)
+    // Invalidate the widget at path in the window with the given id of updates whenever the indexer
+    // publishes a block, so a large file shows its lines while they are indexed. Call it before open(),
+    // the file must outlive the queue
+    void attach(UpdateQueue<char>& updates, int window_id, WidgetPath path)
     {
-#ifdef CURSE_IS_POSIX
-        if (signal == SIGWINCH) return;
-        // Restore original terminal attributes if they were modified
-        if (term_modified.load())
+        _notify = [this, &updates, window_id, path]
         {
-            tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
-            term_modified = false;
-        }
-#endif
-        restore_terminal();
-        exit(signal);
+            updates.post([this, window_id, path](WindowStack<char>& ws)
+            {
+                _notify_pending.store(false); // Blocks published from now on notify again
+                if (Widget<char>* w = UpdateQueue<char>::widget(ws, window_id, path))
+                    w->invalidate();
+            });
+        };
     }
 
-    static void init_signal_handler()
+    [[nodiscard]] bool is_open() const { return _fd >= 0; }
+    [[nodiscard]] std::size_t size() const { return _size.load(std::memory_order_acquire); }
+
+    // Bytes indexed so far, less than size() while the background scan runs
+    [[nodiscard]] std::size_t indexed() const
     {
-#ifdef CURSE_IS_POSIX
-        std::signal(SIGINT, signal_handler);
-        std::signal(SIGWINCH, signal_handler);
-#endif
+        std::lock_guard lock(_mutex);
+        return _indexed;
     }
 
-    // Helper for raw input
-    static int getch()
+    [[nodiscard]] bool indexing() const { return _running.load(std::memory_order_acquire); }
+
+    // Block until the background scan is done
+    void wait()
     {
-#ifdef CURSE_IS_POSIX
-        termios newt = original_term;
-        newt.c_lflag &= ~(ICANON | ECHO);
-        tcsetattr(STDIN_FILENO, TCSANOW, &newt);
-        term_modified = true;
+        if (_indexer.joinable()) _indexer.join();
+    }
 
-        int c = getchar();
+    // Lines indexed so far. A last line without '\n' counts
+    [[nodiscard]] std::size_t lines() const
+    {
+        std::lock_guard lock(_mutex);
+        return _starts.size() - 1 + (_indexed > _starts.back());
+    }
 
-        // Restore immediately after reading
-        tcsetattr(STDIN_FILENO, TCSANOW, &original_term);
-        term_modified = false;
+    // Line without the line break. Valid until the file is closed or poll() maps it again
+    [[nodiscard]] std::string_view line(std::size_t i) const
+    {
+        std::lock_guard lock(_mutex);
+        if (i >= _starts.size() || (i + 1 == _starts.size() && _starts[i] >= _indexed)) return {};
+        std::uint64_t begin = _starts[i];
+        std::uint64_t end = i + 1 < _starts.size() ? _starts[i + 1] - 1 : _indexed;
+        if (end > begin && _data[end - 1] == '\r') end--;
+        return {_data + begin, static_cast<std::size_t>(end - begin)};
+    }
 
-        return c;
-#else
-        return -1;
-#endif
+    // Pick up data appended to the file and index it. A file that got shorter (rotated, truncated) is
+    // reloaded. Returns true if the file changed, or if more of it was indexed since the last poll()
+    bool poll()
+    {
+        if (_fd < 0) return false;
+        bool indexed_more;
+        {
+            std::lock_guard lock(_mutex);
+            indexed_more = _indexed != _polled;
+            _polled = _indexed;
+        }
+        struct stat st{};
+        if (fstat(_fd, &st) != 0) return indexed_more;
+        auto new_size = static_cast<std::size_t>(st.st_size);
+        std::size_t old_size = size();
+        if (new_size == old_size) return indexed_more;
+        if (new_size < old_size)
+        {
+            std::string path = _path;
+            open(path.c_str(), _kernel);
+            return true;
+        }
+
+        if (new_size > _reserved)
+        {
+            // Out of reserved address space, map again with more. The only time the mapping moves
+            stop_indexer();
+            bool mapped;
+            {
+                std::lock_guard lock(_mutex);
+                munmap(const_cast<char*>(_data), _reserved);
+                _data = nullptr;
+                mapped = map(new_size);
+            }
+            if (!mapped)
+            {
+                close();
+                return true;
+            }
+        }
+        // Sequentially consistent with the indexer's exit check, so one of the two sees the new size
+        _size.store(new_size);
+        if (!_running.load())
+            start_indexer();
+        return true;
     }
 
-    /*static int get_terminal_width()
+    // Virtualized list over the lines. The list keeps the file alive
+    static std::shared_ptr<ListView<char>> list(std::shared_ptr<FileView> file, Point size)
     {
-#ifdef CURSE_IS_POSIX
-        winsize w{};
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) return w.ws_col;
-#endif
-        return 80;
+        return std::make_shared<ListView<char>>(ListView<char>::from_views(
+            [file] { return file->lines(); },
+            [file](std::size_t i) { return file->line(i); },
+            size));
     }
 
-    static int get_terminal_height()
+    static constexpr std::size_t scan_block = 1 << 20; // Bytes indexed between two publications
+
+protected:
+    bool map(std::size_t size)
     {
-#ifdef CURSE_IS_POSIX
-        winsize w{};
-        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == 0) return w.ws_row;
+        // Pages past the end of the file fault until the file grows into them, they are never touched before
+        std::size_t extra = sizeof(void*) >= 8 ? std::size_t(1) << 30 : std::size_t(64) << 20;
+        _reserved = std::max<std::size_t>(size, 1) + std::max(size, extra);
+        void* p = mmap(nullptr, _reserved, PROT_READ, MAP_SHARED, _fd, 0);
+        if (p == MAP_FAILED)
+        {
+            _reserved = 0;
+            return false;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(p, std::max<std::size_t>(size, 1), MADV_SEQUENTIAL);
 #endif
-        return 24;
-    }*/
+        _data = static_cast<const char*>(p);
+        return true;
+    }
 
-    void print()
+    // Scan up to the current size a block at a time, publishing the line starts of each block.
+    // Restarted by poll() when more data arrives after it finished
+    void start_indexer()
     {
-        // Render the output
-        render_matrix();
+        if (_indexer.joinable()) _indexer.join();
+        _stop.store(false, std::memory_order_relaxed);
+        _running.store(true, std::memory_order_release);
+        _indexer = std::thread([this]
+        {
+            std::vector<std::uint64_t> found;
+            for (;;)
+            {
+                std::size_t from;
+                {
+                    std::lock_guard lock(_mutex);
+                    from = _indexed;
+                }
+                std::size_t to = std::min(size(), from + scan_block);
+                if (to <= from || _stop.load(std::memory_order_relaxed))
+                {
+                    _running.store(false);
+                    // A poll() between the size check and the flag saw the indexer running, look again
+                    if (_size.load() <= from || _stop.load(std::memory_order_relaxed)) break;
+                    _running.store(true);
+                    continue;
+                }
+                found.clear();
+                _scan(_data + from, to - from, from, found);
+                {
+                    std::lock_guard lock(_mutex);
+                    _starts.insert(_starts.end(), found.begin(), found.end());
+                    _indexed = to;
+                }
+                // One notification until the UI ran it
+                if (_notify && !_notify_pending.exchange(true))
+                    _notify();
+            }
+        });
     }
 
-protected:
-    void init_matrix(std::size_t rows, std::size_t cols)
+    void stop_indexer()
     {
-        _rows = rows;
-        _cols = cols;
-        _output_matrix.assign(rows, std::basic_string<TChar>(cols, ' '));
-        _color_matrix.assign(rows, std::vector<TColor>(cols, TColor::None()));
-        _prev_output_matrix.assign(rows, std::basic_string<TChar>(cols, ' '));
-        _prev_color_matrix.assign(rows, std::vector<TColor>(cols, TColor::None()));
-        _first_frame = true;
+        _stop.store(true, std::memory_order_relaxed);
+        if (_indexer.joinable()) _indexer.join();
+        _running.store(false, std::memory_order_relaxed);
     }
+
+    int _fd = -1;
+    std::string _path;
+    const char* _data = nullptr;
+    std::size_t _reserved = 0; // Mapped length, past the end of the file
+    std::atomic<std::size_t> _size{0};
+    DiffKernel _kernel = DiffKernel::Auto; // Kept when poll() opens the file again
+    NewlineScanFn _scan = scan_newlines_scalar;
+
+    mutable std::mutex _mutex; // Guards the index
+    std::vector<std::uint64_t> _starts{0}; // Line starts, the first line starts at 0
+    std::size_t _indexed = 0; // Bytes scanned
+    std::size_t _polled = 0; // _indexed at the last poll()
+
+    std::thread _indexer;
+    std::atomic<bool> _running{false};
+    std::atomic<bool> _stop{false};
+
+    std::function<void()> _notify; // Set by attach(), called on the indexer thread
+    std::atomic<bool> _notify_pending{false};
 };
+#endif
 
 } // namespace curse
 
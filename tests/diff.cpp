@@ -0,0 +1,549 @@
+//
+// Frame differ: vectorized kernels against the scalar one, Unicode cells, scrolling, color depths.
+// Output is checked by playing it on a small terminal model
+//
+
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "curse.h"
+
+using namespace curse;
+
+static int failures = 0;
+
+static void check(bool cond, const char* what)
+{
+    if (!cond)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Enough of a terminal for what CurseTerminal sends: cursor moves, SGR colors, clear, scroll regions,
+// scrolling and UTF-8 text. Private modes (alternate screen, cursor) are ignored
+struct Screen
+{
+    struct Cell
+    {
+        char32_t glyph = ' ';
+        int fg = 0, bg = 0; // 0 is the default color, 256 + n is indexed, 0x1000000 | rgb is true color
+
+        bool operator==(const Cell&) const = default;
+    };
+
+    int rows, cols;
+    std::vector<Cell> cells;
+    int row = 0, col = 0, fg = 0, bg = 0, top = 0, bottom;
+    bool broken = false; // Got something the model does not know
+
+    Screen(int r, int c) : rows(r), cols(c), cells(static_cast<std::size_t>(r * c)), bottom(r - 1) {}
+
+    Cell& at(int x, int y) { return cells[static_cast<std::size_t>(y * cols + x)]; }
+
+    // Move the rows of the region by n, up for n > 0. Exposed rows are blank in the current colors
+    void scroll(int n)
+    {
+        for (int k = 0; k < std::abs(n); k++)
+        {
+            for (int y = n > 0 ? top : bottom; n > 0 ? y < bottom : y > top; y += n > 0 ? 1 : -1)
+                for (int x = 0; x < cols; x++)
+                    at(x, y) = at(x, y + (n > 0 ? 1 : -1));
+            for (int x = 0; x < cols; x++)
+                at(x, n > 0 ? bottom : top) = {' ', fg, bg};
+        }
+    }
+
+    void sgr(const std::vector<int>& ps)
+    {
+        if (ps.empty()) fg = bg = 0;
+        for (std::size_t i = 0; i < ps.size(); i++)
+        {
+            int p = ps[i];
+            if (p == 0) fg = bg = 0;
+            else if (p == 39) fg = 0;
+            else if (p == 49) bg = 0;
+            else if ((p >= 30 && p <= 37) || (p >= 90 && p <= 97)) fg = p;
+            else if ((p >= 40 && p <= 47) || (p >= 100 && p <= 107)) bg = p;
+            else if ((p == 38 || p == 48) && i + 2 < ps.size() && ps[i + 1] == 5)
+            {
+                (p == 38 ? fg : bg) = 256 + ps[i + 2];
+                i += 2;
+            }
+            else if ((p == 38 || p == 48) && i + 4 < ps.size() && ps[i + 1] == 2)
+            {
+                (p == 38 ? fg : bg) = 0x1000000 | ps[i + 2] << 16 | ps[i + 3] << 8 | ps[i + 4];
+                i += 4;
+            }
+            else broken = true;
+        }
+    }
+
+    void feed(const std::string& out)
+    {
+        std::size_t i = 0;
+        while (i < out.size())
+        {
+            auto c = static_cast<unsigned char>(out[i]);
+            if (c == '\033')
+            {
+                if (i + 1 >= out.size() || out[i + 1] != '[') { broken = true; return; }
+                std::size_t j = i + 2;
+                bool priv = j < out.size() && out[j] == '?';
+                if (priv) j++;
+                std::vector<int> ps;
+                int cur = -1;
+                for (; j < out.size() && ((out[j] >= '0' && out[j] <= '9') || out[j] == ';'); j++)
+                {
+                    if (out[j] == ';') { ps.push_back(std::max(cur, 0)); cur = -1; }
+                    else cur = std::max(cur, 0) * 10 + (out[j] - '0');
+                }
+                if (cur >= 0) ps.push_back(cur);
+                if (j >= out.size()) { broken = true; return; }
+                char f = out[j];
+                i = j + 1;
+                if (priv) continue;
+                auto param = [&](std::size_t k, int def) { return k < ps.size() && ps[k] ? ps[k] : def; };
+                switch (f)
+                {
+                case 'H': row = param(0, 1) - 1; col = param(1, 1) - 1; break;
+                case 'm': sgr(ps); break;
+                case 'J': std::fill(cells.begin(), cells.end(), Cell{' ', fg, bg}); break;
+                case 'r': top = param(0, 1) - 1; bottom = param(1, rows) - 1; row = col = 0; break;
+                case 'S': scroll(param(0, 1)); break;
+                case 'T': scroll(-param(0, 1)); break;
+                default: broken = true; break;
+                }
+                continue;
+            }
+
+            int len = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+            char32_t cp = len == 1 ? c : c & (0x7F >> len);
+            for (int k = 1; k < len && i + k < out.size(); k++)
+                cp = cp << 6 | (static_cast<unsigned char>(out[i + k]) & 0x3F);
+            i += len;
+            if (row >= 0 && row < rows && col >= 0 && col < cols)
+                at(col, row) = {cp, fg, bg};
+            col++;
+        }
+    }
+};
+
+void test_kernels(std::mt19937& rng)
+{
+    const FirstDiffFn kernels[] = {select_diff_kernel(DiffKernel::SSE2), select_diff_kernel(DiffKernel::AVX2)};
+
+    for (int iter = 0; iter < 2000; iter++)
+    {
+        std::size_t n = rng() % 200;
+        std::vector<unsigned char> a(n), b;
+        for (auto& x : a) x = rng() % 4;
+        b = a;
+        if (n && rng() % 4)
+            b[rng() % n] ^= 1 + rng() % 3;
+
+        std::size_t expected = first_diff_scalar(a.data(), b.data(), n);
+        for (FirstDiffFn kernel : kernels)
+            check(kernel(a.data(), b.data(), n) == expected, "first_diff matches the scalar kernel");
+    }
+}
+
+// ASCII text for either cell type
+template<class TChar>
+std::basic_string<TChar> widen(const std::string& text)
+{
+    return {text.begin(), text.end()};
+}
+
+// Random frames of mostly stable content with a few changes, like an UI. Unicode cells get wide glyphs too
+template<class TChar>
+void draw_random(Surface<ANSIColor, TChar>& surface, std::mt19937& rng, int frame)
+{
+    auto color = [&]()
+    {
+        return ANSIColor(static_cast<ANSIColor::FG>(30 + rng() % 8), static_cast<ANSIColor::BG>(40 + rng() % 8));
+    };
+
+    surface.fill(2, 2, 40, 10, ' ', ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Blue));
+    surface.overlay_text(4, 4, widen<TChar>("static label"), ANSIColor(ANSIColor::FG::BrightWhite, ANSIColor::BG::None));
+    surface.overlay_text(4, 5, widen<TChar>("frame " + std::to_string(frame)), ANSIColor());
+
+    for (int i = rng() % 6; i > 0; i--)
+    {
+        int x = static_cast<int>(rng() % (surface.cols() + 10)) - 5;
+        int y = static_cast<int>(rng() % (surface.rows() + 4)) - 2;
+        switch (rng() % 4)
+        {
+        case 0: surface.fill(x, y, rng() % 40, rng() % 8, 'a' + rng() % 26, color()); break;
+        case 1: surface.set(x, y, 'A' + rng() % 26, color()); break;
+        case 2:
+        {
+            auto text = std::basic_string<TChar>(rng() % 50, TChar('0' + rng() % 10));
+            if constexpr (sizeof(TChar) > 1)
+                for (TChar& c : text)
+                    if (rng() % 4 == 0) c = U'\u65e5';
+            surface.overlay_text(x, y, text, color());
+            break;
+        }
+        default: surface.blend(x, y, rng() % 20, rng() % 5, color()); break;
+        }
+    }
+}
+
+template<class TChar>
+void test_frames(std::mt19937& rng)
+{
+    const DiffKernel kernels[] = {DiffKernel::Scalar, DiffKernel::SSE2, DiffKernel::AVX2};
+    std::ostringstream os[3];
+    std::vector<CurseTerminal<ANSIColor, TChar>> terms;
+    terms.reserve(3);
+    for (int i = 0; i < 3; i++)
+    {
+        terms.emplace_back(os[i]);
+        terms[i].resize(50, 173); // Odd width, so rows don't align to vectors
+        terms[i].set_diff_kernel(kernels[i]);
+    }
+
+    for (int frame = 0; frame < 300; frame++)
+    {
+        auto seed = rng();
+        for (int i = 0; i < 3; i++)
+        {
+            std::mt19937 frame_rng(seed);
+            draw_random(terms[i].surface(), frame_rng, frame);
+            os[i].str("");
+            terms[i].render_matrix();
+        }
+        check(os[0].str() == os[1].str(), "SSE2 frame is byte-identical to scalar");
+        check(os[0].str() == os[2].str(), "AVX2 frame is byte-identical to scalar");
+    }
+}
+
+// Encoding on 4 threads shows the same screen as on one, and that screen holds the surface glyphs
+void test_parallel_frames(std::mt19937& rng)
+{
+    const int rows = 40, cols = 131;
+    std::ostringstream os[2];
+    CurseTerminal<ANSIColor, char> serial(os[0]), parallel(os[1]);
+    serial.set_threads(1);
+    parallel.set_threads(4);
+    Screen screens[2] = {{rows, cols}, {rows, cols}};
+    std::vector<Cell<ANSIColor, char>> expected;
+    int mismatches = 0;
+
+    for (int frame = 0; frame < 300; frame++)
+    {
+        auto seed = rng();
+        int i = 0;
+        for (auto* term : {&serial, &parallel})
+        {
+            if (frame == 0) term->resize(rows, cols);
+            std::mt19937 frame_rng(seed);
+            draw_random(term->surface(), frame_rng, frame);
+            expected.assign(term->surface().cells().begin(), term->surface().cells().end());
+            os[i].str("");
+            term->render_matrix();
+            screens[i].feed(os[i].str());
+            i++;
+        }
+        bool glyphs = true;
+        for (std::size_t k = 0; k < expected.size(); k++)
+            glyphs = glyphs && screens[0].cells[k].glyph == static_cast<unsigned char>(expected[k].glyph);
+        mismatches += !(screens[0].cells == screens[1].cells) || !glyphs;
+    }
+    check(!screens[0].broken && !screens[1].broken, "terminal model understands the output");
+    check(mismatches == 0, "parallel encoding shows the same screen as the serial one");
+}
+
+// Wide glyphs take two cells and are sent once, clusters are one cell
+void test_unicode()
+{
+    check(codepoint_width(U'a') == 1 && codepoint_width(U'\u0301') == 0 && codepoint_width(U'日') == 2 &&
+          codepoint_width(U'\U0001F600') == 2, "code point widths");
+
+    std::u32string text = to_glyphs("e\xcc\x81\xe6\x97\xa5!"); // e + combining acute, CJK, ASCII
+    check(text.size() == 3 && GlyphTable::is_cluster(text[0]), "combining mark joins the base");
+    check(text_width<char32_t>(text) == 4, "text width counts columns");
+    check(to_glyphs("a\xef\xbf\xbd" "b") == U"a\ufffdb", "an encoded U+FFFD is one glyph");
+    check(to_glyphs("a\xef\xbf" "b\xff") == U"a\ufffd\ufffdb\ufffd", "each invalid byte is one U+FFFD");
+
+    std::ostringstream os;
+    CurseTerminal<ANSIColor, char32_t> term(os);
+    term.resize(2, 8);
+    term.surface().set_text(0, 0, text, ANSIColor());
+    check(term.surface().at(2, 0).glyph == wide_tail, "wide glyph is followed by its tail cell");
+    term.render_matrix();
+    check(os.str().find("e\xcc\x81\xe6\x97\xa5!") != std::string::npos, "glyphs are sent without a move in between");
+
+    // Overwriting the right half: the terminal blanks the left half by itself, the lead is not resent
+    term.surface().set_text(0, 0, text, ANSIColor());
+    term.surface().set(2, 0, U'z', ANSIColor());
+    os.str("");
+    term.render_matrix();
+    check(os.str().find('z') != std::string::npos && os.str().find("\xe6\x97\xa5") == std::string::npos,
+          "only the overwritten half is sent");
+}
+
+// Colors are quantized to the nearest palette entry, and each depth gets its own SGR form
+void test_colors(std::mt19937& rng)
+{
+    bool round_trip = true;
+    for (int i = 16; i < 256; i++)
+        round_trip = round_trip && xterm_rgb(rgb_to_256(xterm_rgb(i))) == xterm_rgb(i);
+    for (int i = 0; i < 16; i++)
+        round_trip = round_trip && rgb_to_16(xterm_rgb(i)) == i;
+    check(round_trip, "palette colors quantize to themselves");
+
+    // Never further than the nearest cube entry, found by trying all of them
+    bool nearest = true;
+    for (int iter = 0; iter < 2000; iter++)
+    {
+        std::uint32_t rgb = rng() & 0xffffff;
+        int best = rgb_distance(rgb, xterm_rgb(16));
+        for (int i = 17; i < 232; i++)
+            best = std::min(best, rgb_distance(rgb, xterm_rgb(i)));
+        nearest = nearest && rgb_distance(rgb, xterm_rgb(rgb_to_256(rgb))) <= best;
+    }
+    check(nearest, "rgb_to_256 picks the nearest cube or gray entry");
+    check(rgb_to_256(0x123456) == 23 && rgb_to_256(0x808080) == 244 && rgb_to_16(0x808080) == 8 &&
+          rgb_to_16(0x0000ff) == 4, "known quantizations");
+
+    TrueColor rgb(0x123456, 0xff8700);
+    check(rgb.code(ColorDepth::TrueColor) == "\033[38;2;18;52;86;48;2;255;135;0m", "true color SGR");
+    check(rgb.code(ColorDepth::Indexed256) == "\033[38;5;23;48;5;208m", "true color quantized to 256 colors");
+    check(rgb.code(ColorDepth::ANSI16) == "\033[30;43m", "true color quantized to 16 colors");
+    check(TrueColor(TrueColor::none, 0xffffff).code(ColorDepth::ANSI16) == "\033[39;107m", "unset layer keeps the default");
+
+    IndexedColor indexed(196, 21);
+    check(indexed.code(ColorDepth::TrueColor) == "\033[38;5;196;48;5;21m" &&
+          indexed.code(ColorDepth::Indexed256) == "\033[38;5;196;48;5;21m", "indexed SGR");
+    check(indexed.code(ColorDepth::ANSI16) == "\033[91;44m", "indexed quantized to 16 colors");
+    check(IndexedColor(1, 9).code(ColorDepth::ANSI16) == "\033[31;101m" &&
+          IndexedColor(-1, 3).code(ColorDepth::ANSI16) == "\033[39;43m", "basic indices use the short codes");
+
+    // The terminal encodes every cell at its depth
+    std::ostringstream os;
+    CurseTerminal<TrueColor, char> term(os);
+    term.resize(4, 20);
+    for (ColorDepth depth : {ColorDepth::TrueColor, ColorDepth::Indexed256, ColorDepth::ANSI16})
+    {
+        term.set_color_depth(depth);
+        term.surface().overlay_text(0, 1, "colors", rgb);
+        os.str("");
+        term.render_matrix();
+        check(os.str().find(rgb.code(depth)) != std::string::npos, "terminal output uses the depth's SGR");
+        check((os.str().find("38;2;") != std::string::npos) == (depth == ColorDepth::TrueColor) &&
+              (os.str().find("38;5;") != std::string::npos) == (depth == ColorDepth::Indexed256),
+              "no deeper colors than the terminal takes");
+    }
+}
+
+// A log pane that gets one more line scrolls the terminal and sends only that line
+void test_log_scroll()
+{
+    LogBuffer<char> ring(64, 8);
+    for (int i = 0; i < 20; i++)
+    {
+        ring.append("entry " + std::to_string(i) + "\n");
+        ring.poll();
+    }
+    check(ring.lines() <= 8 && ring.line(ring.lines() - 1) == "entry 19", "ring keeps the newest lines");
+    std::size_t used = 0;
+    for (std::size_t i = 0; i < ring.lines(); i++)
+        used += ring.line(i).size() + 1;
+    check(used <= 64 && ring.dropped() + ring.lines() == 20, "ring stays within its budget");
+
+    // A stalled UI: the queue stays about the size of the ring and the oldest batches go
+    LogBuffer<char> stalled(64, 8);
+    std::size_t most = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        stalled.append("line " + std::to_string(i) + "\n");
+        most = std::max(most, stalled.queued());
+    }
+    check(most <= 64 + 9 && stalled.lost() > 0, "the queue is bounded by the ring size");
+    stalled.poll();
+    check(stalled.queued() == 0 && stalled.line(stalled.lines() - 1) == "line 999", "the newest lines are kept");
+    check(stalled.lines() + stalled.dropped() + stalled.lost() == 1000, "every line is kept, dropped or lost");
+
+    // Producers on several threads and a UI that polls now and then
+    LogBuffer<char> shared(256, 16);
+    std::atomic<std::size_t> most_shared{0};
+    std::vector<std::thread> producers;
+    for (int t = 0; t < 4; t++)
+        producers.emplace_back([&shared, &most_shared, t]
+        {
+            for (int i = 0; i < 5000; i++)
+            {
+                shared.append(i % 3 ? "worker " + std::to_string(t) + "\n" : "two\nlines");
+                std::size_t queued = shared.queued(), seen = most_shared.load();
+                while (queued > seen && !most_shared.compare_exchange_weak(seen, queued)) {}
+            }
+        });
+    for (int i = 0; i < 50; i++)
+    {
+        shared.poll();
+        std::this_thread::yield();
+    }
+    for (auto& producer : producers)
+        producer.join();
+    shared.poll();
+    check(most_shared <= 2 * 256 + 4 * 9, "the queue stays bounded with several producers");
+    check(shared.lines() + shared.dropped() + shared.lost() == 4 * (5000 + 1667), "lines add up with several producers");
+
+    auto log = std::make_shared<LogBuffer<char>>();
+    Widget<char> pane(LogBuffer<char>::list(log, {40, 10}));
+    AppStyle<TrueColor> style;
+    std::ostringstream os;
+    CurseTerminal<TrueColor, char> term(os);
+    term.resize(12, 40);
+    auto frame = [&]
+    {
+        log->poll();
+        pane.layout();
+        term.reset_output_matrix();
+        pane.render(term.surface(), style, true, true, 0, 0);
+        os.str("");
+        term.render_matrix();
+        return os.str();
+    };
+    for (int i = 0; i < 30; i++)
+        log->append("request " + std::to_string(i * 7919) + " done in " + std::to_string(i % 13) + " ms\n");
+    frame();
+    log->append("request 31 failed\n"); // Blanks between the words are skipped
+    std::string out = frame();
+    check(out.find("\033[1;10r\033[1S") != std::string::npos, "the pane is scrolled by one line");
+    check(out.find("failed") != std::string::npos && out.find("request 229651") == std::string::npos,
+          "only the new line is sent");
+}
+
+// Rows that moved are found by their hashes and scrolled, without hints
+template<class TChar>
+void test_detected_scroll()
+{
+    std::ostringstream os;
+    CurseTerminal<ANSIColor, TChar> term(os);
+    term.resize(10, 30);
+    auto frame = [&](int first)
+    {
+        term.reset_output_matrix();
+        for (int y = 0; y < 10; y++)
+            term.surface().overlay_text(0, y, widen<TChar>("row-" + std::to_string(first + y) + "-of-the-output"), ANSIColor());
+        os.str("");
+        term.render_matrix();
+        return os.str();
+    };
+    frame(0);
+    std::string up = frame(3);
+    check(up.find("\033[1;10r\033[3S") != std::string::npos, "rows moving up scroll the screen");
+    check(up.find("row-12") != std::string::npos && up.find("row-5") == std::string::npos,
+          "only the exposed rows are sent");
+    std::string down = frame(1);
+    check(down.find("\033[1;10r\033[2T") != std::string::npos, "rows moving down scroll back");
+
+    term.set_scroll_regions(false);
+    check(frame(2).find("\033[r") == std::string::npos, "scroll regions can be turned off");
+}
+
+// Random regions of rows move by random amounts. With scroll regions the terminal must end up showing the
+// same screen as without them, at every frame and with any number of encoding threads
+template<class TChar>
+void test_random_scroll(std::mt19937& rng)
+{
+    const int rows = 40, cols = 90;
+    using Line = std::pair<std::string, int>; // Text and its color
+    auto random_line = [&]
+    {
+        std::string text(rng() % cols, ' ');
+        for (char& c : text)
+            c = rng() % 3 ? static_cast<char>('a' + rng() % 26) : ' ';
+        return Line(text, static_cast<int>(rng() % 8));
+    };
+
+    for (int threads : {1, 4})
+    {
+        std::ostringstream os_on, os_off;
+        CurseTerminal<ANSIColor, TChar> on(os_on), off(os_off);
+        on.resize(rows, cols);
+        off.resize(rows, cols);
+        off.set_scroll_regions(false);
+        on.set_threads(threads);
+        off.set_threads(threads);
+        Screen screen_on(rows, cols), screen_off(rows, cols);
+
+        std::vector<Line> model(rows);
+        for (Line& line : model)
+            line = random_line();
+        int mismatches = 0, scrolled = 0;
+        std::size_t bytes_on = 0, bytes_off = 0;
+        for (int frame = 0; frame < 500; frame++)
+        {
+            int y0 = static_cast<int>(rng() % rows), y1 = y0 + 1 + static_cast<int>(rng() % (rows - y0));
+            int n = static_cast<int>(rng() % 5) - 2;
+            if (rng() % 4 == 0)
+                n = static_cast<int>(rng() % 21) - 10;
+            if (n > 0)
+                for (int y = y0; y < y1; y++)
+                    model[y] = y + n < y1 ? model[y + n] : random_line();
+            else if (n < 0)
+                for (int y = y1 - 1; y >= y0; y--)
+                    model[y] = y + n >= y0 ? model[y + n] : random_line();
+            if (rng() % 3 == 0)
+                model[rng() % rows] = random_line();
+            if (rng() % 5 == 0)
+                model[rng() % rows] = {"", 0};
+
+            for (auto* term : {&on, &off})
+            {
+                term->reset_output_matrix();
+                for (int y = 0; y < rows; y++)
+                    term->surface().overlay_text(0, y, widen<TChar>(model[y].first),
+                                                 ANSIColor(static_cast<ANSIColor::FG>(30 + model[y].second), ANSIColor::BG::None));
+                if (frame % 7 == 0)
+                    term->surface().fill(5, 5, 20, 3, '#', ANSIColor());
+            }
+            os_on.str("");
+            os_off.str("");
+            on.render_matrix();
+            off.render_matrix();
+            scrolled += os_on.str().find("\033[r") != std::string::npos;
+            bytes_on += os_on.str().size();
+            bytes_off += os_off.str().size();
+            screen_on.feed(os_on.str());
+            screen_off.feed(os_off.str());
+            mismatches += screen_on.cells != screen_off.cells;
+        }
+        check(!screen_on.broken && !screen_off.broken, "random scrolls use only what the screen model knows");
+        check(mismatches == 0, "scroll regions show the same screen as redrawing the rows");
+        check(scrolled > 0 && bytes_on < bytes_off, "random scrolls use scroll regions and send less");
+    }
+}
+
+int main()
+{
+    std::mt19937 rng(42);
+    test_kernels(rng);
+    test_frames<char>(rng);
+    test_frames<char32_t>(rng);
+    test_parallel_frames(rng);
+    test_unicode();
+    test_colors(rng);
+    test_log_scroll();
+    test_detected_scroll<char>();
+    test_detected_scroll<char32_t>();
+    test_random_scroll<char>(rng);
+    test_random_scroll<char32_t>(rng);
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "diff: OK" << std::endl;
+    return 0;
+}
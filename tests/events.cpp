@@ -0,0 +1,222 @@
+//
+// Terminal input decoding, raw mode, frame scheduling and updates from other threads
+//
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "curse.h"
+
+using namespace curse;
+
+static int failures = 0;
+
+static void check(bool cond, const char* what)
+{
+    if (!cond)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+static std::vector<IPEvent> decode(InputDecoder& decoder, const std::string& bytes)
+{
+    std::vector<IPEvent> out;
+    decoder.feed(bytes.data(), bytes.size(), out);
+    return out;
+}
+
+static bool is_key(const IPEvent& e, int key) { return e.type == EventType::Click && e.key == key; }
+static bool is_key(const IPEvent& e, Key key) { return is_key(e, static_cast<int>(key)); }
+
+// CSI and SS3 keys, split sequences, lone ESC against Alt+key, UTF-8
+void test_decoder()
+{
+    InputDecoder decoder;
+    auto ev = decode(decoder, "\033[A\033OB\033[1;5C\033[D\033[3~\033[15~\033OP\033[H\033[F\033[Z");
+    check(ev.size() == 10, "one event per CSI/SS3 key");
+    if (ev.size() == 10)
+    {
+        check(ev[0].type == EventType::ArrowUp && ev[1].type == EventType::ArrowDown, "CSI and SS3 arrows");
+        check(ev[2].type == EventType::ArrowRight && ev[3].type == EventType::ArrowLeft, "modifiers are ignored");
+        check(is_key(ev[4], Key::Delete) && is_key(ev[5], Key::F5) && is_key(ev[6], Key::F1), "VT and SS3 function keys");
+        check(is_key(ev[7], Key::Home) && is_key(ev[8], Key::End) && is_key(ev[9], Key::BackTab), "xterm keys");
+    }
+
+    // A sequence cut anywhere waits for the rest
+    const std::string seq = "\033[24~";
+    for (std::size_t cut = 1; cut < seq.size(); cut++)
+    {
+        auto first = decode(decoder, seq.substr(0, cut));
+        check(first.empty() && decoder.pending(), "partial sequence stays pending");
+        auto rest = decode(decoder, seq.substr(cut));
+        check(rest.size() == 1 && is_key(rest[0], Key::F12) && !decoder.pending(), "split sequence is joined");
+    }
+
+    // A lone ESC is only the Escape key once flushed, ESC + key is Alt+key
+    check(decode(decoder, "\033").empty() && decoder.pending(), "lone ESC waits");
+    std::vector<IPEvent> flushed;
+    decoder.flush(flushed);
+    check(flushed.size() == 1 && is_key(flushed[0], Key::Escape) && !decoder.pending(), "flushed ESC is Escape");
+    ev = decode(decoder, "\033x");
+    check(ev.size() == 2 && is_key(ev[0], Key::Escape) && is_key(ev[1], 'x'), "Alt+key is Escape then the key");
+
+    // UTF-8, also split between reads. A stray continuation byte passes through
+    ev = decode(decoder, "a\xc3\xa9\xe2\x94\x80\xf0\x9f\x98\x80");
+    check(ev.size() == 4 && is_key(ev[0], 'a') && is_key(ev[1], 0xe9) && is_key(ev[2], 0x2500) && is_key(ev[3], 0x1f600),
+          "UTF-8 characters are decoded to code points");
+    check(decode(decoder, "\xe2\x94").empty(), "partial UTF-8 waits");
+    ev = decode(decoder, "\x82");
+    check(ev.size() == 1 && is_key(ev[0], 0x2502), "split UTF-8 is joined");
+    ev = decode(decoder, "\xc3x");
+    check(ev.size() == 2 && is_key(ev[0], 0xc3) && is_key(ev[1], 'x'), "broken UTF-8 passes the bytes through");
+}
+
+// Raw mode restores the state of its own tty and leaves the saved original state alone
+void test_raw_mode()
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        std::cout << "events: no pty, raw mode not tested" << std::endl;
+        return;
+    }
+    int slave = ::open(ptsname(master), O_RDWR | O_NOCTTY);
+    check(slave >= 0, "pty opens");
+    if (slave < 0) return;
+
+    termios before{};
+    tcgetattr(slave, &before);
+    termios sentinel = before;
+    sentinel.c_cc[VEOF] = 'x';
+    original_term = sentinel;
+    {
+        InputReader reader(slave);
+        reader.enter_raw();
+        termios raw{};
+        tcgetattr(slave, &raw);
+        check(!(raw.c_lflag & (ICANON | ECHO)), "raw mode is entered");
+        reader.leave_raw();
+    }
+    termios after{};
+    tcgetattr(slave, &after);
+    check(after.c_lflag == before.c_lflag && after.c_cc[VEOF] == before.c_cc[VEOF], "leave_raw restores the tty");
+    check(original_term.c_cc[VEOF] == 'x', "enter_raw keeps the saved original state");
+    ::close(slave);
+    ::close(master);
+}
+
+// Invalidations between frames merge into one frame, frames are spaced by the fps cap, and an idle
+// scheduler does not shorten the wait. The clock is passed in, so nothing here sleeps
+void test_scheduler()
+{
+    using namespace std::chrono_literals;
+    FrameScheduler scheduler(60);
+    auto t0 = FrameScheduler::Clock::time_point{} + 10s;
+    check(scheduler.due(t0), "the first frame is due at once");
+    scheduler.rendered(t0);
+
+    check(!scheduler.dirty() && scheduler.timeout(-1, t0) == -1 && scheduler.timeout(500, t0) == 500,
+          "idle scheduler requests no wake-up");
+    for (int i = 0; i < 5; i++)
+        scheduler.invalidate();
+    check(!scheduler.due(t0 + 1ms), "the cap holds the next frame back");
+    check(scheduler.timeout(-1, t0 + 1ms) == 16 && scheduler.timeout(5, t0 + 1ms) == 5, "wake-up at the end of the interval");
+    check(scheduler.due(t0 + 17ms), "the frame is due after the interval");
+    scheduler.rendered(t0 + 17ms);
+    check(scheduler.frames() == 2 && !scheduler.due(t0 + 100ms), "several invalidations render one frame");
+
+    // Invalidated every millisecond for a second
+    std::size_t before = scheduler.frames();
+    for (auto t = t0 + 100ms; t < t0 + 1100ms; t += 1ms)
+    {
+        scheduler.invalidate();
+        if (scheduler.due(t))
+            scheduler.rendered(t);
+    }
+    std::size_t frames = scheduler.frames() - before;
+    check(frames >= 59 && frames <= 61, "60 fps cap");
+
+    scheduler.set_max_fps(0);
+    scheduler.invalidate();
+    check(scheduler.due(t0 + 1100ms) && scheduler.timeout(-1, t0 + 1100ms) == 0, "no cap renders at once");
+}
+
+// Items of each producer come out in the order they were pushed, none lost, while the consumer pops concurrently
+void test_mpsc()
+{
+    constexpr std::uint64_t producers = 4, per_producer = 100000;
+    MPSCQueue<std::uint64_t> queue;
+    std::vector<std::thread> threads;
+    for (std::uint64_t p = 0; p < producers; p++)
+        threads.emplace_back([&queue, p]
+        {
+            for (std::uint64_t i = 0; i < per_producer; i++)
+                queue.push(p << 32 | i);
+        });
+
+    std::vector<std::uint64_t> next(producers, 0);
+    std::uint64_t popped = 0, item;
+    bool ordered = true;
+    while (popped < producers * per_producer)
+    {
+        if (!queue.pop(item))
+            continue;
+        std::uint64_t p = item >> 32, i = item & 0xffffffff;
+        ordered = ordered && p < producers && i == next[p];
+        if (p < producers) next[p] = i + 1;
+        popped++;
+    }
+    for (auto& t : threads)
+        t.join();
+    check(ordered, "MPSCQueue keeps the order of each producer");
+    check(!queue.pop(item) && queue.empty(), "MPSCQueue delivers every item once");
+}
+
+static bool readable(int fd, int timeout_ms)
+{
+    pollfd p{fd, POLLIN, 0};
+    return poll(&p, 1, timeout_ms) == 1 && (p.revents & POLLIN);
+}
+
+// A post from another thread makes the wake fd readable, once per batch until apply()
+void test_update_wake()
+{
+    UpdateQueue<char> updates;
+    WindowStack<char> ws;
+    ws.push(Widget<char>(WidgetLayout::Vertical, {Widget<char>("before")}), 0, 7);
+    check(updates.wake_fd() >= 0 && !readable(updates.wake_fd(), 0), "wake fd starts empty");
+
+    std::thread worker([&updates] { updates.set_text(7, {0}, "first"); });
+    check(readable(updates.wake_fd(), 1000), "a post from another thread wakes the loop");
+    worker.join();
+    updates.consume_wake();
+    updates.set_text(7, {0}, "second");
+    check(!readable(updates.wake_fd(), 0), "one wake-up per batch");
+
+    check(updates.apply(ws) == 2 && ws.stack[0].at(0)._content == "second", "commands run in order");
+    updates.pop_window(7);
+    check(readable(updates.wake_fd(), 0), "posts after apply wake the loop again");
+    updates.consume_wake();
+    check(updates.apply(ws) == 1 && ws.stack.empty(), "windows are popped by id");
+}
+
+int main()
+{
+    test_decoder();
+    test_raw_mode();
+    test_scheduler();
+    test_mpsc();
+    test_update_wake();
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "events: OK" << std::endl;
+    return 0;
+}
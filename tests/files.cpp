@@ -0,0 +1,252 @@
+//
+// FileView: newline scan kernels, line indexing, following a growing file and how its bytes are shown
+//
+
+#include <cstdio>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "curse.h"
+
+using namespace curse;
+
+static int failures = 0;
+
+static void check(bool cond, const char* what)
+{
+    if (!cond)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+// Exposes the kernel picked by open(), and can hold the indexer after its first notification
+struct ProbeFile : FileView
+{
+    [[nodiscard]] NewlineScanFn scan() const { return _scan; }
+
+    void hold_first_notify(std::shared_future<void> release)
+    {
+        _notify = [notify = _notify, release, first = true]() mutable
+        {
+            notify();
+            if (first) release.wait();
+            first = false;
+        };
+    }
+};
+
+static std::string temp_path()
+{
+    char path[] = "/tmp/curse_files_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) close(fd);
+    return path;
+}
+
+static void write_file(const std::string& path, const std::string& data, bool append = false)
+{
+    std::ofstream f(path, append ? std::ios::binary | std::ios::app : std::ios::binary | std::ios::trunc);
+    f << data;
+}
+
+void test_kernels(std::mt19937& rng)
+{
+    const NewlineScanFn kernels[] = {select_newline_kernel(DiffKernel::SSE2), select_newline_kernel(DiffKernel::AVX2)};
+
+    for (int iter = 0; iter < 2000; iter++)
+    {
+        // Random offsets and lengths, so every kernel runs its tail and unaligned loads
+        std::string buf(rng() % 300, 'x');
+        int density = 1 + rng() % 20;
+        for (char& c : buf)
+            if (rng() % density == 0) c = '\n';
+        std::size_t from = buf.empty() ? 0 : rng() % buf.size();
+        std::uint64_t base = rng() % 1000;
+
+        std::vector<std::uint64_t> expected, found;
+        scan_newlines_scalar(buf.data() + from, buf.size() - from, base, expected);
+        for (NewlineScanFn kernel : kernels)
+        {
+            found.clear();
+            kernel(buf.data() + from, buf.size() - from, base, found);
+            check(found == expected, "newline scan matches the scalar kernel");
+        }
+    }
+}
+
+void test_lines()
+{
+    std::string path = temp_path();
+
+    write_file(path, "first\r\nsecond\n\nlast");
+    FileView file;
+    check(file.open(path.c_str()), "file opens");
+    file.wait();
+    check(file.lines() == 4, "a last line without a line break counts");
+    check(file.line(0) == "first", "CR LF is dropped");
+    check(file.line(1) == "second", "second line");
+    check(file.line(2).empty(), "empty line");
+    check(file.line(3) == "last", "last line");
+    check(file.line(4).empty(), "past the end is empty");
+
+    // More than one scan block, with every kernel
+    std::string big;
+    for (int i = 0; i < 200000; i++)
+        big += "line " + std::to_string(i) + "\n";
+    check(big.size() > 2 * FileView::scan_block, "spans several scan blocks");
+    write_file(path, big);
+    for (DiffKernel kernel : {DiffKernel::Scalar, DiffKernel::SSE2, DiffKernel::AVX2})
+    {
+        check(file.open(path.c_str(), kernel), "file opens again");
+        file.wait();
+        check(file.indexed() == big.size() && !file.indexing(), "whole file indexed");
+        check(file.lines() == 200000, "line count over blocks");
+        check(file.line(0) == "line 0" && file.line(123456) == "line 123456" && file.line(199999) == "line 199999",
+              "lines over blocks");
+    }
+
+    file.close();
+    check(!file.is_open() && file.lines() == 0, "closed file has no lines");
+    std::remove(path.c_str());
+}
+
+void test_poll()
+{
+    std::string path = temp_path();
+
+    write_file(path, "one\ntwo\n");
+    ProbeFile file;
+    check(file.open(path.c_str(), DiffKernel::Scalar), "file opens");
+    file.wait();
+    check(file.lines() == 2, "two lines");
+    check(file.poll(), "lines indexed since open() are a change");
+    check(!file.poll(), "nothing appended");
+
+    write_file(path, "three\nfou", true);
+    check(file.poll(), "appended data is seen");
+    file.wait();
+    check(file.lines() == 4 && file.line(2) == "three" && file.line(3) == "fou", "appended lines");
+
+    write_file(path, "r\nfive\n", true);
+    check(file.poll(), "the partial line is completed");
+    file.wait();
+    check(file.lines() == 5 && file.line(3) == "four" && file.line(4) == "five", "completed line");
+
+    // A list following the file stays on the last line
+    auto list = FileView::list(std::shared_ptr<FileView>(&file, [](FileView*) {}), Point{10, 2});
+    list->set_follow(true);
+    list->scroll_to(4);
+    Surface<ANSIColor, char> surface(2, 10);
+    list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    write_file(path, "six\n", true);
+    check(file.poll(), "another line");
+    file.wait();
+    list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    check(list->cursor() == 5, "the list follows the file");
+
+    // Shorter file: opened again, with the same kernel
+    write_file(path, "new\n");
+    check(file.poll(), "truncation is seen");
+    file.wait();
+    check(file.lines() == 1 && file.line(0) == "new", "lines of the shorter file");
+    check(file.scan() == scan_newlines_scalar, "the kernel is kept after opening again");
+
+    file.close();
+    std::remove(path.c_str());
+}
+
+static bool readable(int fd, int timeout_ms)
+{
+    pollfd p{fd, POLLIN, 0};
+    return poll(&p, 1, timeout_ms) == 1 && (p.revents & POLLIN);
+}
+
+// An attached file invalidates its pane as blocks are indexed, long before the whole file is
+void test_progress()
+{
+    std::string path = temp_path();
+    std::string big;
+    for (int i = 0; i < 300000; i++)
+        big += "entry " + std::to_string(i) + "\n";
+    write_file(path, big);
+
+    UpdateQueue<char> updates;
+    WindowStack<char> ws;
+    ProbeFile file;
+    ws.push(Widget<char>(WidgetLayout::Vertical, {Widget<char>(FileView::list(std::shared_ptr<FileView>(&file, [](FileView*) {}), {12, 3}))}), 0, 5);
+    ws.stack[0].layout();
+    file.attach(updates, 5, {0});
+    std::promise<void> release;
+    file.hold_first_notify(release.get_future().share());
+
+    check(file.open(path.c_str()), "file opens");
+    check(readable(updates.wake_fd(), 5000), "the first indexed block wakes the UI");
+    check(file.indexing() && file.indexed() == FileView::scan_block, "the indexer is held after its first block");
+    updates.consume_wake();
+    updates.apply(ws);
+    check(ws.stack[0].layout(), "the pane is laid out again while indexing runs");
+
+    Surface<ANSIColor, char> surface(3, 12);
+    ws.stack[0].at(0)._list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    std::string shown;
+    for (int x = 0; x < 7; x++)
+        shown += surface.at(x, 0).glyph;
+    check(shown == "entry 0", "indexed lines are shown before the rest");
+    release.set_value();
+
+    file.wait();
+    check(file.lines() == 300000, "the rest is indexed");
+    check(readable(updates.wake_fd(), 5000), "later blocks notify again");
+    file.close();
+    std::remove(path.c_str());
+}
+
+// Bytes that are not printable ASCII don't reach the cells as they are
+void test_printable()
+{
+    std::string path = temp_path();
+    write_file(path, "a\033[2Jb\tc\rd\xc3\xa9\x7f\n");
+    auto file = std::make_shared<FileView>();
+    check(file->open(path.c_str()), "file opens");
+    file->wait();
+
+    auto list = FileView::list(file, Point{20, 1});
+    Surface<ANSIColor, char> surface(1, 20);
+    list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    std::string shown;
+    for (int x = 0; x < 13; x++)
+        shown += surface.at(x, 0).glyph;
+    check(shown == "a [2Jb c d?? ", "controls become spaces and UTF-8 bytes '?'");
+    check(file->line(0)[1] == '\033', "the file itself is not changed");
+
+    surface.set_text(0, 0, "\033x", ANSIColor());
+    check(surface.at(0, 0).glyph == ' ' && surface.at(1, 0).glyph == 'x', "set_text too");
+
+    file->close();
+    std::remove(path.c_str());
+}
+
+int main()
+{
+    std::mt19937 rng(23);
+
+    test_kernels(rng);
+    test_lines();
+    test_poll();
+    test_progress();
+    test_printable();
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "files: OK" << std::endl;
+    return 0;
+}
@@ -0,0 +1,104 @@
+//
+// Parallel rasterization: frame time against the thread count, on a 4K-sized dashboard
+//
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "curse.h"
+
+using namespace curse;
+
+// Dense dashboard: a grid of boxed cells with a few lines of text each
+Widget<char> make_dashboard(int grid_rows, int grid_cols)
+{
+    std::vector<Widget<char>> rows;
+    for (int r = 0; r < grid_rows; r++)
+    {
+        std::vector<Widget<char>> cells;
+        for (int c = 0; c < grid_cols; c++)
+        {
+            std::vector<Widget<char>> lines;
+            lines.emplace_back("job " + std::to_string(r * grid_cols + c), Colors::Accent);
+            lines.emplace_back("cpu " + std::to_string((r * 7 + c * 13) % 100) + "%");
+            lines.emplace_back("mem " + std::to_string((r * 11 + c * 3) % 100) + "%");
+            Widget<char> cell(WidgetLayout::Vertical, lines, Colors::Primary, Quad(1, 0, 1, 0), Quad(0, 0, 0, 0),
+                              &SingleBoxStyle);
+            if ((r + c) % 5 == 0) cell.set_selectable(true);
+            cells.push_back(cell);
+        }
+        rows.emplace_back(WidgetLayout::Horizontal, cells);
+    }
+    // A list spanning several bands, which share its state while they draw it
+    auto log = std::make_shared<ListView<char>>([] { return std::size_t(5000); },
+                                                [](std::size_t i) { return "log line " + std::to_string(i); },
+                                                Point{40, 24});
+    log->scroll_to(2500);
+    rows.emplace_back(log, Colors::Primary, Quad(0, 0, 0, 0), &SingleBoxStyle);
+    return {WidgetLayout::Vertical, rows, Colors::Secondary, Quad(0, 0, 0, 0), Quad(0, 0, 0, 0), &DoubleBoxStyle,
+            ShadowStyle::Shadow};
+}
+
+int main()
+{
+    const int rows = 135, cols = 480; // 3840x2160 with an 8x16 font
+    const int frames = 30;
+
+    AppStyle<ANSIColor> style(
+        ANSIColor(ANSIColor::FG::Default, ANSIColor::BG::Default), // Primary
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Red), // Secondary
+        ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::BrightBlue), // Accent
+        ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::BrightBlue), // Accent 2
+        ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::BrightBlue), // Accent 3
+        ANSIColor(ANSIColor::FG::BrightWhite, ANSIColor::BG::BrightRed), // Selected
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Blue), // Inactive
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightBlue), // Disabled
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightRed), // BorderActive
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Blue), // BorderInactive
+        ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightBlue) // BorderDisabled
+    );
+    WindowStack<char> winstack;
+    winstack.push(make_dashboard(26, 40));
+    for (int i = 0; i < 4; i++)
+    {
+        Widget<char> popup = make_dashboard(4, 6);
+        popup._xy = {40 + 60 * i, 20 + 15 * i};
+        winstack.push(popup);
+    }
+
+    unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+    Surface<ANSIColor, char> reference(rows, cols), surface(rows, cols);
+    double base_ms = 0;
+    int mismatches = 0;
+
+    std::cout << "threads  ms/frame  speedup" << std::endl;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        WindowCompositor<ANSIColor, char> compositor;
+        compositor.set_threads(threads);
+
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; f++)
+        {
+            compositor.invalidate_all(); // Rasterize everything, as after a palette change
+            surface.clear();
+            compositor.render_all(winstack, surface, style);
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+
+        if (threads == 1)
+        {
+            base_ms = ms;
+            std::copy(surface.cells().begin(), surface.cells().end(), reference.cells().begin());
+        }
+        else if (!std::equal(surface.cells().begin(), surface.cells().end(), reference.cells().begin()))
+        {
+            std::cerr << "FAIL: " << threads << " threads differ from the serial output" << std::endl;
+            mismatches++;
+        }
+
+        std::cout << threads << "        " << ms << "  " << base_ms / ms << "x" << std::endl;
+    }
+    return mismatches ? 1 : 0;
+}
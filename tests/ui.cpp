@@ -6,6 +6,7 @@
 #include <vector>
 #include <array>
 #include <sstream>
+#include <thread>
 
 #include "curse.h"
 
@@ -56,7 +57,7 @@ using namespace curse;
 
     // Layout and render
     root.layout();
-    root.render(printer._output_matrix, printer._color_matrix, 0, 0);
+    root.render(printer.surface(), 0, 0);
     printer.render_matrix();
 
     std::cin.ignore();
@@ -65,7 +66,7 @@ using namespace curse;
 template<class TChar>
 void test_popup_windows()
 {
-    CurseTerminal<ANSIColor, TChar> terminal(std::cout);
+    CurseTerminal<ANSIColor, TChar> terminal(std::cout, CurseTerminal<ANSIColor, TChar>::tty_fd());
     terminal.init_renderer();
     //int term_w = terminal.get_terminal_width();
     //int term_h = terminal.get_terminal_height();
@@ -95,7 +96,7 @@ void test_popup_windows()
         Widget<TChar> close_btn("[X]", Colors::Accent, Quad(0, 0, 0, 0), &single_box, ShadowStyle::None);
         close_btn.set_selectable(true);
         close_btn.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev,
-                                const std::vector<int>& path) -> bool
+                                const WidgetPath& path) -> bool
         {
             if (ev.type == EventType::Select || ev.type == EventType::Click)
             {
@@ -107,7 +108,7 @@ void test_popup_windows()
         Widget<TChar> open_btn("[open]");
         open_btn.set_selectable(true);
         open_btn.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev,
-                               const std::vector<int>& path) -> bool
+                               const WidgetPath& path) -> bool
         {
             if ((ev.type == EventType::Select || ev.type == EventType::Click) && window)
             {
@@ -116,7 +117,7 @@ void test_popup_windows()
                                     ShadowStyle::None);
                 close_btn2.set_selectable(true);
                 close_btn2.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev,
-                                         const std::vector<int>& path) -> bool
+                                         const WidgetPath& path) -> bool
                 {
                     if (ev.type == EventType::Select || ev.type == EventType::Click)
                     {
@@ -132,7 +133,7 @@ void test_popup_windows()
                                 }, Colors::Primary, Quad(2, 2, 2, 2), Quad(1, 1, 1, 1), nullptr,
                                 ShadowStyle::Shadow, {10, 5});
                 popup2.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev,
-                                     const std::vector<int>& path) -> bool
+                                     const WidgetPath& path) -> bool
                 {
                     if (ev.type == EventType::OnCreate)
                     {
@@ -153,7 +154,7 @@ void test_popup_windows()
                                     nullptr, ShadowStyle::None)
                        }, Colors::Primary, Quad(2, 2, 2, 2), Quad(1, 1, 1, 1), &double_box,
                        ShadowStyle::Shadow, {5 * i, 3 * i});
-        popup.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev, const std::vector<int>& path) -> bool
+        popup.on_event = [](Widget<TChar>* self, WindowStack<TChar>* window, const IPEvent& ev, const WidgetPath& path) -> bool
         {
             if (ev.type == EventType::OnCreate)
             {
@@ -165,7 +166,40 @@ void test_popup_windows()
         winstack.push(popup);
     }
 
-    auto get_debug_text = [](WindowStack<TChar>& win)
+    // Virtualized list: a million rows, only the visible ones are ever fetched
+    auto rows = std::make_shared<ListView<TChar>>([] { return std::size_t(1000000); },
+                                                  [](std::size_t i) { return "row " + std::to_string(i); },
+                                                  Point{24, 8});
+    winstack.push(Widget<TChar>(WidgetLayout::Vertical, {
+                                    Widget<TChar>("Rows (PgUp/PgDn/Home/End)"),
+                                    Widget<TChar>(rows, Colors::Primary, Quad(0, 0, 0, 0), &single_box)
+                                }, Colors::Primary, Quad(2, 1, 2, 1), Quad(0, 0, 0, 0), &double_box,
+                                ShadowStyle::Shadow, {40, 2}));
+
+    // Streaming log: a worker appends lines, the pane takes them once per frame and scrolls
+    auto log = std::make_shared<LogBuffer<TChar>>(1 << 16, 1000);
+    winstack.push(Widget<TChar>(WidgetLayout::Vertical, {
+                                    Widget<TChar>("Log"),
+                                    Widget<TChar>(LogBuffer<TChar>::list(log, Point{30, 6}), Colors::Primary,
+                                                  Quad(0, 0, 0, 0), &single_box)
+                                }, Colors::Primary, Quad(2, 1, 2, 1), Quad(0, 0, 0, 0), &double_box,
+                                ShadowStyle::Shadow, {40, 14}), 0, 1);
+    UpdateQueue<TChar> updates;
+    log->attach(updates, 1, {1});
+    std::atomic_bool stop_worker = false;
+    std::thread worker([&]
+    {
+        for (int i = 0; !stop_worker; i++)
+        {
+            std::basic_string<TChar> line;
+            for (char c : "event " + std::to_string(i) + " handled\n")
+                line += TChar(c);
+            log->append(std::move(line));
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    });
+
+    static auto get_debug_text = [](WindowStack<TChar>& win)
     {
         std::ostringstream dbg;
         dbg << "selector_idx: " << win.selector_idx << "; ";
@@ -194,51 +228,49 @@ void test_popup_windows()
 
     //terminal.init_matrix(term_h, term_w);
 
-    // Main event loop
-    while (!winstack.stack.empty())
+    EventLoop<ANSIColor, TChar> loop(terminal, winstack, style);
+    loop.attach(updates);
+
+    loop.on_render = [](EventLoop<ANSIColor, TChar>& loop)
     {
         // --- Debug overlay window ---
-        winstack.overlays[0].set_text(get_debug_text(winstack));
-        // --- End debug overlay ---
-
-        terminal.update_terminal_size();
-        terminal.reset_output_matrix();
-        winstack.render_all(terminal._output_matrix, terminal._color_matrix, style);
-        winstack.render_overlays(terminal._output_matrix, terminal._color_matrix, style);
-        terminal.render_matrix();
-
-        int c = terminal.getch();
-        if (c == 'q') break;
-        if (c == '\t')
+        loop.windows().overlays[0].set_text(get_debug_text(loop.windows()));
+    };
+
+    loop.on_event = [](EventLoop<ANSIColor, TChar>& loop, const IPEvent& ev) -> bool
+    {
+        if (ev.type != EventType::Click) return false;
+        WindowStack<TChar>& winstack = loop.windows();
+        switch (ev.key)
         {
+        case 'q':
+            loop.quit();
+            return true;
+        case '\t':
             winstack.move_selector_tab(1);
-            continue;
-        }
-        if (c == 'x')
-        {
+            return true;
+        case 'd':
+            // Show what gets diffed each frame
+            loop.terminal().set_debug_damage(!loop.terminal()._debug_damage,
+                                             ANSIColor(ANSIColor::FG::None, ANSIColor::BG::Magenta));
+            return true;
+        case 'x':
             winstack.pop(winstack.selector_idx);
-            continue;
-        }
-        if (c == 10 || c == ' ')
-        {
+            return true;
+        case 10:
+        case ' ':
             // Enter or space
             winstack.handle_event(IPEvent(EventType::Select));
-            continue;
-        }
-        if (c == 27)
-        {
-            // Escape sequence for arrows
-            int c2 = terminal.getch();
-            if (c2 == '[')
-            {
-                int c3 = terminal.getch();
-                if (c3 == 'A') winstack.handle_event(IPEvent(EventType::ArrowUp));
-                else if (c3 == 'B') winstack.handle_event(IPEvent(EventType::ArrowDown));
-                else if (c3 == 'C') winstack.handle_event(IPEvent(EventType::ArrowRight));
-                else if (c3 == 'D') winstack.handle_event(IPEvent(EventType::ArrowLeft));
-            }
+            return true;
+        default:
+            return false;
         }
-    }
+    };
+
+    // Main event loop
+    while (!winstack.stack.empty() && loop.poll_once(-1)) {}
+    stop_worker = true;
+    worker.join();
 }
 
 
@@ -0,0 +1,553 @@
+//
+// Retained window rendering against immediate rendering
+//
+
+#include <functional>
+#include <iostream>
+#include <random>
+
+#include "curse.h"
+
+using namespace curse;
+
+static int failures = 0;
+
+static void check(bool cond, const char* what)
+{
+    if (!cond)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+static const AppStyle<ANSIColor> style(
+    ANSIColor(ANSIColor::FG::Default, ANSIColor::BG::Default), // Primary
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Red), // Secondary
+    ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::BrightBlue), // Accent
+    ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::Cyan), // Accent 2
+    ANSIColor(ANSIColor::FG::BrightBlack, ANSIColor::BG::Green), // Accent 3
+    ANSIColor(ANSIColor::FG::BrightWhite, ANSIColor::BG::BrightRed), // Selected
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Blue), // Inactive
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightBlue), // Disabled
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightRed), // BorderActive
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::Blue), // BorderInactive
+    ANSIColor(ANSIColor::FG::White, ANSIColor::BG::BrightBlue) // BorderDisabled
+);
+
+static bool same(const Surface<ANSIColor, char>& a, const Surface<ANSIColor, char>& b)
+{
+    return std::equal(a.cells().begin(), a.cells().end(), b.cells().begin(), b.cells().end());
+}
+
+// A few popups with buttons, boxes and shadows
+static void build(WindowStack<char>& ws)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        Widget<char> close_btn("[X]", Colors::Accent, Quad(0, 0, 0, 0), &SingleBoxStyle);
+        close_btn.set_selectable(true);
+        Widget<char> open_btn("[open]");
+        open_btn.set_selectable(true);
+        ws.push(Widget<char>(WidgetLayout::Vertical, {
+                                 close_btn, open_btn,
+                                 Widget<char>("Popup window " + std::to_string(i + 1), Colors::Primary, Quad(1, 1, 1, 1))
+                             }, Colors::Primary, Quad(2, 2, 2, 2), Quad(1, 1, 1, 1), &DoubleBoxStyle,
+                             ShadowStyle::Shadow, {5 * i, 3 * i}));
+    }
+    Widget<char> fill("fill", Colors::Secondary, Quad(1, 0, 1, 0), &SingleBoxStyle, ShadowStyle::Fill);
+    fill._xy = {20, 2};
+    ws.push(Widget<char>({50, 10}, {fill, Widget<char>("sub", Colors::Accent2)}, Colors::Accent, Quad(1, 1, 1, 1),
+                         Quad(0, 0, 0, 0), nullptr, ShadowStyle::Shadow));
+}
+
+// Cached windows must be redrawn after every kind of change, and only reused while nothing changed
+void test_compositor()
+{
+    WindowStack<char> ws;
+    build(ws);
+    WindowCompositor<ANSIColor, char> compositor;
+    Surface<ANSIColor, char> retained(40, 120), immediate(40, 120);
+    std::mt19937 rng(3);
+
+    for (int frame = 0; frame < 200; frame++)
+    {
+        switch (rng() % 6)
+        {
+        case 0: // Layout change
+            ws.stack[rng() % 3].at(2).set_text(std::string(1 + rng() % 20, 'a' + rng() % 26));
+            break;
+        case 1: // Selection
+            ws.handle_event(IPEvent(rng() % 2 ? EventType::ArrowDown : EventType::ArrowUp));
+            break;
+        case 2: // Active window
+            ws.move_selector_tab(1);
+            break;
+        case 3: // Move
+            ws.stack[rng() % ws.stack.size()]._xy = {static_cast<int>(rng() % 60) - 5, static_cast<int>(rng() % 20) - 3};
+            break;
+        default: // Nothing, the cache is used as is
+            break;
+        }
+        retained.clear();
+        compositor.render_all(ws, retained, style);
+        immediate.clear();
+        ws.render_all(immediate, style);
+        if (!same(retained, immediate))
+        {
+            check(false, "composed frame matches render_all");
+            break;
+        }
+    }
+}
+
+// Every window painted in z-order, nothing culled
+static void render_unculled(WindowStack<char>& ws, Surface<ANSIColor, char>& surface)
+{
+    std::vector<int> order;
+    ws.z_order(order);
+    for (int idx : order)
+    {
+        ws.stack[idx].layout();
+        bool active = idx == ws.selector_idx;
+        Point pos = ws.window_pos(idx);
+        ws.stack[idx].render(surface, style, active, false, pos.x(), pos.y(), ANSIColor::None(), true, {},
+                             active ? &ws.selection_paths[idx] : nullptr);
+    }
+}
+
+// Windows under an opaque window are skipped whole or blitted in the visible spans only
+void test_occlusion()
+{
+    WindowStack<char> ws;
+    ws.push(Widget<char>("hidden below", Colors::Secondary, Quad(0, 0, 0, 0), &SingleBoxStyle, ShadowStyle::Shadow));
+    ws.push(Widget<char>("partly covered window", Colors::Accent, Quad(1, 1, 1, 1), &DoubleBoxStyle, ShadowStyle::Shadow));
+    ws.push(Widget<char>(WidgetLayout::Vertical, {Widget<char>("opaque cover")}, Colors::Inactive, Quad(2, 1, 30, 8),
+                         Quad(0, 0, 0, 0), &SingleBoxStyle, ShadowStyle::Shadow));
+    ws.stack[0]._xy = {6, 4};
+    ws.stack[1]._xy = {26, 6};
+    ws.stack[2]._xy = {0, 0};
+
+    WindowCompositor<ANSIColor, char> compositor;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        Surface<ANSIColor, char> culled(30, 90), composed(30, 90), reference(30, 90);
+        ws.render_all(culled, style);
+        compositor.render_all(ws, composed, style);
+        render_unculled(ws, reference);
+
+        std::vector<int> order;
+        std::vector<Quad> opaque;
+        std::vector<std::pair<int, int>> spans, scratch;
+        ws.layout_all(order, opaque);
+        bool covered = fully_covered(WindowStack<char>::paint_rect(ws.stack[0], ws.window_pos(0)),
+                                     std::span<const Quad>(opaque).subspan(1), spans, scratch);
+        check(pass > 0 || covered, "the first window is fully covered");
+        check(same(culled, reference), "culled render_all matches painting every window");
+        check(same(composed, reference), "composed frame matches painting every window");
+
+        ws.stack[2]._xy = {40, 12}; // Uncover most of it
+    }
+}
+
+// Floating children, boxes, shadows and a list, nested
+static Widget<char> mixed_tree()
+{
+    auto list = std::make_shared<ListView<char>>([] { return std::size_t(50); },
+                                                 [](std::size_t i) { return "row " + std::to_string(i); }, Point{12, 4});
+    Widget<char> shadowed("shadow", Colors::Accent2, Quad(1, 0, 1, 0), &SingleBoxStyle, ShadowStyle::Shadow);
+    shadowed._xy = {3, 1};
+    Widget<char> filled("fill", Colors::Secondary, Quad(0, 0, 0, 0), nullptr, ShadowStyle::Fill);
+    filled._xy = {14, 0};
+    Widget<char> floating({0, 0}, {shadowed, filled, Widget<char>("plain", Colors::Accent3)}, Colors::Accent,
+                          Quad(1, 1, 1, 1), Quad(0, 0, 0, 0), &DoubleBoxStyle);
+    Widget<char> button("[ok]", Colors::Primary, Quad(0, 0, 0, 0), &SingleBoxStyle);
+    button.set_selectable(true);
+    return Widget<char>(WidgetLayout::Vertical, {
+                            Widget<char>(WidgetLayout::Horizontal, {button, Widget<char>(list, Colors::Primary,
+                                                                        Quad(1, 0, 0, 0), &SingleBoxStyle)},
+                                         Colors::Primary, Quad(0, 0, 0, 0), Quad(1, 0, 1, 0)),
+                            floating,
+                            Widget<char>("footer", Colors::Inactive, Quad(2, 0, 2, 0), nullptr, ShadowStyle::Shadow)
+                        }, Colors::Primary, Quad(1, 1, 1, 1), Quad(0, 1, 0, 1), &DoubleBoxStyle, ShadowStyle::Shadow);
+}
+
+// Handle of the node at path under root
+static WidgetHandle tree_at(WidgetTree<char>& tree, WidgetHandle root, const WidgetPath& path)
+{
+    WidgetHandle h = root;
+    for (std::size_t d = 0; d < path.size(); d++)
+    {
+        std::uint32_t c = tree.get(h)->first_child;
+        for (int i = 0; i < path[d]; i++)
+            c = tree.get(tree.handle(c))->next_sibling;
+        h = tree.handle(c);
+    }
+    return h;
+}
+
+// Every widget from w up to the root is marked for layout
+static bool dirty_to_root(const Widget<char>& w)
+{
+    for (const Widget<char>* p = &w; p; p = p->_parent)
+        if (!p->_layout_dirty) return false;
+    return true;
+}
+
+// layout() recomputes the widgets from a changed one up to the root and keeps the sizes of the rest
+void test_layout()
+{
+    Widget<char> root = mixed_tree();
+    check(root.layout(), "a new tree is laid out");
+    check(!root.layout(), "a clean tree is not laid out again");
+
+    Widget<char>& floating = root.at(1);
+    Widget<char>& text = floating.at(2);
+    Widget<char>& sibling = floating.at(0);
+    Widget<char>& row = root.at(0);
+    std::size_t root_gen = root._layout_gen, floating_gen = floating._layout_gen, text_gen = text._layout_gen;
+    std::size_t sibling_gen = sibling._layout_gen, row_gen = row._layout_gen, button_gen = row.at(0)._layout_gen;
+    text.set_text("a longer text than before");
+    check(dirty_to_root(text) && !sibling._layout_dirty && !row._layout_dirty, "set_text marks only the path to the root");
+    check(root.layout(), "a changed tree is laid out");
+    check(text._layout_gen == text_gen + 1 && floating._layout_gen == floating_gen + 1 && root._layout_gen == root_gen + 1,
+          "the path to the root is recomputed");
+    check(sibling._layout_gen == sibling_gen && row._layout_gen == row_gen && row.at(0)._layout_gen == button_gen,
+          "the other subtrees keep their sizes");
+
+    Widget<char> fresh = mixed_tree();
+    fresh.at(1).at(2).set_text("a longer text than before");
+    fresh.layout();
+    check(fresh._wh == root._wh && fresh.at(1)._wh == floating._wh, "sizes match a full layout");
+
+    // Every setter that changes the size marks all the ancestors
+    Widget<char>& leaf = floating.at(0);
+    const std::function<void(Widget<char>&)> changes[] = {
+        [](Widget<char>& w) { w.set_margin(Quad(2, 1, 2, 1)); },
+        [](Widget<char>& w) { w.set_padding(Quad(1, 1, 1, 1)); },
+        [](Widget<char>& w) { w.set_box_style(&DoubleBoxStyle); },
+        [](Widget<char>& w) { w.add_child(Widget<char>("added")); },
+    };
+    for (const auto& change : changes)
+    {
+        root.layout();
+        change(leaf);
+        check(dirty_to_root(leaf), "a setter marks every ancestor");
+        check(root.layout() && !dirty_to_root(leaf), "and the tree is laid out again");
+    }
+
+    // A widget that is already dirty still marks its clean ancestors
+    root.layout();
+    leaf._layout_dirty = true;
+    leaf.invalidate();
+    check(dirty_to_root(leaf) && root.layout(), "invalidate() walks past a dirty widget");
+}
+
+// The flat tree renders cell for cell what the Widget it was imported from renders
+void test_tree_render()
+{
+    Widget<char> widget = mixed_tree();
+    WidgetTree<char> tree;
+    WidgetHandle root = tree.import(widget);
+    WidgetPath footer{2}, text{1, 2}, selected{0, 0};
+
+    for (int step = 0; step < 3; step++)
+    {
+        widget.layout();
+        tree.layout(root);
+        for (bool active : {true, false})
+        {
+            Surface<ANSIColor, char> expected(30, 60), actual(30, 60);
+            widget.render(expected, style, active, false, 3, 2, ANSIColor::None(), true, {}, &selected);
+            tree.render(root, actual, style, active, false, 3, 2, tree_at(tree, root, selected));
+            check(same(expected, actual), "WidgetTree renders like Widget::render");
+        }
+
+        // Relayout after text changes, wider and narrower
+        std::string grown(6 + 8 * step, 'x');
+        widget.at(2).set_text(grown);
+        tree.set_text(tree_at(tree, root, footer), grown);
+        widget.at(1).at(2).set_text(grown.substr(0, 2));
+        tree.set_text(tree_at(tree, root, text), grown.substr(0, 2));
+    }
+}
+
+// Handles to removed nodes are rejected, also after their slot is reused
+void test_tree_handles()
+{
+    WidgetTree<char> tree;
+    WidgetHandle root = tree.import(mixed_tree());
+    WidgetHandle floating = tree_at(tree, root, {1});
+    WidgetHandle inner = tree_at(tree, root, {1, 0});
+    std::size_t before = tree.size();
+
+    tree.remove(floating);
+    check(!tree.valid(floating) && !tree.valid(inner), "removed subtree handles are stale");
+    check(tree.size() == before - 4, "removed subtree is freed");
+    check(tree.get(root)->children == 2, "parent unlinks the removed child");
+
+    WidgetHandle reused = tree.add_text(root, "reused");
+    check(reused.index < before, "free slot is reused");
+    check(tree.valid(reused) && !tree.valid(floating) && !tree.valid(inner), "reused slot does not revive old handles");
+
+    tree.set_text(inner, "stale");
+    tree.remove(floating);
+    tree.invalidate(inner);
+    check(tree.add(floating, {}).isna(), "adding under a stale parent fails");
+    check(tree.get(reused)->_content == "reused" && tree.size() == before - 3, "stale handles change nothing");
+
+    Surface<ANSIColor, char> surface(10, 10), blank(10, 10);
+    tree.render(inner, surface, style, true, false, 0, 0);
+    check(same(surface, blank), "rendering a stale root draws nothing");
+}
+
+static int leaf_events = 0;
+
+static bool count_leaf(Widget<char>*, WindowStack<char>*, const IPEvent&, const WidgetPath&)
+{
+    leaf_events++;
+    return false;
+}
+
+static Widget<char> event_window()
+{
+    Widget<char> leaf("[leaf]");
+    leaf.set_selectable(true);
+    leaf.on_event = count_leaf;
+    return Widget<char>(WidgetLayout::Vertical, {Widget<char>(WidgetLayout::Vertical, {leaf})});
+}
+
+// Capture handlers that rebuild the tree and let the event through
+static bool drop_children(Widget<char>* w, WindowStack<char>*, const IPEvent& e, const WidgetPath&)
+{
+    if (e.phase == EventPhase::Capture)
+        w->_children.clear();
+    return false;
+}
+
+static bool rebuild_children(Widget<char>* w, WindowStack<char>*, const IPEvent& e, const WidgetPath&)
+{
+    if (e.phase == EventPhase::Capture)
+        w->_children = event_window()._children;
+    return false;
+}
+
+// The capture walk follows the tree as the handlers left it
+void test_capture_changes()
+{
+    WindowStack<char> ws;
+    ws.capture_events = true;
+    ws.push(event_window());
+    ws.selection_paths[ws.selector_idx] = {0, 0};
+
+    ws.stack[0].on_event = rebuild_children;
+    leaf_events = 0;
+    ws.handle_event(IPEvent(EventType::Click, 'x'));
+    check(leaf_events == 2, "rebuilt path is walked down again");
+
+    ws.stack[0].on_event = drop_children;
+    leaf_events = 0;
+    check(!ws.handle_event(IPEvent(EventType::Click, 'x')) && leaf_events == 0, "removed path drops the event");
+}
+
+// Nearest item by scanning all of them: cone candidates first, then the half plane
+static int nearest_brute(const std::vector<FocusIndex<char>::Item>& items, int from, EventType dir)
+{
+    auto cx = [](const auto& it) { return it.rect.l() + it.rect.r(); };
+    auto cy = [](const auto& it) { return it.rect.t() + it.rect.b(); };
+    long long px = from >= 0 ? cx(items[from]) : 0, py = from >= 0 ? cy(items[from]) : 0;
+    long long cone_dist = std::numeric_limits<long long>::max(), half_dist = cone_dist;
+    int cone = -1, half = -1;
+    for (int i = 0; i < (int)items.size(); i++)
+    {
+        if (i == from) continue;
+        long long dx = cx(items[i]) - px, dy = cy(items[i]) - py;
+        long long along = dir == EventType::ArrowUp ? -dy : dir == EventType::ArrowDown ? dy : dir == EventType::ArrowLeft ? -dx : dx;
+        long long across = (dir == EventType::ArrowUp || dir == EventType::ArrowDown) ? dx : dy;
+        if (along <= 0) continue;
+        long long d = dx * dx + dy * dy;
+        if (along >= std::abs(across))
+        {
+            if (d < cone_dist) { cone_dist = d; cone = i; }
+        }
+        else if (d < half_dist)
+        {
+            half_dist = d;
+            half = i;
+        }
+    }
+    return cone >= 0 ? cone : half;
+}
+
+static void check_nearest(const Widget<char>& root, std::mt19937& rng, const char* what)
+{
+    FocusIndex<char> index;
+    index.build(root, 1);
+    const auto& items = index.items();
+    for (int q = 0; q < 2000 && !items.empty(); q++)
+    {
+        int from = static_cast<int>(rng() % (items.size() + 1)) - 1;
+        auto dir = static_cast<EventType>(static_cast<int>(EventType::ArrowUp) + rng() % 4);
+        if (index.nearest(from, dir) != nearest_brute(items, from, dir))
+        {
+            check(false, what);
+            return;
+        }
+    }
+}
+
+// Directional moves pick what a full scan picks, on grids of uneven cells and with only half plane candidates
+void test_focus()
+{
+    std::mt19937 rng(5);
+    for (int trial = 0; trial < 20; trial++)
+    {
+        std::vector<Widget<char>> rows;
+        for (int r = 0, n = 1 + rng() % 40; r < n; r++)
+        {
+            std::vector<Widget<char>> cells;
+            for (int c = 0, m = 1 + rng() % 30; c < m; c++)
+            {
+                Widget<char> cell(std::string(1 + rng() % 6, 'a'));
+                cell.set_selectable(rng() % 3 != 0);
+                cells.push_back(cell);
+            }
+            rows.push_back(Widget<char>(WidgetLayout::Horizontal, cells, Colors::Primary, Quad(0, 0, 0, 0),
+                                        Quad(rng() % 3, 0, rng() % 2, 0)));
+        }
+        Widget<char> root(WidgetLayout::Vertical, rows, Colors::Primary, Quad(0, 0, 0, 0), Quad(0, rng() % 2, 0, rng() % 2),
+                          &SingleBoxStyle);
+        root.layout();
+        check_nearest(root, rng, "FocusIndex::nearest matches a full scan on a grid");
+    }
+
+    // Zigzag column: sideways moves only ever find half plane candidates
+    std::vector<Widget<char>> zigzag;
+    for (int r = 0; r < 200; r++)
+    {
+        Widget<char> item("ab");
+        item.set_selectable(true);
+        item._xy = {(r % 2) * 3, r * 4};
+        zigzag.push_back(item);
+    }
+    Widget<char> root({0, 0}, zigzag);
+    root.layout();
+    check_nearest(root, rng, "FocusIndex::nearest matches a full scan with only half plane candidates");
+}
+
+static int fetches = 0;
+
+static std::shared_ptr<ListView<char>> counting_list(std::size_t& rows, Point viewport, std::size_t cache_rows)
+{
+    return std::make_shared<ListView<char>>([&rows] { return rows; },
+                                            [](std::size_t i) { fetches++; return "row " + std::to_string(i); },
+                                            viewport, cache_rows);
+}
+
+// Rows are fetched once while cached, the least recently used one goes first. Keys move the cursor and
+// the viewport follows, also when the rows go away
+void test_list_view()
+{
+    std::size_t rows = 100;
+    auto list = counting_list(rows, {10, 3}, 8);
+    fetches = 0;
+    for (std::size_t i = 0; i < 8; i++)
+        (void)list->row(i);
+    (void)list->row(0); // Most recent again
+    (void)list->row(8); // Evicts row 1, the least recently used
+    check(fetches == 9, "each row is fetched once");
+    (void)list->row(0);
+    check(fetches == 9, "recently used row stays cached");
+    (void)list->row(1);
+    check(fetches == 10, "least recently used row was evicted at capacity");
+
+    auto key = [&](Key k) { return list->handle_event(IPEvent(EventType::Click, static_cast<int>(k))); };
+    check(key(Key::PageDown) && list->cursor() == 3 && list->top() == 1, "PageDown moves a page");
+    check(key(Key::End) && list->cursor() == 99 && list->top() == 97, "End goes to the last row");
+    check(!key(Key::End) && !list->handle_event(IPEvent(EventType::ArrowDown)), "keys at the last row are not used");
+    check(key(Key::PageUp) && list->cursor() == 96 && list->top() == 96, "PageUp moves a page");
+    check(key(Key::Home) && list->cursor() == 0 && list->top() == 0, "Home goes to the first row");
+    check(!list->handle_event(IPEvent(EventType::ArrowUp)), "ArrowUp at the first row is not used");
+
+    list->scroll_to(50);
+    rows = 10;
+    Surface<ANSIColor, char> surface(5, 20);
+    list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    check(list->cursor() == 9 && list->top() == 7, "cursor and viewport are clamped to fewer rows");
+    rows = 0;
+    list->render(surface, 0, 0, ANSIColor(), ANSIColor());
+    check(list->cursor() == 0 && list->top() == 0 && !list->handle_event(IPEvent(EventType::ArrowDown)),
+          "empty list");
+}
+
+static bool drop_on_bubble(Widget<char>* w, WindowStack<char>*, const IPEvent& e, const WidgetPath&)
+{
+    if (e.phase == EventPhase::Bubble && e.type == EventType::ArrowDown)
+        w->_children.clear();
+    return false;
+}
+
+// Arrows move the list cursor, and the focus once the cursor is at an edge
+void test_list_focus()
+{
+    std::size_t rows = 3;
+    auto list = counting_list(rows, {10, 2}, 16);
+    Widget<char> title("title");
+    title.set_selectable(true);
+    WindowStack<char> ws;
+    ws.push(Widget<char>(WidgetLayout::Vertical, {title, Widget<char>(list)}));
+    ws.selection_paths[0] = {1};
+
+    check(ws.handle_event(IPEvent(EventType::ArrowDown)) && list->cursor() == 1, "arrow moves the list cursor");
+    ws.handle_event(IPEvent(EventType::ArrowDown));
+    check(list->cursor() == 2 && ws.selection_paths[0] == WidgetPath{1}, "focus stays while the cursor moves");
+    ws.handle_event(IPEvent(EventType::Click, static_cast<int>(Key::Home)));
+    ws.handle_event(IPEvent(EventType::ArrowUp));
+    check(list->cursor() == 0 && ws.selection_paths[0] == WidgetPath{0}, "arrow at the edge moves the focus out");
+
+    // A handler that removes the list before it gets the key
+    ws.selection_paths[0] = {1};
+    ws.stack[0].on_event = drop_on_bubble;
+    check(!ws.handle_event(IPEvent(EventType::ArrowDown)) && ws.stack[0]._children.empty(),
+          "removed list does not get the key");
+}
+
+// A path deeper than CURSE_MAX_DEPTH throws instead of dropping levels
+void test_path_depth()
+{
+    WidgetPath path;
+    for (std::size_t i = 0; i < WidgetPath::capacity; i++)
+        path.push_back(0);
+    bool thrown = false;
+    try
+    {
+        path.push_back(0);
+    }
+    catch (const std::length_error&)
+    {
+        thrown = true;
+    }
+    check(thrown && path.size() == WidgetPath::capacity, "push_back past capacity throws");
+}
+
+int main()
+{
+    test_compositor();
+    test_occlusion();
+    test_layout();
+    test_tree_render();
+    test_tree_handles();
+    test_capture_changes();
+    test_focus();
+    test_list_view();
+    test_list_focus();
+    test_path_depth();
+
+    if (failures)
+    {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "widgets: OK" << std::endl;
+    return 0;
+}